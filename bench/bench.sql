@@ -0,0 +1,71 @@
+-- Microbenchmarks of the normalization hot path.
+--
+-- Prints one CSV row per case, tagged with the commit and server version so
+-- that results of different builds can be put side by side.  Run through
+-- "make bench", or directly with
+--
+--   psql -X -v commit=$(git rev-parse --short HEAD) -f bench/bench.sql
+--
+-- Every case runs about as long as iterations calls on 1kB of query text
+-- would, and at least ten times.  Set the iterations variable to trade
+-- precision for run time.
+
+\set ON_ERROR_STOP 1
+\if :{?commit}
+\else
+\set commit unknown
+\endif
+\if :{?iterations}
+\else
+\set iterations 1000
+\endif
+
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS pg_normalize_query;
+RESET client_min_messages;
+
+COPY (
+	WITH literals(name, literal) AS (
+		VALUES ('integer', '42'),
+			   ('string', '''abc'''),
+			   ('dollar', '$q$abc$q$'),
+			   ('unicode', 'U&''d\0061t'''),
+			   ('bit', 'B''1010'''),
+			   ('hex', 'X''1F''')
+	),
+	cases(name, constants, depth, query) AS (
+		-- An IN list of constants of each kind
+		SELECT l.name, c.n, 0,
+			   'SELECT * FROM foo WHERE a IN (' ||
+			   array_to_string(array_fill(l.literal, ARRAY[c.n]), ', ') || ')'
+		  FROM literals l, (VALUES (1), (10), (1000), (10000)) c(n)
+		UNION ALL
+		-- Nested expressions around a single constant
+		SELECT 'nested', 1, d.n,
+			   'SELECT ' || repeat('(', d.n) || '1' || repeat(')', d.n)
+		  FROM (VALUES (1), (10), (100), (1000)) d(n)
+		UNION ALL
+		-- Long queries with a single constant
+		SELECT 'columns', 1, 0,
+			   'SELECT ' || (SELECT string_agg('c' || i, ', ')
+							   FROM generate_series(1, w.n) i) ||
+			   ' FROM foo WHERE id = 1'
+		  FROM (VALUES (10), (1000), (10000)) w(n)
+	)
+	SELECT :'commit' AS commit,
+		   current_setting('server_version_num') AS server_version,
+		   c.name AS case,
+		   c.constants,
+		   c.depth,
+		   octet_length(c.query) AS query_bytes,
+		   m.lexer_only,
+		   b.calls,
+		   round(b.ns_per_call::numeric, 1) AS ns_per_call,
+		   b.bytes_per_call
+	  FROM cases c,
+		   (VALUES (false), (true)) m(lexer_only),
+		   LATERAL pg_normalize_query_bench(c.query,
+											greatest(10, :iterations * 1000 / octet_length(c.query)),
+											m.lexer_only) b
+	 ORDER BY c.name, c.constants, c.depth, query_bytes, m.lexer_only
+) TO STDOUT WITH (FORMAT csv, HEADER);
@@ -0,0 +1,3 @@
+-- Throughput of pg_normalize_query() on short, distinct queries
+\set id random(1, 1000000)
+SELECT pg_normalize_query('SELECT * FROM foo WHERE id = ' || :id || ' AND name = ''x''');
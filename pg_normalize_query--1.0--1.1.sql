@@ -0,0 +1,149 @@
+/* pg_normalize_query/pg_normalize_query--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_normalize_query UPDATE TO '1.1'" to load this file. \quit
+
+CREATE FUNCTION pg_normalize_query_cache_stats(
+	OUT hits bigint,
+	OUT misses bigint,
+	OUT evictions bigint,
+	OUT entries bigint,
+	OUT memory bigint,
+	OUT shared_hits bigint,
+	OUT shared_misses bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE FUNCTION pg_normalize_query_cache_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE FUNCTION pg_normalize_queries(queries text[])
+RETURNS text[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_fingerprint(query text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_fast(query text)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_statements(query text)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_try_normalize_query(query text, lexer_fallback boolean DEFAULT false)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_log_file(
+	path text,
+	format text DEFAULT 'csvlog',
+	OUT query text,
+	OUT duration double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- Reads server files, so don't let just anyone use it
+REVOKE ALL ON FUNCTION pg_normalize_log_file(text, text) FROM PUBLIC;
+
+-- Only backend-local state is involved
+ALTER FUNCTION pg_normalize_query(text) PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_parallel(source regclass, column_name name, workers integer DEFAULT 4)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION pg_normalized_queries(
+	OUT dbid oid,
+	OUT query text,
+	OUT calls bigint,
+	OUT syntax_errors bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE VIEW pg_normalized_queries AS
+	SELECT * FROM pg_normalized_queries();
+
+CREATE FUNCTION pg_normalized_queries_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+-- Queries of all users are shown, so don't let just anyone see them
+REVOKE ALL ON FUNCTION pg_normalized_queries() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_normalized_queries_reset() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_normalized_queries() TO pg_read_all_stats;
+GRANT SELECT ON pg_normalized_queries TO pg_read_all_stats;
+
+CREATE FUNCTION pg_normalize_query_bench(
+	query text,
+	iterations integer DEFAULT 1000,
+	lexer_only boolean DEFAULT false,
+	OUT calls bigint,
+	OUT ns_per_call double precision,
+	OUT bytes_per_call bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_stats(
+	OUT scope text,
+	OUT calls bigint,
+	OUT total_bytes bigint,
+	OUT max_bytes bigint,
+	OUT constants bigint,
+	OUT clocations_growths bigint,
+	OUT parse_time double precision,
+	OUT walk_time double precision,
+	OUT fill_time double precision,
+	OUT build_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE VIEW pg_normalize_query_stats AS
+	SELECT * FROM pg_normalize_query_stats();
+
+CREATE FUNCTION pg_normalize_query_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION pg_normalize_query_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_normalize_query_profile(
+	query text,
+	OUT normalized text,
+	OUT query_bytes bigint,
+	OUT constants bigint,
+	OUT duplicates bigint,
+	OUT tokens bigint,
+	OUT max_depth integer,
+	OUT peak_memory bigint,
+	OUT parse_time double precision,
+	OUT walk_time double precision,
+	OUT sort_time double precision,
+	OUT rescan_time double precision,
+	OUT build_time double precision
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
@@ -0,0 +1,304 @@
+/* pg_normalize_query/pg_normalize_query--1.1--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_normalize_query UPDATE TO '1.2'" to load this file. \quit
+
+CREATE TYPE normalized_query;
+
+CREATE FUNCTION normalized_query_in(cstring)
+RETURNS normalized_query
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_out(normalized_query)
+RETURNS cstring
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_recv(internal)
+RETURNS normalized_query
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_send(normalized_query)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Not collatable: values are compared bytewise
+CREATE TYPE normalized_query (
+	INPUT = normalized_query_in,
+	OUTPUT = normalized_query_out,
+	RECEIVE = normalized_query_recv,
+	SEND = normalized_query_send,
+	INTERNALLENGTH = VARIABLE,
+	ALIGNMENT = int4,
+	STORAGE = extended
+);
+
+CREATE FUNCTION normalized_query(text)
+RETURNS normalized_query
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_text(normalized_query)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text AS normalized_query)
+	WITH FUNCTION normalized_query(text) AS ASSIGNMENT;
+
+CREATE CAST (normalized_query AS text)
+	WITH FUNCTION normalized_query_text(normalized_query) AS ASSIGNMENT;
+
+CREATE FUNCTION normalized_query_eq(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_ne(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_lt(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_le(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_gt(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_ge(normalized_query, normalized_query)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_cmp(normalized_query, normalized_query)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_hash(normalized_query)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION normalized_query_sortsupport(internal)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR = (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_eq,
+	COMMUTATOR = =,
+	NEGATOR = <>,
+	RESTRICT = eqsel,
+	JOIN = eqjoinsel,
+	HASHES,
+	MERGES
+);
+
+CREATE OPERATOR <> (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_ne,
+	COMMUTATOR = <>,
+	NEGATOR = =,
+	RESTRICT = neqsel,
+	JOIN = neqjoinsel
+);
+
+CREATE OPERATOR < (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_lt,
+	COMMUTATOR = >,
+	NEGATOR = >=,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_le,
+	COMMUTATOR = >=,
+	NEGATOR = >,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR > (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_gt,
+	COMMUTATOR = <,
+	NEGATOR = <=,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+	LEFTARG = normalized_query,
+	RIGHTARG = normalized_query,
+	PROCEDURE = normalized_query_ge,
+	COMMUTATOR = <=,
+	NEGATOR = <,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS normalized_query_ops
+	DEFAULT FOR TYPE normalized_query USING btree AS
+		OPERATOR 1 <,
+		OPERATOR 2 <=,
+		OPERATOR 3 =,
+		OPERATOR 4 >=,
+		OPERATOR 5 >,
+		FUNCTION 1 normalized_query_cmp(normalized_query, normalized_query),
+		FUNCTION 2 normalized_query_sortsupport(internal);
+
+CREATE OPERATOR CLASS normalized_query_ops
+	DEFAULT FOR TYPE normalized_query USING hash AS
+		OPERATOR 1 =,
+		FUNCTION 1 normalized_query_hash(normalized_query);
+
+CREATE FUNCTION pg_normalize_query_params(text, OUT query text, OUT params text[])
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalized_activity(
+	OUT pid integer,
+	OUT state text,
+	OUT query text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE VIEW pg_normalized_activity AS
+	SELECT * FROM pg_normalized_activity();
+
+-- Sessions of other users are hidden as by pg_stat_activity, which anyone
+-- can read
+GRANT SELECT ON pg_normalized_activity TO PUBLIC;
+
+CREATE FUNCTION pg_normalize_query_queryid(query text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE TYPE pg_normalize_query_group AS (
+	query text,
+	calls bigint,
+	total_duration double precision
+);
+
+CREATE FUNCTION pg_normalize_query_agg_trans(internal, text, double precision)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_agg_combine(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_agg_serialize(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_agg_deserialize(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_query_agg_final(internal)
+RETURNS pg_normalize_query_group[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE pg_normalize_query_agg(query text, duration double precision) (
+	SFUNC = pg_normalize_query_agg_trans,
+	STYPE = internal,
+	FINALFUNC = pg_normalize_query_agg_final,
+	COMBINEFUNC = pg_normalize_query_agg_combine,
+	SERIALFUNC = pg_normalize_query_agg_serialize,
+	DESERIALFUNC = pg_normalize_query_agg_deserialize,
+	PARALLEL = SAFE
+);
+
+CREATE FUNCTION pg_normalize_script(script bytea)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pg_normalize_script(script oid)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'pg_normalize_script_lo'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE TABLE pg_normalize_query_dictionary (
+	id bigserial PRIMARY KEY,
+	fingerprint bigint NOT NULL UNIQUE,
+	query text NOT NULL
+);
+
+-- Interned queries are data of the users, so keep them in dumps
+SELECT pg_catalog.pg_extension_config_dump('pg_normalize_query_dictionary', '');
+SELECT pg_catalog.pg_extension_config_dump('pg_normalize_query_dictionary_id_seq', '');
+
+CREATE FUNCTION pg_normalize_query_intern(query text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION pg_normalize_query_resolve(id bigint)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- Deleted or updated rows must not stay in the caches of the backends
+CREATE FUNCTION pg_normalize_query_dictionary_invalidate()
+RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE TRIGGER pg_normalize_query_dictionary_invalidate
+	AFTER UPDATE OR DELETE ON pg_normalize_query_dictionary
+	FOR EACH STATEMENT EXECUTE PROCEDURE pg_normalize_query_dictionary_invalidate();
+
+-- Reads files of the server, so keep it in the leader
+ALTER FUNCTION pg_normalize_log_file(text, text) PARALLEL RESTRICTED;
+
+-- Results depend on pg_normalize_query.collapse_lists, which any session can
+-- change
+ALTER FUNCTION pg_normalize_query(text) STABLE;
+ALTER FUNCTION pg_normalize_queries(text[]) STABLE;
+ALTER FUNCTION pg_normalize_query_fingerprint(text) STABLE;
+ALTER FUNCTION pg_normalize_query_statements(text) STABLE;
+ALTER FUNCTION pg_try_normalize_query(text, boolean) STABLE;
+ALTER FUNCTION pg_normalize_query_params(text) STABLE;
+ALTER FUNCTION pg_normalize_script(bytea) STABLE;
+ALTER FUNCTION pg_normalize_query_agg_trans(internal, text, double precision) STABLE;
+ALTER FUNCTION pg_normalize_query_agg_combine(internal, internal) STABLE;
+ALTER FUNCTION pg_normalize_query_agg_serialize(internal) STABLE;
+ALTER FUNCTION pg_normalize_query_agg_deserialize(bytea, internal) STABLE;
+ALTER FUNCTION pg_normalize_query_agg_final(internal) STABLE;
+
+-- Results depend on pg_normalize_query.canonicalize_whitespace and fold_case
+-- too
+ALTER FUNCTION pg_normalize_query_fast(text) STABLE;
@@ -1,405 +1,6612 @@
 #include "postgres.h"
 
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
 #include "funcapi.h"
+#include "lib/ilist.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "nodes/nodeFuncs.h"
 #include "parser/analyze.h"
 #include "parser/parser.h"
+#include "parser/parse_param.h"
 #include "parser/parsetree.h"
 #include "parser/scanner.h"
+#include "parser/gram.h"		/* must come after scanner.h */
 #include "parser/scansup.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/syslogger.h"
+#include "replication/walsender.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/large_object.h"
+#include "storage/latch.h"
+#include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
 
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/sortsupport.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/typcache.h"
+
+#include "pgnq_core.h"
 
 PG_MODULE_MAGIC;
 
-/* Define scanner_init parameters following the PostgreSQL versions */
-#if PG_VERSION_NUM >= 120000
-#define PGNQ_SCANNER_INIT_ARGS query, &yyextra, &ScanKeywords, ScanKeywordTokens
-#else
-#define PGNQ_SCANNER_INIT_ARGS query, &yyextra, ScanKeywords, NumScanKeywords
-#endif
+/*
+ * 64-bit FNV-1a parameters.  Fingerprints are computed with our own hash
+ * function rather than hash_any() so they can be persisted and compared
+ * between servers.
+ */
+#define PGNQ_FNV_OFFSET_BASIS	UINT64CONST(0xcbf29ce484222325)
+#define PGNQ_FNV_PRIME			UINT64CONST(0x100000001b3)
+
+/*
+ * normalized_query values are varlenas holding the 64-bit FNV-1a hash of the
+ * normalized text followed by the text itself, so that comparisons can
+ * usually stop at the hash.  The hash is stored on disk and must never
+ * change for a given text.  It is read with memcpy(), as values may come
+ * with a short header and so unaligned.
+ */
+#define PGNQ_NQ_HASH_SIZE		sizeof(uint64)
+#define PGNQ_NQ_TEXT(v)			(VARDATA_ANY(v) + PGNQ_NQ_HASH_SIZE)
+#define PGNQ_NQ_TEXT_LEN(v)		(VARSIZE_ANY_EXHDR(v) - PGNQ_NQ_HASH_SIZE)
+#define PG_GETARG_NQ_PP(n)		((struct varlena *) PG_DETOAST_DATUM_PACKED(PG_GETARG_DATUM(n)))
+
+/*
+ * Size of the buffer query jumbles are serialized into, as in
+ * pg_stat_statements
+ */
+#define PGNQ_JUMBLE_SIZE		1024
+
+/*
+ * Not a normalization option: marks the entries of the backend-local cache
+ * that hold a query ID rather than a normalized text
+ */
+#define PGNQ_OPT_QUERYID			0x0100
+
+/* Bytes that can start or continue a name, as the scanner sees them */
+#define PGNQ_IS_IDENT_START(c) \
+	(((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+	 (c) == '_' || IS_HIGHBIT_SET(c))
+#define PGNQ_IS_IDENT_CONT(c) \
+	(PGNQ_IS_IDENT_START(c) || ((c) >= '0' && (c) <= '9') || (c) == '$')
+
+/*
+ * A group of pg_normalize_query_agg(), holding the queries that have the
+ * same fingerprint
+ */
+typedef struct pgnqAggGroup
+{
+	uint64		fingerprint;	/* hash key */
+	int64		calls;			/* number of queries in the group */
+	double		total_duration; /* sum of their non-NULL durations */
+	char	   *query;			/* normalized text of one of them */
+	int			query_len;
+} pgnqAggGroup;
+
+/*
+ * Transition state of pg_normalize_query_agg()
+ */
+typedef struct pgnqAggState
+{
+	MemoryContext context;		/* where the group texts live */
+	HTAB	   *groups;
+} pgnqAggState;
 
 /*
- * Struct for tracking locations/lengths of constants during normalization
+ * Query jumble computed the way pg_stat_statements does it, to get the same
+ * query IDs
  */
-typedef struct pgnqLocationLen
+typedef struct pgnqJumbleState
 {
-	int			location;		/* start offset in query text */
-	int			length;			/* length in bytes, or -1 to ignore */
-} pgnqLocationLen;
+	unsigned char *jumble;		/* Jumble of current query tree */
+	Size		jumble_len;		/* Number of bytes used in jumble[] */
+} pgnqJumbleState;
 
 /*
- * Working state for constant tree walker
+ * Backend-local cache of normalization results, keyed by a hash of the
+ * input text.  Entries are kept in a LRU list and the least recently used
+ * ones are evicted once the cache grows beyond pg_normalize_query.cache_size.
  */
-typedef struct pgnqConstLocations
+typedef struct pgnqCacheEntry
 {
-	/* Array of locations of constants that should be removed */
-	pgnqLocationLen *clocations;
+	uint32		hash;			/* hash of the input text, hashtable key */
+	dlist_node	lru_node;		/* LRU list link, most recently used first */
+	Size		size;			/* memory accounted to this entry */
+	int			options;		/* normalization options used */
+	char	   *query;			/* input text */
+	int			query_len;		/* length of input text */
+	char	   *result;			/* normalized text */
+	int			result_len;		/* length of normalized text */
+} pgnqCacheEntry;
 
-	/* Allocated length of clocations array */
-	int			clocations_buf_size;
+/*
+ * Cross-backend cache living in the main shared memory segment, available
+ * when the library is loaded through shared_preload_libraries.
+ *
+ * It is a direct-mapped array of fixed-size slots indexed by the same hash
+ * of the input text and options used by the backend-local cache; an insert simply
+ * replaces whatever the slot held before.  Lookups take no lock at all:
+ * each slot carries a version counter that writers make odd while they
+ * rewrite the slot, and readers discard anything they copied out if the
+ * version was odd or changed meanwhile.  Writers claim a slot with a
+ * compare-and-swap on that counter and just skip the insert if another
+ * backend got there first.
+ */
+typedef struct pgnqSharedSlot
+{
+	pg_atomic_uint32 version;	/* odd while the slot is being written */
+	uint32		hash;			/* hash of the input text */
+	int			options;		/* normalization options used */
+	int			query_len;		/* length of input text, -1 if unused */
+	int			result_len;		/* length of normalized text */
+	char		data[FLEXIBLE_ARRAY_MEMBER];	/* input text, then result */
+} pgnqSharedSlot;
 
-	/* Current number of valid entries in clocations array */
-	int			clocations_count;
+typedef struct pgnqSharedCache
+{
+	int			nslots;			/* number of slots */
+	Size		slot_size;		/* bytes per slot, including header */
+} pgnqSharedCache;
 
-	/* highest Param id we've seen, in order to start normalization correctly */
-	int			highest_extern_param_id;
-} pgnqConstLocations;
+/*
+ * State kept across calls of pg_normalize_query_statements()
+ */
+typedef struct pgnqStatementsState
+{
+	char	   *query;			/* whole input text */
+	int			query_len;		/* length of input text */
+	RawStmt   **stmts;			/* statements returned by raw_parser() */
+	pgnqConstLocations jstate;	/* workspace shared by all statements */
+} pgnqStatementsState;
 
-static int pgnq_comp_location(const void *a, const void *b);
-static void pgnq_fill_in_constant_lengths(pgnqConstLocations *jstate, const char *query);
-static char *pgnq_build_normalized_query(pgnqConstLocations *jstate, const char *query,
-						  int query_loc, int *query_len_p);
-static void pgnq_record_const_location(pgnqConstLocations *jstate, int location);
-static bool pgnq_const_record_walker(Node *node, pgnqConstLocations *jstate);
+/*
+ * Normalization options of pg_normalize_query_intern(), those of the default
+ * settings, whatever the settings of the session
+ */
+#define PGNQ_INTERN_OPTIONS		0
 
-PG_FUNCTION_INFO_V1(pg_normalize_query);
+/*
+ * Entry of the backend-local cache of pg_normalize_query_intern(), mapping
+ * the fingerprint of a query to its dictionary ID.  The cache is emptied
+ * when it holds PGNQ_INTERN_CACHE_SIZE entries, so it follows the queries
+ * seen recently.
+ */
+#define PGNQ_INTERN_CACHE_SIZE	8192
 
-Datum
-pg_normalize_query(PG_FUNCTION_ARGS)
+typedef struct pgnqInternEntry
 {
-	text *sql_t = PG_GETARG_TEXT_P(0);
-	text *out_t;
-	char *sql, *out;
-	List *tree;
-	pgnqConstLocations jstate;
-	int query_len;
+	uint64		fingerprint;	/* hash key, must be first */
+	int64		id;
+} pgnqInternEntry;
 
-	/* Parse query */
-	sql = text_to_cstring(sql_t);
-	tree = raw_parser(sql);
+/* Bytes read from a script at a time by pg_normalize_script() */
+#define PGNQ_SCRIPT_READ_SIZE	(64 * 1024)
 
-	/* Set up workspace for constant recording */
-	jstate.clocations_buf_size = 32;
-	jstate.clocations = (pgnqLocationLen *)
-		palloc(jstate.clocations_buf_size * sizeof(pgnqLocationLen));
-	jstate.clocations_count = 0;
-	jstate.highest_extern_param_id = 0;
+/* Bytes first scanned for the end of a statement, doubled as needed */
+#define PGNQ_SCRIPT_SCAN_SIZE	4096
 
-	/* Walk tree and record const locations */
-	pgnq_const_record_walker((Node *) tree, &jstate);
+/*
+ * State kept across calls of pg_normalize_script().  The script is read in
+ * slices, from a large object or a bytea value, and only the text of the
+ * statements not returned yet is kept in buf.
+ */
+typedef struct pgnqScriptState
+{
+	LargeObjectDesc *lobj;		/* large object read, NULL for bytea */
+	Datum		script;			/* bytea value read, when lobj is NULL */
+	int64		script_pos;		/* next byte of the bytea value to read */
+	bool		eof;			/* whole script read into buf */
+	StringInfoData buf;			/* script text read */
+	int			buf_pos;		/* first byte of buf not returned yet */
+	ExprContext *econtext;		/* where pgnq_script_close() is registered,
+								 * if anywhere */
+	MemoryContext row_context;	/* reset before each statement */
+	pgnqConstLocations jstate;	/* workspace shared by all statements */
+} pgnqScriptState;
 
-	/* Normalize query */
-	query_len = (int) strlen(sql);
-	out = strdup(pgnq_build_normalized_query(&jstate, sql, 0, &query_len));
-	out_t = cstring_to_text(out);
-	
-	PG_RETURN_TEXT_P(out_t);
-}
+/*
+ * Server log file formats read by pg_normalize_log_file()
+ */
+typedef enum pgnqLogFormat
+{
+	PGNQ_LOG_STDERR,
+	PGNQ_LOG_CSVLOG,
+	PGNQ_LOG_JSONLOG
+} pgnqLogFormat;
+
+/* Bytes read from a log file at a time */
+#define PGNQ_LOG_READ_SIZE		(64 * 1024)
 
 /*
- * pgnq_comp_location: comparator for qsorting pgnqLocationLen structs by location
+ * State kept across calls of pg_normalize_log_file().  The file is read in
+ * large chunks and only one log entry is kept in memory at a time, so memory
+ * use is bounded by the size of the largest entry.
  */
-static int
-pgnq_comp_location(const void *a, const void *b)
+typedef struct pgnqLogReader
 {
-	int			l = ((const pgnqLocationLen *) a)->location;
-	int			r = ((const pgnqLocationLen *) b)->location;
+	char	   *path;			/* file name, for error messages */
+	FILE	   *file;			/* NULL once closed */
+	pgnqLogFormat format;
+	char	   *buf;			/* read buffer */
+	int			buf_len;		/* valid bytes in buf */
+	int			buf_pos;		/* next byte of buf to return */
+	StringInfoData line;		/* current line, for stderr and jsonlog */
+	StringInfoData severity;	/* severity of the current csvlog entry */
+	StringInfoData message;		/* message of the current entry */
+	TupleDesc	tupdesc;		/* result row descriptor */
+	ExprContext *econtext;		/* where pgnq_log_reader_close() is
+								 * registered, if anywhere */
+	MemoryContext row_context;	/* reset before each row */
+	pgnqConstLocations jstate;	/* workspace shared by all entries */
+} pgnqLogReader;
 
-	if (l < r)
-		return -1;
-	else if (l > r)
-		return +1;
-	else
-		return 0;
-}
+/*
+ * Dynamic shared memory used by pg_normalize_query_parallel() and its
+ * workers.  Its table of contents holds this struct under key 0, the queue
+ * each worker sends its results through under keys 1 to nworkers, then the
+ * snapshot of the leader under key nworkers + 1.
+ */
+#define PGNQ_WORKER_MAGIC		0x504e5131
+#define PGNQ_WORKER_QUEUE_SIZE	(64 * 1024)
+
+typedef struct pgnqWorkerShared
+{
+	Oid			relid;			/* table to read */
+	AttrNumber	attnum;			/* column holding the queries */
+	BlockNumber nblocks;		/* blocks of the table to scan */
+	int			nworkers;		/* number of workers launched */
+	int			options;		/* PGNQ_OPT_* flags of the leader */
+	pg_atomic_uint32 nfinished; /* workers done with their block range */
+} pgnqWorkerShared;
 
 /*
- * Given a valid SQL string and an array of constant-location records,
- * fill in the textual lengths of those constants.
- *
- * The constants may use any allowed constant syntax, such as float literals,
- * bit-strings, single-quoted strings and dollar-quoted strings.  This is
- * accomplished by using the public API for the core scanner.
- *
- * It is the caller's job to ensure that the string is a valid SQL statement
- * with constants at the indicated locations.  Since in practice the string
- * has already been parsed, and the locations that the caller provides will
- * have originated from within the authoritative parser, this should not be
- * a problem.
- *
- * Duplicate constant pointers are possible, and will have their lengths
- * marked as '-1', so that they are later ignored.  (Actually, we assume the
- * lengths were initialized as -1 to start with, and don't change them here.)
- *
- * N.B. There is an assumption that a '-' character at a Const location begins
- * a negative numeric constant.  This precludes there ever being another
- * reason for a constant to start with a '-'.
+ * Passed to each worker in bgw_extra, as it must connect to the database
+ * before it can attach to the shared memory
  */
-static void
-pgnq_fill_in_constant_lengths(pgnqConstLocations *jstate, const char *query)
+typedef struct pgnqWorkerExtra
 {
-	pgnqLocationLen *locs;
-	core_yyscan_t yyscanner;
-	core_yy_extra_type yyextra;
-	core_YYSTYPE yylval;
-	YYLTYPE		yylloc;
-	int			last_loc = -1;
-	int			i;
+	Oid			database_id;
+	Oid			user_id;
+	int			worker;			/* zero-based worker number */
+} pgnqWorkerExtra;
 
-	/*
-	 * Sort the records by location so that we can process them in order while
-	 * scanning the query text.
-	 */
-	if (jstate->clocations_count > 1)
-		qsort(jstate->clocations, jstate->clocations_count,
-			  sizeof(pgnqLocationLen), pgnq_comp_location);
-	locs = jstate->clocations;
+/*
+ * Phases of pgnq_normalize() timed when pg_normalize_query.track_timing is on
+ */
+typedef enum pgnqPhase
+{
+	PGNQ_PHASE_PARSE,			/* raw_parser() */
+	PGNQ_PHASE_WALK,			/* pgnq_const_record_walker() */
+	PGNQ_PHASE_FILL,			/* pgnq_fill_in_constant_lengths() */
+	PGNQ_PHASE_BUILD,			/* pgnq_build_normalized_text() */
+	PGNQ_NUM_PHASES
+} pgnqPhase;
 
-	/* initialize the flex scanner --- should match raw_parser() */
-	yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+/*
+ * Cumulative counters of the work done normalizing queries
+ */
+typedef struct pgnqCounters
+{
+	int64		calls;			/* queries normalized by the parser */
+	int64		total_bytes;	/* sum of their lengths */
+	int64		max_bytes;		/* length of the longest one */
+	int64		constants;		/* constants recorded by the walker */
+	int64		clocations_growths; /* times clocations had to be enlarged */
+	double		phase_time[PGNQ_NUM_PHASES];	/* in msec */
+} pgnqCounters;
 
-	/* Search for each constant, in sequence */
-	for (i = 0; i < jstate->clocations_count; i++)
-	{
-		int			loc = locs[i].location;
-		int			tok;
+/*
+ * Counters of every backend in shared memory, summed up when they are read.
+ * A backend only ever writes the slot of its own backend ID, so no lock is
+ * needed: as for the shared cache, the writer makes changecount odd while it
+ * updates the slot and readers retry if it was odd or changed meanwhile.
+ * Slots keep counting across the backends that use the same ID.  A reset
+ * bumps the generation, and slots of an older generation are left out of the
+ * sums and cleared by their backend the next time it writes.
+ */
+typedef struct pgnqStatsSlot
+{
+	pg_atomic_uint32 changecount;	/* odd while the slot is being written */
+	uint32		generation;		/* generation the counters belong to */
+	pgnqCounters counters;
+} pgnqStatsSlot;
 
-		Assert(loc >= 0);
+typedef struct pgnqStatsShared
+{
+	pg_atomic_uint32 generation;	/* bumped by each reset */
+	int			nslots;			/* one per possible backend ID */
+	pgnqStatsSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} pgnqStatsShared;
 
-		if (loc <= last_loc)
-			continue;			/* Duplicate constant, ignore */
+/*
+ * Queries captured in shared memory for the pg_normalized_queries view.
+ * Entries are keyed by database and by a hash of the normalized text, and
+ * the least used ones are evicted once pg_normalize_query.capture_max is
+ * reached.
+ */
+#define PGNQ_CAPTURE_TEXT_SIZE		1024	/* longer texts are truncated */
+#define PGNQ_CAPTURE_PENDING_SIZE	64	/* statements buffered per backend */
+#define PGNQ_CAPTURE_FLUSH_INTERVAL 1000	/* ms between flushes */
+#define PGNQ_CAPTURE_EVICT_PERCENT	5	/* % of entries evicted when full */
 
-		/* Lex tokens until we find the desired constant */
-		for (;;)
-		{
-			tok = core_yylex(&yylval, &yylloc, yyscanner);
+typedef struct pgnqCaptureKey
+{
+	Oid			dbid;			/* database the query ran in */
+	uint64		hash;			/* hash of the normalized text */
+} pgnqCaptureKey;
 
-			/* We should not hit end-of-string, but if we do, behave sanely */
-			if (tok == 0)
-				break;			/* out of inner for-loop */
+typedef struct pgnqCaptureEntry
+{
+	pgnqCaptureKey key;			/* hash key of entry - MUST BE FIRST */
+	int64		calls;			/* times the statement was parsed */
+	int64		syntax_errors;	/* times it was rejected by the parser */
+	int			query_len;		/* bytes of query used */
+	char		query[PGNQ_CAPTURE_TEXT_SIZE];	/* normalized text */
+} pgnqCaptureEntry;
 
-			/*
-			 * We should find the token position exactly, but if we somehow
-			 * run past it, work with that.
-			 */
-			if (yylloc >= loc)
-			{
-				if (query[loc] == '-')
-				{
-					/*
-					 * It's a negative value - this is the one and only case
-					 * where we replace more than a single token.
-					 *
-					 * Do not compensate for the core system's special-case
-					 * adjustment of location to that of the leading '-'
-					 * operator in the event of a negative constant.  It is
-					 * also useful for our purposes to start from the minus
-					 * symbol.  In this way, queries like "select * from foo
-					 * where bar = 1" and "select * from foo where bar = -2"
-					 * will have identical normalized query strings.
-					 */
-					tok = core_yylex(&yylval, &yylloc, yyscanner);
-					if (tok == 0)
-						break;	/* out of inner for-loop */
-				}
+typedef struct pgnqCaptureShared
+{
+	LWLock	   *lock;			/* protects the hash table */
+} pgnqCaptureShared;
 
-				/*
-				 * We now rely on the assumption that flex has placed a zero
-				 * byte after the text of the current token in scanbuf.
-				 */
-				locs[i].length = (int) strlen(yyextra.scanbuf + loc);
+/*
+ * Statements seen by a backend, kept as they are until the next flush.
+ * Recording one only copies its text, so that both normalization and the
+ * shared lock are paid once per batch rather than once per statement.
+ */
+typedef struct pgnqCapturePending
+{
+	char	   *query;			/* raw statement text */
+	int			query_len;
+	bool		syntax_error;	/* rejected by the parser? */
+} pgnqCapturePending;
 
-				/* Quoted string with Unicode escapes
-				 *
-				 * The lexer consumes trailing whitespace in order to find UESCAPE, but if there
-				 * is no UESCAPE it has still consumed it - don't include it in constant length.
-				 */
-				if (locs[i].length > 4 && /* U&'' */
-					(yyextra.scanbuf[loc] == 'u' || yyextra.scanbuf[loc] == 'U') &&
-					 yyextra.scanbuf[loc + 1] == '&' && yyextra.scanbuf[loc + 2] == '\'')
-				{
-					int j = locs[i].length - 1; /* Skip the \0 */
-					for (; j >= 0 && scanner_isspace(yyextra.scanbuf[loc + j]); j--) {}
-					locs[i].length = j + 1; /* Count the \0 */
-				}
+/*
+ * Entry that a flush may evict to make room, chosen before it takes the
+ * capture lock exclusively
+ */
+typedef struct pgnqCaptureVictim
+{
+	pgnqCaptureKey key;
+	int64		usage;			/* calls and syntax errors */
+} pgnqCaptureVictim;
 
-				break;			/* out of inner for-loop */
-			}
-		}
+/* Slots follow the header in the shared memory area */
+#define PGNQ_SHARED_SLOT(cache, i) \
+	((pgnqSharedSlot *) ((char *) (cache) + MAXALIGN(sizeof(pgnqSharedCache)) + \
+						 (Size) (i) * (cache)->slot_size))
 
-		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
-		if (tok == 0)
-			break;
+/* Bytes of query and result text that fit in a slot */
+#define PGNQ_SHARED_SLOT_CAPACITY(cache) \
+	((cache)->slot_size - offsetof(pgnqSharedSlot, data))
 
-		last_loc = loc;
-	}
+/* GUC variables */
+static int	pgnq_cache_size = 0;	/* in kB, 0 disables the cache */
+static int	pgnq_shared_cache_size = 0;	/* in kB, 0 disables the cache */
+static int	pgnq_shared_cache_entry_size = 2;	/* in kB */
+static bool pgnq_collapse_lists = false;
 
-	scanner_finish(yyscanner);
-}
+/*
+ * Bumped on catalog changes that may change query IDs, so that the cached
+ * ones are no longer found
+ */
+static uint64 pgnq_queryid_generation = 0;
+static bool pgnq_queryid_callbacks = false;
+static bool pgnq_canonicalize_whitespace = false;
+static bool pgnq_fold_case = false;
+static bool pgnq_prefilter = false;
+static bool pgnq_log_normalize = false;
+static int	pgnq_log_normalize_max_size = 8;	/* in kB */
+static int	pgnq_capture_max = 0;	/* 0 disables the capture */
+static bool pgnq_track_timing = false;
+
+/* Saved hook values in case of unload */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static emit_log_hook_type prev_emit_log_hook = NULL;
+static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+
+/* Links to shared memory state */
+static pgnqSharedCache *pgnq_shared_cache = NULL;
+static pgnqCaptureShared *pgnq_capture = NULL;
+static pgnqStatsShared *pgnq_shared_stats = NULL;
+static HTAB *pgnq_capture_hash = NULL;
+
+/* Cache state */
+static MemoryContext pgnq_cache_context = NULL;
+static HTAB *pgnq_cache = NULL;
+static dlist_head pgnq_cache_lru = DLIST_STATIC_INIT(pgnq_cache_lru);
+static Size pgnq_cache_memory = 0;
+static int64 pgnq_cache_hits = 0;
+static int64 pgnq_cache_misses = 0;
+static int64 pgnq_cache_evictions = 0;
+static int64 pgnq_shared_cache_hits = 0;
+static int64 pgnq_shared_cache_misses = 0;
 
 /*
- * Generate a normalized version of the query string that will be used to
- * represent all similar queries.
- *
- * Note that the normalized representation may well vary depending on
- * just which "equivalent" query is used to create the hashtable entry.
- * We assume this is OK.
- *
- * *query_len_p contains the input string length, and is updated with
- * the result string length (which cannot be longer) on exit.
- *
- * Returns a palloc'd string.
- */
-static char *
-pgnq_build_normalized_query(pgnqConstLocations *jstate, const char *query,
-						  int query_loc, int *query_len_p)
-{
-	char	   *norm_query;
-	int			query_len = *query_len_p;
-	int			i,
-				norm_query_buflen,		/* Space allowed for norm_query */
-				len_to_wrt,		/* Length (in bytes) to write */
-				quer_loc = 0,	/* Source query byte location */
-				n_quer_loc = 0, /* Normalized query byte location */
-				last_off = 0,	/* Offset from start for previous tok */
-				last_tok_len = 0;		/* Length (in bytes) of that tok */
+ * Dictionary state of pg_normalize_query_intern().  pgnq_intern_valid is
+ * cleared when the dictionary table changes, or when a transaction that
+ * added IDs to the cache aborts, to empty the cache and prepare the plans
+ * again on next use.
+ */
+static HTAB *pgnq_intern_cache = NULL;
+static Oid	pgnq_intern_relid = InvalidOid;
+static SPIPlanPtr pgnq_intern_select_plan = NULL;
+static SPIPlanPtr pgnq_intern_insert_plan = NULL;
+static SPIPlanPtr pgnq_intern_resolve_plan = NULL;
+static bool pgnq_intern_valid = true;
+static bool pgnq_intern_uncommitted = false;	/* cached IDs added by this
+												 * transaction */
+static bool pgnq_intern_callbacks = false;
 
-	/*
-	 * Get constants' lengths (core system only gives us locations).  Note
-	 * this also ensures the items are sorted by location.
-	 */
-	pgnq_fill_in_constant_lengths(jstate, query);
+/* Counters of this backend */
+static pgnqCounters pgnq_stats;
+
+/*
+ * Long-lived workspace of the scalar functions.  Its clocations array is kept
+ * from one call to the next at the largest size needed so far, within
+ * PGNQ_WORKSPACE_MAX_LOCATIONS.  Everything else a call allocates, the parse
+ * tree and the scanner buffers included, goes to a scratch context reset at
+ * the end of the call, whose first block is kept to serve the next one.
+ */
+#define PGNQ_SCRATCH_BLOCK_SIZE		(64 * 1024)
+#define PGNQ_WORKSPACE_MAX_LOCATIONS 8192
+
+static MemoryContext pgnq_workspace_context = NULL;
+static MemoryContext pgnq_scratch_context = NULL;
+static pgnqConstLocations pgnq_workspace;
+
+/* Scratch memory of the log hook, and whether it is running */
+static MemoryContext pgnq_log_context = NULL;
+static bool pgnq_in_log_hook = false;
+
+/* Statements captured by this backend and not flushed yet */
+static MemoryContext pgnq_capture_context = NULL;
+static pgnqCapturePending pgnq_capture_pending[PGNQ_CAPTURE_PENDING_SIZE];
+static int	pgnq_capture_npending = 0;
+static TimestampTz pgnq_capture_last_flush = 0;
+static bool pgnq_capture_exit_registered = false;
+
+/* Memory context methods of pg_normalize_query_profile(), and its peak */
+static MemoryContextMethods pgnq_profile_methods;
+static const MemoryContextMethods *pgnq_profile_base_methods = NULL;
+static Size pgnq_profile_peak = 0;
+
+void		_PG_init(void);
+PGDLLEXPORT void pg_normalize_query_worker_main(Datum main_arg);
+
+static int	pgnq_current_options(void);
+static bool pgnq_skip_normalization(const char *query, int query_len);
+static bool pgnq_is_constant_keyword(const char *word, int len);
+static uint32 pgnq_cache_hash(const char *query, int query_len, int options);
+static void pgnq_cache_size_assign(int newval, void *extra);
+static void pgnq_cache_evict(Size limit);
+static bool pgnq_cache_lookup(const char *query, int query_len, int options,
+							  const char **result, int *result_len);
+static void pgnq_cache_insert(const char *query, int query_len, int options,
+							  const char *result, int result_len);
+static Size pgnq_shared_cache_slot_size(void);
+static Size pgnq_shared_cache_memsize(void);
+static void pgnq_shmem_startup(void);
+static Size pgnq_capture_memsize(void);
+static void pgnq_post_parse_analyze(ParseState *pstate, Query *query);
+static void pgnq_capture_add(const char *query, int query_len, bool syntax_error);
+static void pgnq_capture_flush(void);
+static void pgnq_capture_flush_quietly(void);
+static void pgnq_capture_make_key(const char *query, int query_len, pgnqCaptureKey *key);
+static pgnqCaptureVictim *pgnq_capture_pick_victims(text **normalized, int n,
+													 int *nvictims);
+static void pgnq_capture_store(const char *query, int query_len, bool syntax_error,
+							   pgnqCaptureVictim *victims, int *nvictims);
+static void pgnq_capture_evict(const pgnqCaptureVictim *victims, int nvictims);
+static int	pgnq_capture_entry_cmp(const void *a, const void *b);
+static void pgnq_capture_shmem_exit(int code, Datum arg);
+static void pgnq_capture_check_enabled(void);
+static int	pgnq_stats_nslots(void);
+static Size pgnq_stats_memsize(void);
+static void pgnq_stats_clock(instr_time *t);
+static void pgnq_stats_report(pgnqConstLocations *jstate, int query_len,
+							  instr_time *phase_start);
+static void pgnq_counters_add(pgnqCounters *dst, const pgnqCounters *src);
+static void pgnq_stats_put_row(Tuplestorestate *tupstore, TupleDesc tupdesc,
+							   const char *scope, const pgnqCounters *counters);
+static void pgnq_bench_normalize(const char *query, int query_len, bool lexer_only);
+static Size pgnq_context_allocated(MemoryContext context);
+static Size pgnq_profile_peak_memory(const char *query, int query_len);
+static void *pgnq_profile_alloc(MemoryContext context, Size size);
+static void *pgnq_profile_realloc(MemoryContext context, void *pointer, Size size);
+static text *pgnq_shared_cache_lookup(const char *query, int query_len,
+									  int options);
+static void pgnq_shared_cache_insert(const char *query, int query_len,
+									 int options, const char *result,
+									 int result_len);
+static pgnqConstLocations *pgnq_workspace_begin(void);
+static void pgnq_workspace_end(void);
+static text *pgnq_normalize(pgnqConstLocations *jstate, const char *query,
+							int query_len, MemoryContext result_context);
+static text *pgnq_normalize_cached(pgnqConstLocations *jstate, const char *query,
+								   int query_len, MemoryContext result_context);
+static text *pgnq_normalize_tolerant(pgnqConstLocations *jstate, char *query,
+									 int query_len, bool lexer_fallback);
+static text *pgnq_normalize_lexer_tolerant(pgnqConstLocations *jstate, char *query,
+										   int query_len);
+static const char *pgnq_backend_state_name(BackendState state);
+static text *pgnq_try_normalize(pgnqConstLocations *jstate, const char *query,
+								int query_len, bool lexer_only, int *error_offset);
+static bool pgnq_is_query_text_error(int sqlerrcode);
+static int	pgnq_cursorpos_offset(const char *query, int query_len, int cursorpos);
+static int	pgnq_log_getc(pgnqLogReader *reader);
+static int	pgnq_log_peekc(pgnqLogReader *reader);
+static bool pgnq_log_read_line(pgnqLogReader *reader, StringInfo dst);
+static bool pgnq_log_read_csv_entry(pgnqLogReader *reader);
+static bool pgnq_log_read_entry(pgnqLogReader *reader);
+static void pgnq_log_reader_close(Datum arg);
+static void pgnq_check_log_path(char *path);
+static Datum pgnq_normalize_script(FunctionCallInfo fcinfo, bool large_object);
+static int	pgnq_script_fill(pgnqScriptState *state, int needed);
+static int	pgnq_script_find_semicolon(char *script, int len, bool final);
+static bool pgnq_script_next_statement(pgnqScriptState *state, int *stmt_len);
+static void pgnq_script_skip_to_statement(pgnqScriptState *state);
+static void pgnq_script_skip_copy_data(pgnqScriptState *state);
+static void pgnq_script_close(Datum arg);
+static void pgnq_emit_log_hook(ErrorData *edata);
+static void pgnq_normalize_log_message(ErrorData *edata);
+static void pgnq_check_parallel_scan(Relation rel);
+static void pgnq_worker_scan(pgnqWorkerShared *shared, int worker,
+							 shm_mq_handle *mqh);
+static text *pgnq_normalize_statement(pgnqConstLocations *jstate, const char *query,
+									  int query_len, RawStmt *stmt);
+static bool pgnq_minus_is_unary(int prev_tok, const char *prev_keyword);
+static void pgnq_scan_constants(pgnqConstLocations *jstate, const char *query);
+static uint64 pgnq_hash_bytes(uint64 hash, const void *data, Size len);
+static uint64 pgnq_hash_token(uint64 hash, char kind, const char *str);
+static uint64 pgnq_fingerprint_query(pgnqConstLocations *jstate, const char *query);
+static uint64 pgnq_compute_queryid(const char *query, RawStmt *stmt);
+static void pgnq_append_jumble(pgnqJumbleState *jstate, const unsigned char *item, Size size);
+static void pgnq_jumble_query(pgnqJumbleState *jstate, Query *query);
+static void pgnq_jumble_range_table(pgnqJumbleState *jstate, List *rtable);
+static void pgnq_jumble_expr(pgnqJumbleState *jstate, Node *node);
+static void pgnq_queryid_relcache_callback(Datum arg, Oid relid);
+static void pgnq_queryid_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void pgnq_intern_setup(Oid fn_oid);
+static int64 pgnq_intern_store(uint64 fingerprint, text *query);
+static void pgnq_intern_relcache_callback(Datum arg, Oid relid);
+static void pgnq_intern_xact_callback(XactEvent event, void *arg);
+static void pgnq_intern_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+										 SubTransactionId parentSubid, void *arg);
+static struct varlena *pgnq_nq_make(const char *str, int len);
+static uint64 pgnq_nq_hash(const struct varlena *v);
+static bool pgnq_nq_equal(const struct varlena *a, const struct varlena *b);
+static int	pgnq_nq_cmp(const struct varlena *a, const struct varlena *b);
+static pgnqAggState *pgnq_agg_state_create(MemoryContext context);
+static void pgnq_agg_add(pgnqAggState *state, uint64 fingerprint,
+						 const char *query, int query_len,
+						 int64 calls, double total_duration);
+static int	pgnq_agg_group_cmp(const void *a, const void *b);
+static int	pgnq_agg_text_cmp(const char *a, int a_len, const char *b, int b_len);
+static int	pgnq_nq_fastcmp(Datum x, Datum y, SortSupport ssup);
+#if SIZEOF_DATUM == 8
+static Datum pgnq_nq_abbrev_convert(Datum original, SortSupport ssup);
+static int	pgnq_nq_abbrev_cmp(Datum x, Datum y, SortSupport ssup);
+static bool pgnq_nq_abbrev_abort(int memtupcount, SortSupport ssup);
+#endif
+
+PG_FUNCTION_INFO_V1(pg_normalize_query);
+PG_FUNCTION_INFO_V1(pg_normalize_query_params);
+PG_FUNCTION_INFO_V1(pg_try_normalize_query);
+PG_FUNCTION_INFO_V1(pg_normalize_queries);
+PG_FUNCTION_INFO_V1(pg_normalize_query_fingerprint);
+PG_FUNCTION_INFO_V1(pg_normalize_query_intern);
+PG_FUNCTION_INFO_V1(pg_normalize_query_resolve);
+PG_FUNCTION_INFO_V1(pg_normalize_query_dictionary_invalidate);
+PG_FUNCTION_INFO_V1(pg_normalize_query_agg_trans);
+PG_FUNCTION_INFO_V1(pg_normalize_query_agg_combine);
+PG_FUNCTION_INFO_V1(pg_normalize_query_agg_serialize);
+PG_FUNCTION_INFO_V1(pg_normalize_query_agg_deserialize);
+PG_FUNCTION_INFO_V1(pg_normalize_query_agg_final);
+PG_FUNCTION_INFO_V1(pg_normalize_query_queryid);
+PG_FUNCTION_INFO_V1(pg_normalize_query_fast);
+PG_FUNCTION_INFO_V1(pg_normalize_query_statements);
+PG_FUNCTION_INFO_V1(pg_normalize_script);
+PG_FUNCTION_INFO_V1(pg_normalize_script_lo);
+PG_FUNCTION_INFO_V1(pg_normalize_log_file);
+PG_FUNCTION_INFO_V1(pg_normalize_query_parallel);
+PG_FUNCTION_INFO_V1(pg_normalize_query_cache_stats);
+PG_FUNCTION_INFO_V1(pg_normalize_query_cache_reset);
+PG_FUNCTION_INFO_V1(pg_normalized_queries);
+PG_FUNCTION_INFO_V1(pg_normalized_queries_reset);
+PG_FUNCTION_INFO_V1(pg_normalized_activity);
+PG_FUNCTION_INFO_V1(pg_normalize_query_bench);
+PG_FUNCTION_INFO_V1(pg_normalize_query_profile);
+PG_FUNCTION_INFO_V1(pg_normalize_query_stats);
+PG_FUNCTION_INFO_V1(pg_normalize_query_stats_reset);
+PG_FUNCTION_INFO_V1(normalized_query_in);
+PG_FUNCTION_INFO_V1(normalized_query_out);
+PG_FUNCTION_INFO_V1(normalized_query_recv);
+PG_FUNCTION_INFO_V1(normalized_query_send);
+PG_FUNCTION_INFO_V1(normalized_query);
+PG_FUNCTION_INFO_V1(normalized_query_text);
+PG_FUNCTION_INFO_V1(normalized_query_eq);
+PG_FUNCTION_INFO_V1(normalized_query_ne);
+PG_FUNCTION_INFO_V1(normalized_query_lt);
+PG_FUNCTION_INFO_V1(normalized_query_le);
+PG_FUNCTION_INFO_V1(normalized_query_gt);
+PG_FUNCTION_INFO_V1(normalized_query_ge);
+PG_FUNCTION_INFO_V1(normalized_query_cmp);
+PG_FUNCTION_INFO_V1(normalized_query_hash);
+PG_FUNCTION_INFO_V1(normalized_query_sortsupport);
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("pg_normalize_query.cache_size",
+							"Sets the maximum memory used to cache normalized queries in each backend.",
+							"Zero disables the cache.",
+							&pgnq_cache_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							pgnq_cache_size_assign,
+							NULL);
+
+	DefineCustomIntVariable("pg_normalize_query.shared_cache_size",
+							"Sets the amount of shared memory used to cache normalized queries across backends.",
+							"Zero disables the cache. Requires loading the library through shared_preload_libraries.",
+							&pgnq_shared_cache_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_normalize_query.shared_cache_entry_size",
+							"Sets the size of each shared cache entry.",
+							"Queries whose text and normalized text do not fit together in an entry are not shared.",
+							&pgnq_shared_cache_entry_size,
+							2,
+							1,
+							1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.collapse_lists",
+							 "Collapses IN lists and multi-row VALUES lists of constants.",
+							 "An IN list keeps a single placeholder and a VALUES list keeps its first row only.",
+							 &pgnq_collapse_lists,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.canonicalize_whitespace",
+							 "Replaces whitespace and comments between tokens by a single space.",
+							 "The contents of quoted identifiers and literals are kept as they are.",
+							 &pgnq_canonicalize_whitespace,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.fold_case",
+							 "Writes keywords in upper case and unquoted names in lower case.",
+							 NULL,
+							 &pgnq_fold_case,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.prefilter",
+							 "Returns queries that can't hold any constant without parsing them.",
+							 "Syntax errors in such queries are not reported.",
+							 &pgnq_prefilter,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.log_normalize",
+							 "Normalizes statements before they are written to the server log.",
+							 "Applies to the statements logged by log_statement and log_min_duration_statement.",
+							 &pgnq_log_normalize,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_normalize_query.log_normalize_max_size",
+							"Sets the size of the largest statement normalized before being logged.",
+							"Larger statements are logged as they are.",
+							&pgnq_log_normalize_max_size,
+							8,
+							1,
+							MAX_KILOBYTES,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_normalize_query.capture_max",
+							"Sets the maximum number of normalized queries captured in shared memory.",
+							"Zero disables the capture. Requires loading the library through shared_preload_libraries.",
+							&pgnq_capture_max,
+							0,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_normalize_query.track_timing",
+							 "Collects timing statistics for each phase of query normalization.",
+							 NULL,
+							 &pgnq_track_timing,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("pg_normalize_query");
+
+	prev_emit_log_hook = emit_log_hook;
+	emit_log_hook = pgnq_emit_log_hook;
 
 	/*
-	 * Allow for $n symbols to be longer than the constants they replace.
-	 * Constants must take at least one byte in text form, while a $n symbol
-	 * certainly isn't more than 11 bytes, even if n reaches INT_MAX.  We
-	 * could refine that limit based on the max value of n for the current
-	 * query, but it hardly seems worth any extra effort to do so.
+	 * The shared cache, the server-wide stats and the query capture can only
+	 * be set up when we are loaded through shared_preload_libraries.
+	 * Otherwise the SQL functions keep working with backend-local state only.
 	 */
-	norm_query_buflen = query_len + jstate->clocations_count * 10;
+	if (!process_shared_preload_libraries_in_progress)
+		return;
 
-	/* Allocate result buffer */
-	norm_query = palloc(norm_query_buflen + 1);
-
-	for (i = 0; i < jstate->clocations_count; i++)
-	{
-		int			off,		/* Offset from start for cur tok */
-					tok_len;	/* Length (in bytes) of that tok */
+	RequestAddinShmemSpace(add_size(add_size(pgnq_shared_cache_memsize(),
+											 pgnq_capture_memsize()),
+									pgnq_stats_memsize()));
 
-		off = jstate->clocations[i].location;
-		/* Adjust recorded location if we're dealing with partial string */
-		off -= query_loc;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pgnq_shmem_startup;
 
-		tok_len = jstate->clocations[i].length;
+	if (pgnq_capture_max > 0)
+	{
+		RequestNamedLWLockTranche("pg_normalize_query", 1);
 
-		if (tok_len < 0)
-			continue;			/* ignore any duplicates */
+		/* Created here so that syntax errors can be captured right away */
+		pgnq_capture_context = AllocSetContextCreate(TopMemoryContext,
+													 "pg_normalize_query capture",
+													 ALLOCSET_DEFAULT_SIZES);
 
-		/* Copy next chunk (what precedes the next constant) */
-		len_to_wrt = off - last_off;
-		len_to_wrt -= last_tok_len;
+		prev_post_parse_analyze_hook = post_parse_analyze_hook;
+		post_parse_analyze_hook = pgnq_post_parse_analyze;
+	}
+}
 
-		Assert(len_to_wrt >= 0);
-		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-		n_quer_loc += len_to_wrt;
+Datum
+pg_normalize_query(PG_FUNCTION_ARGS)
+{
+	char *sql;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	text	   *out;
 
-		/* And insert a param symbol in place of the constant token */
-		n_quer_loc += sprintf(norm_query + n_quer_loc, "$%d",
-							  i + 1 + jstate->highest_extern_param_id);
+	if (pgnq_prefilter)
+	{
+		text	   *sql_t = PG_GETARG_TEXT_PP(0);
 
-		quer_loc = off + tok_len;
-		last_off = off;
-		last_tok_len = tok_len;
+		if (pgnq_skip_normalization(VARDATA_ANY(sql_t), VARSIZE_ANY_EXHDR(sql_t)))
+			PG_RETURN_TEXT_P(sql_t);
 	}
 
+	/* Set up workspace for constant recording */
+	jstate = pgnq_workspace_begin();
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
 	/*
-	 * We've copied up until the last ignorable constant.  Copy over the
-	 * remaining bytes of the original query string.
+	 * Let text_to_cstring() detoast the argument itself, so that it can free
+	 * the detoasted copy right away and only the C string is kept.
 	 */
-	len_to_wrt = query_len - quer_loc;
+	sql = text_to_cstring((text *) DatumGetPointer(PG_GETARG_DATUM(0)));
 
-	Assert(len_to_wrt >= 0);
-	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-	n_quer_loc += len_to_wrt;
+	/* Normalize query, building the result directly where it has to live */
+	out = pgnq_normalize_cached(jstate, sql, (int) strlen(sql), oldcontext);
 
-	Assert(n_quer_loc <= norm_query_buflen);
-	norm_query[n_quer_loc] = '\0';
+	MemoryContextSwitchTo(oldcontext);
+	pgnq_workspace_end();
 
-	*query_len_p = n_quer_loc;
-	return norm_query;
+	PG_RETURN_TEXT_P(out);
 }
 
-static void pgnq_record_const_location(pgnqConstLocations *jstate, int location)
+/*
+ * Normalize a query and also return the original text of each constant it
+ * replaced, so that the values can be put back, e.g. to replay a captured
+ * workload.  params[n] holds the text of the constant replaced by $n.
+ * Parameters the query already had, and constants repeated at the same
+ * location, are NULL.
+ */
+Datum
+pg_normalize_query_params(PG_FUNCTION_ARGS)
 {
-	/* -1 indicates unknown or undefined location */
-	if (location >= 0)
+	char	   *sql;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2];
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nparams;
+	int			collapsed_rows = 0;
+	int			lbound = 1;
+	int			i;
+	text	   *out;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	jstate = pgnq_workspace_begin();
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
+	sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	out = pgnq_normalize(jstate, sql, (int) strlen(sql), oldcontext);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * The constant records are left sorted, with their lengths filled in, so
+	 * they delimit the values in the source text.  Collapsed VALUES rows take
+	 * no param symbol, as in pgnq_build_normalized_query().
+	 */
+	nparams = jstate->highest_extern_param_id + jstate->clocations_count;
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		if (jstate->clocations[i].length >= 0 &&
+			jstate->clocations[i].kind == PGNQ_LOC_ROWS)
+			nparams--;
+	}
+	elems = (Datum *) palloc0(Max(nparams, 1) * sizeof(Datum));
+	elem_nulls = (bool *) palloc(Max(nparams, 1) * sizeof(bool));
+	memset(elem_nulls, true, Max(nparams, 1) * sizeof(bool));
+
+	for (i = 0; i < jstate->clocations_count; i++)
 	{
-		/* enlarge array if needed */
-		if (jstate->clocations_count >= jstate->clocations_buf_size)
+		pgnqLocationLen *loc = &jstate->clocations[i];
+		int			n = jstate->highest_extern_param_id + i - collapsed_rows;
+
+		if (loc->length < 0)
+			continue;			/* ignore any duplicates */
+
+		if (loc->kind == PGNQ_LOC_ROWS)
 		{
-			jstate->clocations_buf_size *= 2;
-			jstate->clocations = (pgnqLocationLen *)
-				repalloc(jstate->clocations,
-						 jstate->clocations_buf_size *
-						 sizeof(pgnqLocationLen));
+			collapsed_rows++;
+			continue;
 		}
-		jstate->clocations[jstate->clocations_count].location = location;
-		/* initialize lengths to -1 to simplify pgnq_fill_in_constant_lengths */
-		jstate->clocations[jstate->clocations_count].length = -1;
-		jstate->clocations_count++;
+
+		elems[n] = PointerGetDatum(cstring_to_text_with_len(sql + loc->location,
+															loc->length));
+		elem_nulls[n] = false;
 	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = PointerGetDatum(out);
+	values[1] = PointerGetDatum(construct_md_array(elems, elem_nulls, 1,
+												   &nparams, &lbound,
+												   TEXTOID, -1, false, 'i'));
+	pgnq_workspace_end();
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
-static bool pgnq_const_record_walker(Node *node, pgnqConstLocations *jstate)
+/*
+ * Like pg_normalize_query(), but return NULL instead of raising an error
+ * when the query can't be parsed, so that bulk jobs over logged statements
+ * need no subtransaction per row.
+ *
+ * With lexer_fallback, such queries are normalized using only the core
+ * scanner instead, as pg_normalize_query_fast() does.  If even the scanner
+ * fails, e.g. on an unterminated quoted string, the text before the point of
+ * failure is normalized and returned.
+ */
+Datum
+pg_try_normalize_query(PG_FUNCTION_ARGS)
 {
-	Node	*nodeReturn = NULL;
+	char	   *sql;
+	bool		lexer_fallback = PG_GETARG_BOOL(1);
+	text	   *out;
+	pgnqConstLocations jstate;
 
-	if (node == NULL)
-		return false;
+	sql = text_to_cstring((text *) DatumGetPointer(PG_GETARG_DATUM(0)));
 
-	/* Guard against stack overflow due to overly complex expressions */
-	check_stack_depth();
+	/* Set up workspace for constant recording */
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
 
-	switch (nodeTag(node))
-	{
-		case T_A_Const:
-			pgnq_record_const_location(jstate, castNode(A_Const, node)->location);
-			break;
+	out = pgnq_normalize_tolerant(&jstate, sql, (int) strlen(sql), lexer_fallback);
 
-		case T_ParamRef:
-			if (((ParamRef *) node)->number > jstate->highest_extern_param_id)
-				jstate->highest_extern_param_id = castNode(ParamRef, node)->number;
-			break;
+	if (out == NULL)
+		PG_RETURN_NULL();
 
-		case T_DefElem:
-			nodeReturn = (Node *) ((DefElem *) node)->arg;
-			break;
+	PG_RETURN_TEXT_P(out);
+}
 
-#if PG_VERSION_NUM >= 100000
-		case T_RawStmt:
-			nodeReturn = (Node *) ((RawStmt *) node)->stmt;
-			break;
-#endif
+/*
+ * Normalize every element of a text array in one call.
+ *
+ * The constant-location workspace is set up once for the whole batch, and
+ * each element is parsed in a scratch memory context that is reset before
+ * the next one, so the per-query setup costs are paid once per batch.  NULL
+ * elements are returned as NULL.
+ */
+Datum
+pg_normalize_queries(PG_FUNCTION_ARGS)
+{
+	ArrayType  *queries = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+	MemoryContext scratch_context;
+	MemoryContext oldcontext;
+	pgnqConstLocations jstate;
 
-		case T_VariableSetStmt:
-			nodeReturn = (Node *) ((VariableSetStmt *) node)->args;
-			break;
+	deconstruct_array(queries, TEXTOID, -1, false, 'i',
+					  &elems, &nulls, &nelems);
 
-		case T_CopyStmt:
-			nodeReturn = (Node *) ((CopyStmt *) node)->query;
-			break;
+	if (nelems == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
 
-		case T_ExplainStmt:
-			nodeReturn = (Node *) ((ExplainStmt *) node)->query;
-			break;
+	/* Set up workspace for constant recording */
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
 
-		case T_AlterRoleStmt:
-			nodeReturn = (Node *) ((AlterRoleStmt *) node)->options;
-			break;
+	scratch_context = AllocSetContextCreate(CurrentMemoryContext,
+											"pg_normalize_queries scratch",
+											ALLOCSET_DEFAULT_SIZES);
 
-		case T_DeclareCursorStmt:
-			nodeReturn = (Node *) ((DeclareCursorStmt *) node)->query;
-			break;
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *sql;
+		text	   *out;
 
-		default:
-			break;
+		if (nulls[i])
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (pgnq_prefilter)
+		{
+			text	   *sql_t = DatumGetTextPP(elems[i]);
+
+			if (pgnq_skip_normalization(VARDATA_ANY(sql_t),
+										VARSIZE_ANY_EXHDR(sql_t)))
+				continue;
+		}
+
+		MemoryContextReset(scratch_context);
+		oldcontext = MemoryContextSwitchTo(scratch_context);
+
+		sql = text_to_cstring(DatumGetTextPP(elems[i]));
+		out = pgnq_normalize_cached(&jstate, sql, (int) strlen(sql),
+									oldcontext);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		elems[i] = PointerGetDatum(out);
 	}
 
-	if (nodeReturn != NULL)
-		return pgnq_const_record_walker((Node *) nodeReturn, jstate);
+	MemoryContextDelete(scratch_context);
 
-	return raw_expression_tree_walker(node, pgnq_const_record_walker, (void*) jstate);
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls,
+											 ARR_NDIM(queries),
+											 ARR_DIMS(queries),
+											 ARR_LBOUND(queries),
+											 TEXTOID, -1, false, 'i'));
 }
+
+/*
+ * Transition function of pg_normalize_query_agg(query, duration), which
+ * counts queries and sums up their durations by normalized query.
+ *
+ * Queries are grouped by fingerprint, so memory grows with the number of
+ * groups rather than of rows, but that ignores whitespace, comments and case:
+ * a group may hold queries pg_normalize_query() tells apart.  Each group then
+ * shows the smallest of their normalized texts, so that the result depends
+ * neither on the order of the rows nor on how parallel workers split them.
+ * NULL queries are skipped.
+ */
+Datum
+pg_normalize_query_agg_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	pgnqAggState *state;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	char	   *sql;
+	List	   *tree;
+	uint64		fingerprint;
+	text	   *out;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "pg_normalize_query_agg_trans called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		state = pgnq_agg_state_create(aggcontext);
+	else
+		state = (pgnqAggState *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	jstate = pgnq_workspace_begin();
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
+	sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	tree = raw_parser(sql);
+	pgnq_const_record_walker((Node *) tree, jstate);
+	fingerprint = pgnq_fingerprint_query(jstate, sql);
+	pgnq_fill_in_constant_lengths(jstate, sql, 0);
+	out = pgnq_build_normalized_text(jstate, sql, 0, (int) strlen(sql));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgnq_agg_add(state, fingerprint, VARDATA_ANY(out), VARSIZE_ANY_EXHDR(out),
+				 1, PG_ARGISNULL(2) ? 0.0 : PG_GETARG_FLOAT8(2));
+	pgnq_workspace_end();
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Combine function of pg_normalize_query_agg(), merging the groups found by
+ * parallel workers
+ */
+Datum
+pg_normalize_query_agg_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	pgnqAggState *state1;
+	pgnqAggState *state2;
+	HASH_SEQ_STATUS status;
+	pgnqAggGroup *group;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "pg_normalize_query_agg_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	state2 = (pgnqAggState *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		state1 = pgnq_agg_state_create(aggcontext);
+	else
+		state1 = (pgnqAggState *) PG_GETARG_POINTER(0);
+
+	hash_seq_init(&status, state2->groups);
+	while ((group = (pgnqAggGroup *) hash_seq_search(&status)) != NULL)
+		pgnq_agg_add(state1, group->fingerprint, group->query, group->query_len,
+					 group->calls, group->total_duration);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * Serialization function of pg_normalize_query_agg(), to send the groups of
+ * a parallel worker to the leader
+ */
+Datum
+pg_normalize_query_agg_serialize(PG_FUNCTION_ARGS)
+{
+	pgnqAggState *state;
+	StringInfoData buf;
+	HASH_SEQ_STATUS status;
+	pgnqAggGroup *group;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "pg_normalize_query_agg_serialize called in non-aggregate context");
+
+	state = (pgnqAggState *) PG_GETARG_POINTER(0);
+
+	pq_begintypsend(&buf);
+	pq_sendint64(&buf, hash_get_num_entries(state->groups));
+
+	hash_seq_init(&status, state->groups);
+	while ((group = (pgnqAggGroup *) hash_seq_search(&status)) != NULL)
+	{
+		pq_sendint64(&buf, (int64) group->fingerprint);
+		pq_sendint64(&buf, group->calls);
+		pq_sendfloat8(&buf, group->total_duration);
+		pq_sendint64(&buf, group->query_len);
+		pq_sendbytes(&buf, group->query, group->query_len);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Deserialization function of pg_normalize_query_agg()
+ */
+Datum
+pg_normalize_query_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bytea	   *sstate = PG_GETARG_BYTEA_PP(0);
+	pgnqAggState *state;
+	StringInfoData buf;
+	int64		ngroups;
+	int64		i;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "pg_normalize_query_agg_deserialize called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+	state = pgnq_agg_state_create(aggcontext);
+	ngroups = pq_getmsgint64(&buf);
+
+	for (i = 0; i < ngroups; i++)
+	{
+		uint64		fingerprint = (uint64) pq_getmsgint64(&buf);
+		int64		calls = pq_getmsgint64(&buf);
+		double		total_duration = pq_getmsgfloat8(&buf);
+		int			query_len = (int) pq_getmsgint64(&buf);
+		const char *query = pq_getmsgbytes(&buf, query_len);
+
+		pgnq_agg_add(state, fingerprint, query, query_len,
+					 calls, total_duration);
+	}
+
+	pq_getmsgend(&buf);
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Final function of pg_normalize_query_agg(), returning the groups in an
+ * array of pg_normalize_query_group, by decreasing number of calls
+ */
+Datum
+pg_normalize_query_agg_final(PG_FUNCTION_ARGS)
+{
+	pgnqAggState *state;
+	Oid			elemtype;
+	int16		elemlen;
+	bool		elembyval;
+	char		elemalign;
+	TupleDesc	tupdesc;
+	pgnqAggGroup **groups;
+	Datum	   *elems;
+	HASH_SEQ_STATUS status;
+	pgnqAggGroup *group;
+	int			ngroups;
+	int			i;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (pgnqAggState *) PG_GETARG_POINTER(0);
+
+	elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	if (!OidIsValid(elemtype))
+		elog(ERROR, "return type must be an array");
+
+	ngroups = (int) hash_get_num_entries(state->groups);
+	if (ngroups == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(elemtype));
+
+	groups = (pgnqAggGroup **) palloc(ngroups * sizeof(pgnqAggGroup *));
+	i = 0;
+	hash_seq_init(&status, state->groups);
+	while ((group = (pgnqAggGroup *) hash_seq_search(&status)) != NULL)
+		groups[i++] = group;
+	qsort(groups, ngroups, sizeof(pgnqAggGroup *), pgnq_agg_group_cmp);
+
+	tupdesc = lookup_rowtype_tupdesc(elemtype, -1);
+	elems = (Datum *) palloc(ngroups * sizeof(Datum));
+
+	for (i = 0; i < ngroups; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = PointerGetDatum(cstring_to_text_with_len(groups[i]->query,
+															 groups[i]->query_len));
+		values[1] = Int64GetDatum(groups[i]->calls);
+		values[2] = Float8GetDatum(groups[i]->total_duration);
+
+		elems[i] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+	}
+
+	ReleaseTupleDesc(tupdesc);
+
+	get_typlenbyvalalign(elemtype, &elemlen, &elembyval, &elemalign);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, ngroups, elemtype,
+										  elemlen, elembyval, elemalign));
+}
+
+/*
+ * Compute a 64-bit fingerprint of a query that is the same for all queries
+ * pg_normalize_query() would consider similar, without building the
+ * normalized text.  It ignores the values of constants and the numbers of
+ * parameters as well as whitespace, comments and keyword case.
+ */
+Datum
+pg_normalize_query_fingerprint(PG_FUNCTION_ARGS)
+{
+	text	   *sql_t = PG_GETARG_TEXT_PP(0);
+	char	   *sql;
+	List	   *tree;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	uint64		fingerprint;
+
+	jstate = pgnq_workspace_begin();
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
+	/* Parse query */
+	sql = text_to_cstring(sql_t);
+	tree = raw_parser(sql);
+
+	/* Walk tree and record const locations */
+	pgnq_const_record_walker((Node *) tree, jstate);
+
+	fingerprint = pgnq_fingerprint_query(jstate, sql);
+
+	MemoryContextSwitchTo(oldcontext);
+	pgnq_workspace_end();
+
+	PG_RETURN_INT64((int64) fingerprint);
+}
+
+/*
+ * Return the ID of query in the pg_normalize_query_dictionary table, adding
+ * its normalized text there when it is new, so that tables storing many
+ * queries can keep a bigint instead of their text.
+ *
+ * Queries are identified by their fingerprint, as pg_normalize_query_agg()
+ * groups them, and the IDs are kept in a backend-local cache, so that the
+ * queries seen recently cost a parse and no access to the table.  Both the
+ * fingerprint and the stored text use PGNQ_INTERN_OPTIONS, as sessions with
+ * different settings share the dictionary.
+ */
+Datum
+pg_normalize_query_intern(PG_FUNCTION_ARGS)
+{
+	text	   *sql_t = PG_GETARG_TEXT_PP(0);
+	char	   *sql;
+	List	   *tree;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	uint64		fingerprint;
+	pgnqInternEntry *entry;
+	text	   *out;
+	int64		id;
+
+	pgnq_intern_setup(fcinfo->flinfo->fn_oid);
+
+	jstate = pgnq_workspace_begin();
+	jstate->options = PGNQ_INTERN_OPTIONS;
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
+	sql = text_to_cstring(sql_t);
+	tree = raw_parser(sql);
+	pgnq_const_record_walker((Node *) tree, jstate);
+	fingerprint = pgnq_fingerprint_query(jstate, sql);
+
+	entry = (pgnqInternEntry *) hash_search(pgnq_intern_cache, &fingerprint,
+											HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		pgnq_workspace_end();
+		PG_RETURN_INT64(entry->id);
+	}
+
+	pgnq_fill_in_constant_lengths(jstate, sql, 0);
+
+	/* Build the result where it survives the workspace */
+	MemoryContextSwitchTo(oldcontext);
+	out = pgnq_build_normalized_text(jstate, sql, 0, (int) strlen(sql));
+	pgnq_workspace_end();
+
+	id = pgnq_intern_store(fingerprint, out);
+
+	if (hash_get_num_entries(pgnq_intern_cache) >= PGNQ_INTERN_CACHE_SIZE)
+	{
+		hash_destroy(pgnq_intern_cache);
+		pgnq_intern_cache = NULL;
+		pgnq_intern_setup(fcinfo->flinfo->fn_oid);
+	}
+
+	entry = (pgnqInternEntry *) hash_search(pgnq_intern_cache, &fingerprint,
+											HASH_ENTER, NULL);
+	entry->id = id;
+
+	PG_RETURN_INT64(id);
+}
+
+/*
+ * Return the normalized query of a pg_normalize_query_intern() ID, or NULL
+ * if the dictionary doesn't have it
+ */
+Datum
+pg_normalize_query_resolve(PG_FUNCTION_ARGS)
+{
+	Datum		id = PG_GETARG_DATUM(0);
+	text	   *out = NULL;
+
+	pgnq_intern_setup(fcinfo->flinfo->fn_oid);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	if (SPI_execute_plan(pgnq_intern_resolve_plan, &id, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not look up the query dictionary");
+
+	if (SPI_processed > 0)
+	{
+		bool		isnull;
+		Datum		query;
+
+		query = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+							  &isnull);
+
+		/* Copy it out of the SPI memory */
+		out = (text *) SPI_datumTransfer(query, false, -1);
+	}
+
+	SPI_finish();
+
+	if (out == NULL)
+		PG_RETURN_NULL();
+	PG_RETURN_TEXT_P(out);
+}
+
+/*
+ * Statement trigger of pg_normalize_query_dictionary, so that deleting or
+ * updating rows empties the caches of pg_normalize_query_intern() in all
+ * backends, as truncating the table does, once the change is committed
+ */
+Datum
+pg_normalize_query_dictionary_invalidate(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("pg_normalize_query_dictionary_invalidate: not called by trigger manager")));
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Compute the query ID pg_stat_statements gives the statement in query,
+ * which must hold exactly one, so that log lines can be matched with its
+ * entries.
+ *
+ * Unlike the fingerprint, this requires parse analysis, so the statement
+ * must be valid against the current catalogs and search_path, and the
+ * relations it references stay locked until the end of the transaction.
+ * Results are remembered in the backend-local cache when it is enabled,
+ * until a catalog change might alter them.  NULL is returned for PREPARE, EXECUTE and
+ * DEALLOCATE, which pg_stat_statements does not track under their own text.
+ */
+Datum
+pg_normalize_query_queryid(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int			sql_len = strlen(sql);
+	StringInfoData key;
+	const char *cached;
+	int			cached_len;
+	List	   *tree;
+	RawStmt    *stmt;
+	uint64		queryid;
+
+	/* The result depends on who resolves the names, and how */
+	initStringInfo(&key);
+	appendBinaryStringInfo(&key, (char *) &pgnq_queryid_generation,
+						   sizeof(pgnq_queryid_generation));
+	appendStringInfo(&key, "%u %s", GetUserId(), namespace_search_path);
+	appendBinaryStringInfo(&key, "", 1);
+	appendBinaryStringInfo(&key, sql, sql_len);
+
+	if (pgnq_cache_lookup(key.data, key.len, PGNQ_OPT_QUERYID,
+						  &cached, &cached_len))
+	{
+		if (cached_len == 0)
+			PG_RETURN_NULL();
+		memcpy(&queryid, cached, sizeof(queryid));
+		PG_RETURN_INT64((int64) queryid);
+	}
+
+	tree = raw_parser(sql);
+	if (list_length(tree) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("query must contain exactly one statement")));
+	stmt = linitial_node(RawStmt, tree);
+
+	if (!pgnq_queryid_callbacks)
+	{
+		CacheRegisterRelcacheCallback(pgnq_queryid_relcache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(RELNAMENSP, pgnq_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(PROCOID, pgnq_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(TYPEOID, pgnq_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(OPEROID, pgnq_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(COLLOID, pgnq_queryid_syscache_callback, (Datum) 0);
+		pgnq_queryid_callbacks = true;
+	}
+
+	if (IsA(stmt->stmt, PrepareStmt) || IsA(stmt->stmt, ExecuteStmt) ||
+		IsA(stmt->stmt, DeallocateStmt))
+	{
+		pgnq_cache_insert(key.data, key.len, PGNQ_OPT_QUERYID, "", 0);
+		PG_RETURN_NULL();
+	}
+
+	queryid = pgnq_compute_queryid(sql, stmt);
+	pgnq_cache_insert(key.data, key.len, PGNQ_OPT_QUERYID,
+					  (const char *) &queryid, sizeof(queryid));
+
+	PG_RETURN_INT64((int64) queryid);
+}
+
+/*
+ * Normalize a query using only the core scanner.
+ *
+ * This skips raw_parser() altogether: constants are recognized from the
+ * token stream in a single scan.  It is faster, but does not check that the
+ * query is valid SQL and may give slightly different results, see README.
+ */
+Datum
+pg_normalize_query_fast(PG_FUNCTION_ARGS)
+{
+	text	   *sql_t = PG_GETARG_TEXT_PP(0);
+	char	   *sql;
+	pgnqConstLocations *jstate;
+	MemoryContext oldcontext;
+	text	   *out;
+
+	if (pgnq_prefilter &&
+		pgnq_skip_normalization(VARDATA_ANY(sql_t), VARSIZE_ANY_EXHDR(sql_t)))
+		PG_RETURN_TEXT_P(sql_t);
+
+	jstate = pgnq_workspace_begin();
+	oldcontext = MemoryContextSwitchTo(pgnq_scratch_context);
+
+	sql = text_to_cstring(sql_t);
+	pgnq_scan_constants(jstate, sql);
+
+	/* Build the result directly where it has to live */
+	MemoryContextSwitchTo(oldcontext);
+	out = pgnq_build_normalized_text(jstate, sql, 0, (int) strlen(sql));
+	pgnq_workspace_end();
+
+	PG_RETURN_TEXT_P(out);
+}
+
+/*
+ * Normalize each statement of a multi-statement string separately,
+ * returning one row per statement.
+ *
+ * The whole string is parsed once, on the first call, and each statement is
+ * then normalized from its location and length in the string, with its own
+ * $n numbering.
+ */
+Datum
+pg_normalize_query_statements(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	pgnqStatementsState *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		List	   *tree;
+		ListCell   *lc;
+		int			nstmts = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		state = (pgnqStatementsState *) palloc(sizeof(pgnqStatementsState));
+		state->query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		state->query_len = (int) strlen(state->query);
+
+		/* Parse the whole string */
+		tree = raw_parser(state->query);
+
+		state->stmts = (RawStmt **) palloc(Max(list_length(tree), 1) * sizeof(RawStmt *));
+		foreach(lc, tree)
+			state->stmts[nstmts++] = lfirst_node(RawStmt, lc);
+
+		/* Set up workspace for constant recording */
+		pgnq_init_const_locations(&state->jstate, pgnq_current_options());
+
+		funcctx->max_calls = nstmts;
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (pgnqStatementsState *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		text	   *out;
+
+		out = pgnq_normalize_statement(&state->jstate, state->query,
+									   state->query_len,
+									   state->stmts[funcctx->call_cntr]);
+
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(out));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Normalize each statement of a SQL script stored in a bytea value or a
+ * large object, like pg_dump output or migration scripts, returning one row
+ * per statement.
+ *
+ * Unlike pg_normalize_query_statements(), the script is never held in
+ * memory as a whole: it is read in slices and split one statement at a
+ * time with the core scanner, and the memory used to parse and normalize
+ * a statement is released before the next one, so that memory usage
+ * follows the size of the largest statement.  Leading line comments, psql
+ * meta-commands and the data of COPY FROM STDIN statements are skipped.
+ */
+Datum
+pg_normalize_script(PG_FUNCTION_ARGS)
+{
+	return pgnq_normalize_script(fcinfo, false);
+}
+
+/*
+ * Large object flavor of pg_normalize_script()
+ */
+Datum
+pg_normalize_script_lo(PG_FUNCTION_ARGS)
+{
+	return pgnq_normalize_script(fcinfo, true);
+}
+
+static Datum
+pgnq_normalize_script(FunctionCallInfo fcinfo, bool large_object)
+{
+	FuncCallContext *funcctx;
+	pgnqScriptState *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		state = (pgnqScriptState *) palloc0(sizeof(pgnqScriptState));
+
+		if (large_object)
+		{
+			Oid			lobjId = PG_GETARG_OID(0);
+
+			state->lobj = inv_open(lobjId, INV_READ, funcctx->multi_call_memory_ctx);
+
+#if PG_VERSION_NUM < 110000
+			/* Older versions leave the privilege check to inv_open() callers */
+			if (!lo_compat_privileges &&
+				pg_largeobject_aclcheck_snapshot(lobjId, GetUserId(), ACL_SELECT,
+												 state->lobj->snapshot) != ACLCHECK_OK)
+				ereport(ERROR,
+						(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						 errmsg("permission denied for large object %u", lobjId)));
+#endif
+
+			/* Close the large object if the caller stops fetching rows early */
+			if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo))
+			{
+				state->econtext = rsinfo->econtext;
+				RegisterExprContextCallback(state->econtext, pgnq_script_close,
+											PointerGetDatum(state));
+			}
+		}
+		else
+		{
+			struct varlena *script = (struct varlena *) PG_GETARG_POINTER(0);
+			bool		sliced = false;
+
+			/*
+			 * Values stored out of line without compression are read in
+			 * slices straight from the TOAST table, so only the pointer is
+			 * kept.  Others have to be decompressed as a whole anyway.
+			 */
+			if (VARATT_IS_EXTERNAL_ONDISK(script))
+			{
+				struct varatt_external toast_pointer;
+
+				VARATT_EXTERNAL_GET_POINTER(toast_pointer, script);
+				sliced = !VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer);
+			}
+
+			if (sliced)
+				state->script = datumCopy(PointerGetDatum(script), false, -1);
+			else
+				state->script = PointerGetDatum(PG_DETOAST_DATUM_COPY(PointerGetDatum(script)));
+		}
+
+		initStringInfo(&state->buf);
+		state->row_context = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
+												   "pg_normalize_script row",
+												   ALLOCSET_DEFAULT_SIZES);
+
+		/* Set up workspace for constant recording */
+		pgnq_init_const_locations(&state->jstate, pgnq_current_options());
+
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (pgnqScriptState *) funcctx->user_fctx;
+
+	for (;;)
+	{
+		MemoryContext oldcontext;
+		int			stmt_len;
+		char	   *stmt_text;
+		List	   *tree;
+		RawStmt    *stmt;
+		text	   *out;
+
+		CHECK_FOR_INTERRUPTS();
+
+		pgnq_script_skip_to_statement(state);
+		if (!pgnq_script_next_statement(state, &stmt_len))
+			break;
+
+		MemoryContextReset(state->row_context);
+		oldcontext = MemoryContextSwitchTo(state->row_context);
+
+		stmt_text = pnstrdup(state->buf.data + state->buf_pos, stmt_len);
+		state->buf_pos += stmt_len;
+
+		/* Past its terminating semicolon, if there is one */
+		if (state->buf_pos < state->buf.len)
+			state->buf_pos++;
+
+		pg_verifymbstr(stmt_text, stmt_len, false);
+		tree = raw_parser(stmt_text);
+
+		/* Nothing but comments */
+		if (tree == NIL)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			continue;
+		}
+
+		stmt = linitial_node(RawStmt, tree);
+		out = pgnq_normalize_statement(&state->jstate, stmt_text, stmt_len, stmt);
+
+		if (IsA(stmt->stmt, CopyStmt) &&
+			((CopyStmt *) stmt->stmt)->is_from &&
+			((CopyStmt *) stmt->stmt)->filename == NULL)
+			pgnq_script_skip_copy_data(state);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(out));
+	}
+
+	/* The state goes away with the multi-call context */
+	pgnq_script_close(PointerGetDatum(state));
+	if (state->econtext != NULL)
+		UnregisterExprContextCallback(state->econtext, pgnq_script_close,
+									  PointerGetDatum(state));
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Read a server log file and return its logged statements, normalized, with
+ * their duration when it was logged along with them.
+ *
+ * Statements logged by log_statement and log_min_duration_statement are
+ * returned, other entries are skipped.  Statements that can't be parsed are
+ * normalized as pg_try_normalize_query() does with lexer_fallback.
+ */
+Datum
+pg_normalize_log_file(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	pgnqLogReader *reader;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+		char	   *format;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		reader = (pgnqLogReader *) palloc0(sizeof(pgnqLogReader));
+		reader->tupdesc = BlessTupleDesc(tupdesc);
+		reader->path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+		format = text_to_cstring(PG_GETARG_TEXT_PP(1));
+		if (pg_strcasecmp(format, "stderr") == 0)
+			reader->format = PGNQ_LOG_STDERR;
+		else if (pg_strcasecmp(format, "csvlog") == 0)
+			reader->format = PGNQ_LOG_CSVLOG;
+		else if (pg_strcasecmp(format, "jsonlog") == 0)
+			reader->format = PGNQ_LOG_JSONLOG;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unrecognized log format \"%s\"", format),
+					 errhint("Valid formats are \"stderr\", \"csvlog\" and \"jsonlog\".")));
+
+		pgnq_check_log_path(reader->path);
+		reader->file = AllocateFile(reader->path, PG_BINARY_R);
+		if (reader->file == NULL)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\" for reading: %m",
+							reader->path)));
+
+		/* Close the file if the caller stops fetching rows before the end */
+		if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo))
+		{
+			reader->econtext = rsinfo->econtext;
+			RegisterExprContextCallback(reader->econtext, pgnq_log_reader_close,
+										PointerGetDatum(reader));
+		}
+
+		reader->buf = (char *) palloc(PGNQ_LOG_READ_SIZE);
+		initStringInfo(&reader->line);
+		initStringInfo(&reader->severity);
+		initStringInfo(&reader->message);
+		reader->row_context = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
+													"pg_normalize_log_file row",
+													ALLOCSET_DEFAULT_SIZES);
+
+		/* Set up workspace for constant recording */
+		pgnq_init_const_locations(&reader->jstate, pgnq_current_options());
+
+		funcctx->user_fctx = reader;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	reader = (pgnqLogReader *) funcctx->user_fctx;
+
+	while (reader->file != NULL && pgnq_log_read_entry(reader))
+	{
+		MemoryContext oldcontext;
+		char	   *stmt;
+		double		duration;
+		bool		has_duration;
+		Datum		values[2];
+		bool		nulls[2];
+		text	   *out;
+		HeapTuple	tuple;
+
+		CHECK_FOR_INTERRUPTS();
+
+		stmt = pgnq_log_statement(reader->message.data, &duration, &has_duration);
+		if (stmt == NULL)
+			continue;
+
+		MemoryContextReset(reader->row_context);
+		oldcontext = MemoryContextSwitchTo(reader->row_context);
+		out = pgnq_normalize_tolerant(&reader->jstate, stmt, (int) strlen(stmt), true);
+		MemoryContextSwitchTo(oldcontext);
+
+		if (out == NULL)
+			continue;
+
+		values[0] = PointerGetDatum(out);
+		nulls[0] = false;
+		values[1] = Float8GetDatum(duration);
+		nulls[1] = !has_duration;
+
+		tuple = heap_form_tuple(reader->tupdesc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	/* The reader goes away with the multi-call context */
+	pgnq_log_reader_close(PointerGetDatum(reader));
+	if (reader->econtext != NULL)
+		UnregisterExprContextCallback(reader->econtext, pgnq_log_reader_close,
+									  PointerGetDatum(reader));
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Normalize the queries stored in a column of a table using a pool of
+ * dynamic background workers, returning the normalized texts in no
+ * particular order.
+ *
+ * Each worker scans its own range of the table's blocks and sends back the
+ * results through a shared memory queue.  NULL values are skipped, and
+ * queries that can't be parsed are returned as NULL, as
+ * pg_try_normalize_query() does.  Workers scan the table with the active
+ * snapshot of the caller, so they see the rows the caller would, except for
+ * its own changes: see pgnq_check_parallel_scan().
+ */
+Datum
+pg_normalize_query_parallel(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	int			nworkers = PG_GETARG_INT32(2);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Relation	rel;
+	AttrNumber	attnum;
+	Oid			atttype;
+	AclResult	aclresult;
+	BlockNumber nblocks;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	dsm_segment *seg;
+	shm_toc_estimator e;
+	shm_toc    *toc;
+	Size		segsize;
+	Snapshot	snapshot = GetActiveSnapshot();
+	Size		snapshot_size = EstimateSnapshotSpace(snapshot);
+	char	   *snapshot_space;
+	pgnqWorkerShared *shared;
+	shm_mq_handle **mqh;
+	bool	   *detached;
+	int			nattached;
+	int			i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (nworkers < 1 || nworkers > max_worker_processes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of workers must be between 1 and max_worker_processes (%d)",
+						max_worker_processes)));
+
+	/*
+	 * Workers read the table directly, so check access here and keep the
+	 * lock until the end of the transaction.
+	 */
+	rel = relation_open(relid, AccessShareLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table or materialized view",
+						RelationGetRelationName(rel))));
+
+	attnum = get_attnum(relid, NameStr(*attname));
+	if (attnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						NameStr(*attname), RelationGetRelationName(rel))));
+
+	atttype = get_atttype(relid, attnum);
+	if (atttype != TEXTOID && atttype != VARCHAROID)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column \"%s\" of relation \"%s\" must be of type text",
+						NameStr(*attname), RelationGetRelationName(rel))));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclresult = pg_attribute_aclcheck(relid, attnum, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+#if PG_VERSION_NUM >= 110000
+		aclcheck_error(aclresult, OBJECT_TABLE, RelationGetRelationName(rel));
+#else
+		aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(rel));
+#endif
+
+	/* The workers' scans would bypass row level security */
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("row level security is enabled for relation \"%s\"",
+						RelationGetRelationName(rel))));
+
+	pgnq_check_parallel_scan(rel);
+
+	/*
+	 * Blocks added from now on only hold rows the snapshot of the workers
+	 * can't see.
+	 */
+	nblocks = RelationGetNumberOfBlocks(rel);
+	relation_close(rel, NoLock);
+
+	/* Set up the result */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+#if PG_VERSION_NUM >= 120000
+	tupdesc = CreateTemplateTupleDesc(1);
+#else
+	tupdesc = CreateTemplateTupleDesc(1, false);
+#endif
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pg_normalize_query_parallel",
+					   TEXTOID, -1, 0);
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+									 false, work_mem);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (nblocks == 0)
+		return (Datum) 0;
+
+	/* No point in having workers with nothing to scan */
+	nworkers = Min((BlockNumber) nworkers, nblocks);
+
+	/* Set up the shared memory with one queue per worker */
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, sizeof(pgnqWorkerShared));
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, PGNQ_WORKER_QUEUE_SIZE);
+	shm_toc_estimate_chunk(&e, snapshot_size);
+	shm_toc_estimate_keys(&e, 2 + nworkers);
+	segsize = shm_toc_estimate(&e);
+
+	seg = dsm_create(segsize, 0);
+	toc = shm_toc_create(PGNQ_WORKER_MAGIC, dsm_segment_address(seg), segsize);
+
+	shared = (pgnqWorkerShared *) shm_toc_allocate(toc, sizeof(pgnqWorkerShared));
+	shared->relid = relid;
+	shared->attnum = attnum;
+	shared->nblocks = nblocks;
+	shared->nworkers = nworkers;
+	shared->options = pgnq_current_options();
+	pg_atomic_init_u32(&shared->nfinished, 0);
+	shm_toc_insert(toc, 0, shared);
+
+	mqh = (shm_mq_handle **) palloc(nworkers * sizeof(shm_mq_handle *));
+	detached = (bool *) palloc0(nworkers * sizeof(bool));
+
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, PGNQ_WORKER_QUEUE_SIZE),
+						   PGNQ_WORKER_QUEUE_SIZE);
+		shm_toc_insert(toc, i + 1, mq);
+		shm_mq_set_receiver(mq, MyProc);
+		mqh[i] = shm_mq_attach(mq, seg, NULL);
+	}
+
+	/* The caller keeps its snapshot, and so its xmin, until we are done */
+	snapshot_space = shm_toc_allocate(toc, snapshot_size);
+	SerializeSnapshot(snapshot, snapshot_space);
+	shm_toc_insert(toc, nworkers + 1, snapshot_space);
+
+	/* Launch the workers */
+	for (i = 0; i < nworkers; i++)
+	{
+		BackgroundWorker worker;
+		BackgroundWorkerHandle *handle;
+		pgnqWorkerExtra extra;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_normalize_query");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_normalize_query_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_normalize_query worker %d", i + 1);
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_normalize_query worker");
+#endif
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+
+		extra.database_id = MyDatabaseId;
+		extra.user_id = GetUserId();
+		extra.worker = i;
+		memcpy(worker.bgw_extra, &extra, sizeof(extra));
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("could not register background process"),
+					 errhint("You may need to increase max_worker_processes.")));
+
+		/* Receiving fails instead of waiting forever if the worker dies */
+		shm_mq_set_handle(mqh[i], handle);
+	}
+
+	/* Collect results until every worker has detached from its queue */
+	nattached = nworkers;
+	while (nattached > 0)
+	{
+		bool		received = false;
+
+		for (i = 0; i < nworkers; i++)
+		{
+			shm_mq_result res;
+			Size		nbytes;
+			void	   *data;
+			Datum		value;
+			bool		isnull;
+
+			if (detached[i])
+				continue;
+
+			res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+			if (res == SHM_MQ_WOULD_BLOCK)
+				continue;
+			if (res == SHM_MQ_DETACHED)
+			{
+				detached[i] = true;
+				nattached--;
+				continue;
+			}
+
+			/* Each message is a flag byte, then the normalized text */
+			received = true;
+			isnull = (((char *) data)[0] == 'n');
+			value = isnull ? (Datum) 0 :
+				PointerGetDatum(cstring_to_text_with_len((char *) data + 1,
+														 (int) nbytes - 1));
+
+			tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+
+			if (!isnull)
+				pfree(DatumGetPointer(value));
+		}
+
+		if (!received && nattached > 0)
+		{
+#if PG_VERSION_NUM >= 120000
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, 0,
+							 PG_WAIT_EXTENSION);
+#else
+			if (WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0,
+						  PG_WAIT_EXTENSION) & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+#endif
+			ResetLatch(MyLatch);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	/* A worker that went away early has left part of the table unread */
+	if (pg_atomic_read_u32(&shared->nfinished) != (uint32) nworkers)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("%d of %d pg_normalize_query workers exited without finishing",
+						nworkers - (int) pg_atomic_read_u32(&shared->nfinished),
+						nworkers),
+				 errhint("More details may be available in the server log.")));
+
+	dsm_detach(seg);
+
+	return (Datum) 0;
+}
+
+/*
+ * Check that the workers of pg_normalize_query_parallel() can read a table
+ * as the caller would
+ *
+ * The workers run their own transactions, so they don't see the uncommitted
+ * changes of the caller's, and they would wait forever on a lock the caller
+ * holds while it waits for their results.  Only AccessExclusiveLock conflicts
+ * with their AccessShareLock, but any stronger lock than that one means that
+ * the caller is about to change the table, if it hasn't already.
+ */
+static void
+pgnq_check_parallel_scan(Relation rel)
+{
+	LOCKTAG		tag;
+	LOCKMODE	mode;
+
+	if (GetTopTransactionIdIfAny() != InvalidTransactionId)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+				 errmsg("pg_normalize_query_parallel() cannot be called in a transaction that has modified data")));
+
+	SET_LOCKTAG_RELATION(tag, rel->rd_lockInfo.lockRelId.dbId,
+						 rel->rd_lockInfo.lockRelId.relId);
+	for (mode = AccessShareLock + 1; mode <= MaxLockMode; mode++)
+	{
+		if (LockHeldByMe(&tag, mode))
+			ereport(ERROR,
+					(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+					 errmsg("pg_normalize_query_parallel() cannot read relation \"%s\" while holding a lock stronger than ACCESS SHARE on it",
+							RelationGetRelationName(rel))));
+	}
+
+	/* Temporary tables live in the local buffers of their session */
+	if (rel->rd_rel->relpersistence == RELPERSISTENCE_TEMP)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_normalize_query_parallel() cannot read temporary table \"%s\"",
+						RelationGetRelationName(rel))));
+}
+
+/*
+ * Entry point of the background workers started by
+ * pg_normalize_query_parallel()
+ */
+void
+pg_normalize_query_worker_main(Datum main_arg)
+{
+	pgnqWorkerExtra extra;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	pgnqWorkerShared *shared;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+
+	memcpy(&extra, MyBgworkerEntry->bgw_extra, sizeof(extra));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(extra.database_id, extra.user_id, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(extra.database_id, extra.user_id);
+#endif
+
+	/*
+	 * Everything happens in a single transaction, which owns the mapping of
+	 * the shared memory too.
+	 */
+	StartTransactionCommand();
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+
+	toc = shm_toc_attach(PGNQ_WORKER_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bad magic number in dynamic shared memory segment")));
+
+	shared = (pgnqWorkerShared *) shm_toc_lookup(toc, 0, false);
+	mq = (shm_mq *) shm_toc_lookup(toc, extra.worker + 1, false);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	PushActiveSnapshot(RestoreSnapshot(shm_toc_lookup(toc, shared->nworkers + 1,
+													  false)));
+	pgnq_worker_scan(shared, extra.worker, mqh);
+	PopActiveSnapshot();
+
+	pg_atomic_fetch_add_u32(&shared->nfinished, 1);
+	shm_mq_detach(mqh);
+	dsm_detach(seg);
+
+	CommitTransactionCommand();
+}
+
+/*
+ * Normalize the queries found in a worker's range of blocks, and send them
+ * to the leader
+ */
+static void
+pgnq_worker_scan(pgnqWorkerShared *shared, int worker, shm_mq_handle *mqh)
+{
+	BlockNumber chunk = (shared->nblocks + shared->nworkers - 1) / shared->nworkers;
+	BlockNumber start = chunk * worker;
+	Relation	rel;
+	TupleDesc	tupdesc;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc scan;
+#else
+	HeapScanDesc scan;
+#endif
+	HeapTuple	tuple;
+	MemoryContext row_context;
+	pgnqConstLocations jstate;
+
+	if (start >= shared->nblocks)
+		return;
+
+	rel = relation_open(shared->relid, AccessShareLock);
+	tupdesc = RelationGetDescr(rel);
+
+	/* No synchronized scan, which could move the start of the range */
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+#else
+	scan = heap_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+#endif
+	heap_setscanlimits(scan, start, Min(chunk, shared->nblocks - start));
+
+	row_context = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_normalize_query worker row",
+										ALLOCSET_DEFAULT_SIZES);
+
+	/* Normalize as the leader would, not with the defaults of the worker */
+	pgnq_init_const_locations(&jstate, shared->options);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		MemoryContext oldcontext;
+		Datum		value;
+		bool		isnull;
+		char	   *sql;
+		text	   *out;
+		shm_mq_iovec iov[2];
+		shm_mq_result res;
+
+		CHECK_FOR_INTERRUPTS();
+
+		value = heap_getattr(tuple, shared->attnum, tupdesc, &isnull);
+		if (isnull)
+			continue;
+
+		MemoryContextReset(row_context);
+		oldcontext = MemoryContextSwitchTo(row_context);
+
+		sql = text_to_cstring(DatumGetTextPP(value));
+		out = pgnq_normalize_tolerant(&jstate, sql, (int) strlen(sql), false);
+
+		iov[0].data = (out != NULL) ? "v" : "n";
+		iov[0].len = 1;
+		if (out != NULL)
+		{
+			iov[1].data = VARDATA(out);
+			iov[1].len = VARSIZE(out) - VARHDRSZ;
+		}
+
+		res = shm_mq_sendv(mqh, iov, (out != NULL) ? 2 : 1, false);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		if (res != SHM_MQ_SUCCESS)
+			ereport(ERROR,
+					(errcode(ERRCODE_ADMIN_SHUTDOWN),
+					 errmsg("pg_normalize_query_parallel() is not receiving results anymore")));
+	}
+
+#if PG_VERSION_NUM >= 120000
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+	relation_close(rel, AccessShareLock);
+}
+
+/*
+ * Get the workspace of the scalar functions ready for a new call.  The caller
+ * is expected to allocate in pgnq_scratch_context until pgnq_workspace_end().
+ */
+static pgnqConstLocations *
+pgnq_workspace_begin(void)
+{
+	if (pgnq_workspace_context == NULL)
+	{
+		MemoryContext oldcontext;
+
+		pgnq_workspace_context = AllocSetContextCreate(TopMemoryContext,
+													   "pg_normalize_query workspace",
+													   ALLOCSET_SMALL_SIZES);
+		pgnq_scratch_context = AllocSetContextCreate(pgnq_workspace_context,
+													 "pg_normalize_query scratch",
+													 PGNQ_SCRATCH_BLOCK_SIZE,
+													 PGNQ_SCRATCH_BLOCK_SIZE,
+													 ALLOCSET_DEFAULT_MAXSIZE);
+
+		oldcontext = MemoryContextSwitchTo(pgnq_workspace_context);
+		pgnq_init_const_locations(&pgnq_workspace, pgnq_current_options());
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* Clean up after a previous call that failed half-way */
+	MemoryContextReset(pgnq_scratch_context);
+
+	pgnq_workspace.clocations_count = 0;
+	pgnq_workspace.highest_extern_param_id = 0;
+	pgnq_workspace.options = pgnq_current_options();
+	pgnq_workspace.clocations_growths = 0;
+	pgnq_workspace.profile = NULL;
+
+	return &pgnq_workspace;
+}
+
+/*
+ * Release what a call of a scalar function allocated in the workspace
+ */
+static void
+pgnq_workspace_end(void)
+{
+	/* Don't hold on to the array for an exceptionally large query */
+	if (pgnq_workspace.clocations_buf_size > PGNQ_WORKSPACE_MAX_LOCATIONS)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pgnq_workspace_context);
+
+		pfree(pgnq_workspace.clocations);
+		pgnq_init_const_locations(&pgnq_workspace, pgnq_current_options());
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	MemoryContextReset(pgnq_scratch_context);
+}
+
+/*
+ * Normalization options selected by the current settings
+ */
+static int
+pgnq_current_options(void)
+{
+	int			options = 0;
+
+	if (pgnq_collapse_lists)
+		options |= PGNQ_OPT_COLLAPSE_LISTS;
+	if (pgnq_canonicalize_whitespace)
+		options |= PGNQ_OPT_CANONICAL_SPACE;
+	if (pgnq_fold_case)
+		options |= PGNQ_OPT_FOLD_CASE;
+
+	return options;
+}
+
+/*
+ * Can pg_normalize_query.prefilter return query as it is?  That's when the
+ * current options only replace constants, and none can be found in a single
+ * pass over the bytes, which is much cheaper than setting up the scanner,
+ * let alone parsing.
+ *
+ * This errs on the side of normalizing: a constant starts with a digit, a
+ * quote (bit, hexadecimal, escape and Unicode strings included) or a dollar
+ * quote, but the grammar also turns a few words into constants, see
+ * pgnq_is_constant_keyword().  Digits and dollar signs inside names, and
+ * parameters, are told apart the way the scanner does.  Words in comments
+ * and quoted names are taken at face value, which only costs a parse.
+ */
+static bool
+pgnq_skip_normalization(const char *query, int query_len)
+{
+	const unsigned char *p = (const unsigned char *) query;
+	const unsigned char *end = p + query_len;
+
+	if ((pgnq_current_options() & PGNQ_OPT_TOKEN_BUILD) != 0)
+		return false;
+
+	while (p < end)
+	{
+		const unsigned char *word;
+
+		if ((*p >= '0' && *p <= '9') || *p == '\'')
+			return false;
+
+		if (*p == '$')
+		{
+			/* $n is a parameter, anything else starts a dollar quote */
+			if (++p == end || *p < '0' || *p > '9')
+				return false;
+			while (p < end && *p >= '0' && *p <= '9')
+				p++;
+			continue;
+		}
+
+		if (!PGNQ_IS_IDENT_START(*p))
+		{
+			p++;
+			continue;
+		}
+
+		word = p++;
+		while (p < end && PGNQ_IS_IDENT_CONT(*p))
+			p++;
+
+		if (pgnq_is_constant_keyword((const char *) word, p - word))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Is word one that raw_parser() may turn into a located constant without
+ * any digit or quote in sight?  Those are NULL, TRUE, FALSE and LIMIT ALL,
+ * the fields taken by EXTRACT and INTERVAL, the forms of NORMALIZE and IS
+ * NORMALIZED, and the values of SET.  The constants the grammar makes up
+ * with no location, like the length of a bare char, don't count.
+ */
+static bool
+pgnq_is_constant_keyword(const char *word, int len)
+{
+	static const char *const keywords[] = {
+		"all", "extract", "false", "interval", "normalize", "normalized",
+		"null", "set", "true"
+	};
+	int			i;
+
+	for (i = 0; i < lengthof(keywords); i++)
+	{
+		if ((int) strlen(keywords[i]) == len &&
+			pg_strncasecmp(word, keywords[i], len) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Parse query and generate its normalized version.
+ *
+ * Returns a text datum allocated in result_context, so that callers working
+ * in a scratch context need not copy it out.
+ */
+static text *
+pgnq_normalize(pgnqConstLocations *jstate, const char *query, int query_len,
+			   MemoryContext result_context)
+{
+	List	   *tree;
+	text	   *out;
+	MemoryContext oldcontext;
+	instr_time	phase_start[PGNQ_NUM_PHASES + 1];
+
+	/* Parse query */
+	pgnq_stats_clock(&phase_start[PGNQ_PHASE_PARSE]);
+	tree = raw_parser(query);
+
+	/* Walk tree and record const locations */
+	pgnq_stats_clock(&phase_start[PGNQ_PHASE_WALK]);
+	jstate->clocations_count = 0;
+	jstate->highest_extern_param_id = 0;
+	pgnq_const_record_walker((Node *) tree, jstate);
+
+	/*
+	 * Get constants' lengths (core system only gives us locations).  Note
+	 * this also ensures the items are sorted by location.
+	 */
+	pgnq_stats_clock(&phase_start[PGNQ_PHASE_FILL]);
+	pgnq_fill_in_constant_lengths(jstate, query, 0);
+
+	/* Normalize query */
+	pgnq_stats_clock(&phase_start[PGNQ_PHASE_BUILD]);
+	oldcontext = MemoryContextSwitchTo(result_context);
+	out = pgnq_build_normalized_text(jstate, query, 0, query_len);
+	MemoryContextSwitchTo(oldcontext);
+
+	pgnq_stats_clock(&phase_start[PGNQ_NUM_PHASES]);
+	pgnq_stats_report(jstate, query_len, phase_start);
+
+	return out;
+}
+
+/*
+ * Read the clock for the phase timings, if they are collected
+ */
+static void
+pgnq_stats_clock(instr_time *t)
+{
+	if (pgnq_track_timing)
+		INSTR_TIME_SET_CURRENT(*t);
+}
+
+/*
+ * Count a query normalized by pgnq_normalize() in the stats of this backend,
+ * and in its shared memory slot if there is one.  phase_start holds the
+ * start time of each phase followed by the end time of the last one.
+ */
+static void
+pgnq_stats_report(pgnqConstLocations *jstate, int query_len,
+				  instr_time *phase_start)
+{
+	pgnqCounters delta;
+
+	memset(&delta, 0, sizeof(delta));
+	delta.calls = 1;
+	delta.total_bytes = query_len;
+	delta.max_bytes = query_len;
+	delta.constants = jstate->clocations_count;
+	delta.clocations_growths = jstate->clocations_growths;
+	jstate->clocations_growths = 0;
+
+	if (pgnq_track_timing)
+	{
+		int			i;
+
+		for (i = 0; i < PGNQ_NUM_PHASES; i++)
+		{
+			instr_time	t = phase_start[i + 1];
+
+			INSTR_TIME_SUBTRACT(t, phase_start[i]);
+			delta.phase_time[i] = INSTR_TIME_GET_MILLISEC(t);
+		}
+	}
+
+	pgnq_counters_add(&pgnq_stats, &delta);
+
+	if (pgnq_shared_stats != NULL && MyBackendId != InvalidBackendId &&
+		MyBackendId <= pgnq_shared_stats->nslots)
+	{
+		pgnqStatsSlot *slot = &pgnq_shared_stats->slots[MyBackendId - 1];
+		uint32		changecount = pg_atomic_read_u32(&slot->changecount);
+		uint32		generation = pg_atomic_read_u32(&pgnq_shared_stats->generation);
+
+		pg_atomic_write_u32(&slot->changecount, changecount + 1);
+		pg_write_barrier();
+
+		if (slot->generation != generation)
+		{
+			memset(&slot->counters, 0, sizeof(pgnqCounters));
+			slot->generation = generation;
+		}
+		pgnq_counters_add(&slot->counters, &delta);
+
+		pg_write_barrier();
+		pg_atomic_write_u32(&slot->changecount, changecount + 2);
+	}
+}
+
+/*
+ * Add the counters of src to dst
+ */
+static void
+pgnq_counters_add(pgnqCounters *dst, const pgnqCounters *src)
+{
+	int			i;
+
+	dst->calls += src->calls;
+	dst->total_bytes += src->total_bytes;
+	dst->max_bytes = Max(dst->max_bytes, src->max_bytes);
+	dst->constants += src->constants;
+	dst->clocations_growths += src->clocations_growths;
+	for (i = 0; i < PGNQ_NUM_PHASES; i++)
+		dst->phase_time[i] += src->phase_time[i];
+}
+
+/*
+ * Normalize query as pg_try_normalize_query() does, returning NULL if it is
+ * rejected by the parser and, with lexer_fallback, by the scanner too.  The
+ * query string may be truncated in place.
+ */
+static text *
+pgnq_normalize_tolerant(pgnqConstLocations *jstate, char *query, int query_len,
+						bool lexer_fallback)
+{
+	int			error_offset = -1;
+	text	   *out;
+
+	out = pgnq_try_normalize(jstate, query, query_len, false, &error_offset);
+
+	if (out == NULL && lexer_fallback)
+		out = pgnq_normalize_lexer_tolerant(jstate, query, query_len);
+
+	return out;
+}
+
+/*
+ * Normalize query using only the core scanner, returning NULL instead of
+ * raising an error.  If the scanner fails, e.g. on an unterminated quoted
+ * string, the text before the point of failure is normalized instead, which
+ * requires query to be writable.
+ */
+static text *
+pgnq_normalize_lexer_tolerant(pgnqConstLocations *jstate, char *query,
+							  int query_len)
+{
+	int			error_offset = -1;
+	text	   *out;
+
+	out = pgnq_try_normalize(jstate, query, query_len, true, &error_offset);
+
+	/* Keep the part of the text the scanner could read */
+	if (out == NULL && error_offset > 0 && error_offset < query_len)
+	{
+		query[error_offset] = '\0';
+		out = pgnq_try_normalize(jstate, query, error_offset, true,
+								 &error_offset);
+	}
+
+	return out;
+}
+
+/*
+ * Normalize query, returning NULL instead of raising an error if it is
+ * rejected by the parser, or by the scanner if lexer_only is set.  The byte
+ * offset where the error was found is then stored in *error_offset, or -1 if
+ * unknown.
+ *
+ * Parsing does not acquire any resources other than memory, so errors can be
+ * caught without a subtransaction as long as that memory is released.  All
+ * work is therefore done in a temporary context, but for the result, which
+ * is built last in the caller's context.
+ * Errors unrelated to the text of the query, such as query cancellation, are
+ * rethrown.
+ */
+static text *
+pgnq_try_normalize(pgnqConstLocations *jstate, const char *query,
+				   int query_len, bool lexer_only, int *error_offset)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	MemoryContext try_context;
+	text	   *volatile out = NULL;
+
+	try_context = AllocSetContextCreate(oldcontext,
+										"pg_try_normalize_query",
+										ALLOCSET_SMALL_SIZES);
+	MemoryContextSwitchTo(try_context);
+
+	PG_TRY();
+	{
+		/* The result is built last, directly in the caller's context */
+		if (lexer_only)
+		{
+			pgnq_scan_constants(jstate, query);
+			MemoryContextSwitchTo(oldcontext);
+			out = pgnq_build_normalized_text(jstate, query, 0, query_len);
+		}
+		else
+			out = pgnq_normalize_cached(jstate, query, query_len, oldcontext);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+
+		if (!pgnq_is_query_text_error(edata->sqlerrcode))
+			PG_RE_THROW();
+
+		FlushErrorState();
+
+		*error_offset = pgnq_cursorpos_offset(query, query_len, edata->cursorpos);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(try_context);
+
+	return out;
+}
+
+/*
+ * Can an error with this SQLSTATE be raised by the scanner or the grammar
+ * because of the query text?
+ */
+static bool
+pgnq_is_query_text_error(int sqlerrcode)
+{
+	switch (ERRCODE_TO_CATEGORY(sqlerrcode))
+	{
+		case ERRCODE_SYNTAX_ERROR_OR_ACCESS_RULE_VIOLATION:
+		case ERRCODE_DATA_EXCEPTION:
+			return true;
+
+		default:
+			break;
+	}
+
+	/* The grammar rejects some constructs it recognizes */
+	if (sqlerrcode == ERRCODE_FEATURE_NOT_SUPPORTED)
+		return true;
+
+	return false;
+}
+
+/*
+ * Convert an error cursor position, counted in characters from 1, to a byte
+ * offset in query.  Returns -1 if the position is unknown.
+ */
+static int
+pgnq_cursorpos_offset(const char *query, int query_len, int cursorpos)
+{
+	int			offset = 0;
+
+	if (cursorpos <= 0)
+		return -1;
+
+	while (--cursorpos > 0 && offset < query_len)
+		offset += pg_mblen(query + offset);
+
+	return Min(offset, query_len);
+}
+
+/*
+ * Return the next byte of a log file, or EOF
+ */
+static int
+pgnq_log_getc(pgnqLogReader *reader)
+{
+	if (reader->buf_pos >= reader->buf_len)
+	{
+		size_t		nread;
+
+		nread = fread(reader->buf, 1, PGNQ_LOG_READ_SIZE, reader->file);
+		if (nread == 0)
+		{
+			if (ferror(reader->file))
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read file \"%s\": %m", reader->path)));
+			return EOF;
+		}
+
+		reader->buf_len = (int) nread;
+		reader->buf_pos = 0;
+	}
+
+	return (unsigned char) reader->buf[reader->buf_pos++];
+}
+
+/*
+ * Return the next byte of a log file, or EOF, without consuming it
+ */
+static int
+pgnq_log_peekc(pgnqLogReader *reader)
+{
+	int			c = pgnq_log_getc(reader);
+
+	/* pgnq_log_getc() just returned it from the buffer */
+	if (c != EOF)
+		reader->buf_pos--;
+
+	return c;
+}
+
+/*
+ * Append the next line of a log file to dst, without its line terminator.
+ * Returns false at end of file.
+ */
+static bool
+pgnq_log_read_line(pgnqLogReader *reader, StringInfo dst)
+{
+	if (pgnq_log_peekc(reader) == EOF)
+		return false;
+
+	for (;;)
+	{
+		char	   *start = reader->buf + reader->buf_pos;
+		int			avail = reader->buf_len - reader->buf_pos;
+		char	   *eol = memchr(start, '\n', avail);
+
+		if (eol != NULL)
+		{
+			appendBinaryStringInfo(dst, start, eol - start);
+			reader->buf_pos += eol - start + 1;
+			break;
+		}
+
+		appendBinaryStringInfo(dst, start, avail);
+		reader->buf_pos = reader->buf_len;
+
+		if (pgnq_log_peekc(reader) == EOF)
+			break;
+	}
+
+	if (dst->len > 0 && dst->data[dst->len - 1] == '\r')
+		dst->data[--dst->len] = '\0';
+
+	return true;
+}
+
+/*
+ * Read the next csvlog entry, keeping only its severity and message fields.
+ * Quoted fields may span several lines.  Returns false at end of file.
+ */
+static bool
+pgnq_log_read_csv_entry(pgnqLogReader *reader)
+{
+	int			field = 0;
+	bool		in_quotes = false;
+	int			c;
+
+	resetStringInfo(&reader->severity);
+	resetStringInfo(&reader->message);
+
+	if (pgnq_log_peekc(reader) == EOF)
+		return false;
+
+	while ((c = pgnq_log_getc(reader)) != EOF)
+	{
+		if (in_quotes)
+		{
+			if (c == '"')
+			{
+				/* A doubled quote stands for itself */
+				if (pgnq_log_peekc(reader) != '"')
+				{
+					in_quotes = false;
+					continue;
+				}
+				pgnq_log_getc(reader);
+			}
+		}
+		else if (c == '"')
+		{
+			in_quotes = true;
+			continue;
+		}
+		else if (c == ',')
+		{
+			field++;
+			continue;
+		}
+		else if (c == '\n')
+			break;
+		else if (c == '\r')
+			continue;
+
+		if (field == PGNQ_CSVLOG_SEVERITY)
+			appendStringInfoChar(&reader->severity, (char) c);
+		else if (field == PGNQ_CSVLOG_MESSAGE)
+			appendStringInfoChar(&reader->message, (char) c);
+	}
+
+	return true;
+}
+
+/*
+ * Read log entries up to the next one with LOG severity, and put its message
+ * in reader->message.  Returns false at end of file.
+ */
+static bool
+pgnq_log_read_entry(pgnqLogReader *reader)
+{
+	for (;;)
+	{
+		char	   *p;
+
+		switch (reader->format)
+		{
+			case PGNQ_LOG_CSVLOG:
+				if (!pgnq_log_read_csv_entry(reader))
+					return false;
+				if (strcmp(reader->severity.data, "LOG") == 0)
+					return true;
+				break;
+
+			case PGNQ_LOG_JSONLOG:
+				resetStringInfo(&reader->line);
+				if (!pgnq_log_read_line(reader, &reader->line))
+					return false;
+
+				/*
+				 * Entries are written one per line with no whitespace between
+				 * tokens, so other entries are cheaply skipped before parsing
+				 * the JSON object.
+				 */
+				if (strstr(reader->line.data, "\"error_severity\":\"LOG\"") == NULL ||
+					strstr(reader->line.data, "\"message\":\"") == NULL)
+					break;
+
+				p = TextDatumGetCString(DirectFunctionCall2(json_object_field_text,
+															CStringGetTextDatum(reader->line.data),
+															CStringGetTextDatum("message")));
+				resetStringInfo(&reader->message);
+				appendStringInfoString(&reader->message, p);
+				pfree(p);
+				return true;
+
+			case PGNQ_LOG_STDERR:
+				resetStringInfo(&reader->line);
+				if (!pgnq_log_read_line(reader, &reader->line))
+					return false;
+
+				/* Lines starting with a tab continue the previous entry */
+				if (reader->line.data[0] == '\t')
+					break;
+
+				p = strstr(reader->line.data, "LOG:  ");
+				if (p == NULL)
+					break;
+
+				resetStringInfo(&reader->message);
+				appendStringInfoString(&reader->message, p + strlen("LOG:  "));
+
+				/* Add the lines of multi-line messages, without their tab */
+				while (pgnq_log_peekc(reader) == '\t')
+				{
+					pgnq_log_getc(reader);
+					appendStringInfoChar(&reader->message, '\n');
+					pgnq_log_read_line(reader, &reader->message);
+				}
+				return true;
+		}
+	}
+}
+
+/*
+ * Check that the user may read the file at path, canonicalizing it, with the
+ * rules of the server's own file access functions: members of
+ * pg_read_server_files can read any file, others only those under the data
+ * directory or log_directory.
+ */
+static void
+pgnq_check_log_path(char *path)
+{
+	canonicalize_path(path);
+
+#if PG_VERSION_NUM >= 110000
+	if (is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_SERVER_FILES))
+		return;
+#else
+	if (superuser())
+		return;
+#endif
+
+	if (is_absolute_path(path))
+	{
+		/* Disallow '/a/b/data/..' */
+		if (path_contains_parent_reference(path))
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 errmsg("reference to parent directory (\"..\") not allowed")));
+
+		/* log_directory may be outside of the data directory */
+		if (!path_is_prefix_of_path(DataDir, path) &&
+			(!is_absolute_path(Log_directory) ||
+			 !path_is_prefix_of_path(Log_directory, path)))
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 errmsg("absolute path not allowed")));
+	}
+	else if (!path_is_relative_and_below_cwd(path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("path must be in or below the current directory")));
+}
+
+/*
+ * Close the log file of a pg_normalize_log_file() call, once all rows are
+ * returned or when the caller shuts the function down early
+ */
+static void
+pgnq_log_reader_close(Datum arg)
+{
+	pgnqLogReader *reader = (pgnqLogReader *) DatumGetPointer(arg);
+
+	if (reader->file != NULL)
+	{
+		FreeFile(reader->file);
+		reader->file = NULL;
+	}
+}
+
+/*
+ * Read more of the script of a pg_normalize_script() call, so that buf
+ * holds at least needed bytes past buf_pos unless the script ends first.
+ * Returns the number of bytes available past buf_pos.
+ */
+static int
+pgnq_script_fill(pgnqScriptState *state, int needed)
+{
+	StringInfo	buf = &state->buf;
+
+	while (!state->eof && buf->len - state->buf_pos < needed)
+	{
+		int			nbytes = Max(PGNQ_SCRIPT_READ_SIZE,
+								 needed - (buf->len - state->buf_pos));
+		int			nread;
+
+		/* Drop what was already returned */
+		if (state->buf_pos > 0)
+		{
+			memmove(buf->data, buf->data + state->buf_pos,
+					buf->len - state->buf_pos);
+			buf->len -= state->buf_pos;
+			state->buf_pos = 0;
+		}
+
+		enlargeStringInfo(buf, nbytes);
+
+		if (state->lobj != NULL)
+			nread = inv_read(state->lobj, buf->data + buf->len, nbytes);
+		else
+		{
+			bytea	   *slice;
+
+			slice = DatumGetByteaPSlice(state->script, (int32) state->script_pos,
+										nbytes);
+			nread = VARSIZE(slice) - VARHDRSZ;
+			memcpy(buf->data + buf->len, VARDATA(slice), nread);
+			pfree(slice);
+			state->script_pos += nread;
+		}
+
+		buf->len += nread;
+		buf->data[buf->len] = '\0';
+
+		if (nread < nbytes)
+			state->eof = true;
+	}
+
+	return buf->len - state->buf_pos;
+}
+
+/*
+ * Find the first semicolon ending a statement in the len bytes at script,
+ * with the core scanner so that the ones in literals and comments are left
+ * alone.  As in psql, semicolons within parentheses don't end the statement,
+ * e.g. between the actions of CREATE RULE ... DO ALSO (...; ...).  Returns
+ * its offset, or -1 if there is none.
+ *
+ * Unless final is true, the text may stop in the middle of a literal or
+ * comment, so the scanner errors this causes only mean that more of the
+ * script is needed.
+ */
+static int
+pgnq_script_find_semicolon(char *script, int len, bool final)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	char		saved = script[len];
+	volatile int semicolon = -1;
+
+	/* The scanner wants a NUL-terminated string, and copies it */
+	script[len] = '\0';
+
+	PG_TRY();
+	{
+		const char *query = script;
+		core_yyscan_t yyscanner;
+		core_yy_extra_type yyextra;
+		core_YYSTYPE yylval;
+		YYLTYPE		yylloc;
+		int			tok;
+		int			paren_depth = 0;
+
+		/* initialize the flex scanner --- should match raw_parser() */
+		yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+
+		while ((tok = core_yylex(&yylval, &yylloc, yyscanner)) != 0)
+		{
+			if (tok == '(')
+				paren_depth++;
+			else if (tok == ')' && paren_depth > 0)
+				paren_depth--;
+			else if (tok == ';' && paren_depth == 0)
+			{
+				semicolon = yylloc;
+				break;
+			}
+		}
+
+		scanner_finish(yyscanner);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		script[len] = saved;
+
+		edata = CopyErrorData();
+		if (final || !pgnq_is_query_text_error(edata->sqlerrcode))
+			PG_RE_THROW();
+
+		FlushErrorState();
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	script[len] = saved;
+
+	return semicolon;
+}
+
+/*
+ * Find the end of the next statement of the script, starting at buf_pos,
+ * reading as much of the script as needed.  The statement is scanned with a
+ * window doubled until its semicolon shows up, so that a long statement
+ * costs a few scans of itself rather than one per slice read.  Returns
+ * false at the end of the script.
+ */
+static bool
+pgnq_script_next_statement(pgnqScriptState *state, int *stmt_len)
+{
+	int			scan_len = PGNQ_SCRIPT_SCAN_SIZE;
+
+	for (;;)
+	{
+		int			avail = pgnq_script_fill(state, scan_len);
+		int			len = Min(avail, scan_len);
+		bool		final = state->eof && len == avail;
+		int			semicolon;
+
+		if (avail == 0)
+			return false;
+
+		semicolon = pgnq_script_find_semicolon(state->buf.data + state->buf_pos,
+											   len, final);
+		if (semicolon >= 0)
+		{
+			*stmt_len = semicolon;
+			return true;
+		}
+
+		/* The last statement needs no semicolon */
+		if (final)
+		{
+			*stmt_len = avail;
+			return true;
+		}
+
+		scan_len *= 2;
+	}
+}
+
+/*
+ * Skip what comes before the next statement of the script: whitespace, line
+ * comments, like the headers pg_dump writes before each object, and the
+ * lines of psql meta-commands, like \connect
+ */
+static void
+pgnq_script_skip_to_statement(pgnqScriptState *state)
+{
+	bool		skip_line = false;
+
+	while (pgnq_script_fill(state, 2) > 0)
+	{
+		/* buf is NUL-terminated, so p[1] can be read at its last byte */
+		char	   *p = state->buf.data + state->buf_pos;
+
+		if (skip_line)
+		{
+			if (p[0] == '\n')
+				skip_line = false;
+		}
+		else if (p[0] == '\\' || (p[0] == '-' && p[1] == '-'))
+			skip_line = true;
+		else if (!scanner_isspace(p[0]))
+			break;
+
+		state->buf_pos++;
+	}
+}
+
+/*
+ * Skip the data following a COPY FROM STDIN statement: the rest of the
+ * line of the statement, then lines up to the one holding only "\."
+ */
+static void
+pgnq_script_skip_copy_data(pgnqScriptState *state)
+{
+	bool		first = true;
+
+	for (;;)
+	{
+		int			avail = pgnq_script_fill(state, 1);
+		char	   *line = state->buf.data + state->buf_pos;
+		char	   *eol;
+		int			line_len;
+
+		if (avail == 0)
+			return;
+
+		eol = memchr(line, '\n', avail);
+		if (eol == NULL)
+		{
+			/* Get the whole line, or the end of the script */
+			if (!state->eof)
+			{
+				pgnq_script_fill(state, avail + 1);
+				continue;
+			}
+			line_len = avail;
+		}
+		else
+			line_len = eol - line;
+
+		state->buf_pos += (eol != NULL) ? line_len + 1 : line_len;
+
+		if (line_len > 0 && line[line_len - 1] == '\r')
+			line_len--;
+
+		if (!first && line_len == 2 && line[0] == '\\' && line[1] == '.')
+			return;
+		first = false;
+	}
+}
+
+/*
+ * Close the large object of a pg_normalize_script() call, once all rows are
+ * returned or when the caller shuts the function down early
+ */
+static void
+pgnq_script_close(Datum arg)
+{
+	pgnqScriptState *state = (pgnqScriptState *) DatumGetPointer(arg);
+
+	if (state->lobj != NULL)
+	{
+		inv_close(state->lobj);
+		state->lobj = NULL;
+	}
+}
+
+/*
+ * emit_log_hook: normalize the statements logged by log_statement and
+ * log_min_duration_statement, when pg_normalize_query.log_normalize is on,
+ * and capture statements rejected by the parser
+ */
+static void
+pgnq_emit_log_hook(ErrorData *edata)
+{
+	if (pgnq_log_normalize && !pgnq_in_log_hook &&
+		(edata->elevel == LOG || edata->elevel == LOG_SERVER_ONLY) &&
+		edata->output_to_server && edata->message != NULL)
+		pgnq_normalize_log_message(edata);
+
+	/*
+	 * Statements with a syntax error never reach parse analysis, so they are
+	 * captured here.  Errors in statements run by functions carry their text
+	 * in internalquery and are not counted against the calling statement.
+	 */
+	if (pgnq_capture != NULL && edata->elevel == ERROR &&
+		edata->sqlerrcode == ERRCODE_SYNTAX_ERROR &&
+		edata->internalquery == NULL && debug_query_string != NULL)
+		pgnq_capture_add(debug_query_string, strlen(debug_query_string), true);
+
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
+}
+
+/*
+ * Replace the statement of a log message by its normalized text.
+ *
+ * We are in the middle of reporting the message here, where raising an error
+ * would lose it, and even catching one would flush the error data stack it is
+ * on.  So the statement is only normalized when it can't fail: it must be the
+ * statement being run, not text of the same form logged by, e.g., RAISE LOG,
+ * so the scanner already accepted it, and scanning it again gives the same
+ * result unless standard_conforming_strings has changed since then, which we
+ * can't know, so we only go ahead while it is on.  Only the scanner is used,
+ * as pg_normalize_query_fast() does, so that nothing else can fail.  Should
+ * it fail anyway, our state is restored before the error goes on.  The size
+ * limit bounds the time spent in the logging path.
+ */
+static void
+pgnq_normalize_log_message(ErrorData *edata)
+{
+	char	   *stmt;
+	double		duration;
+	bool		has_duration;
+	int			stmt_len;
+	int			prefix_len;
+	int			out_len;
+	bool		save_escape_string_warning;
+	pgnqConstLocations jstate;
+	MemoryContext oldcontext;
+	text	   *volatile out = NULL;
+	char	   *message;
+
+	stmt = pgnq_log_statement(edata->message, &duration, &has_duration);
+	if (stmt == NULL || debug_query_string == NULL ||
+		strcmp(stmt, debug_query_string) != 0)
+		return;
+
+	stmt_len = strlen(stmt);
+	if (stmt_len > pgnq_log_normalize_max_size * 1024L ||
+		!standard_conforming_strings)
+		return;
+
+	if (pgnq_log_context == NULL)
+		pgnq_log_context = AllocSetContextCreate(TopMemoryContext,
+												 "pg_normalize_query log",
+												 ALLOCSET_DEFAULT_SIZES);
+
+	/* The scanner must not report warnings about the statement again */
+	save_escape_string_warning = escape_string_warning;
+	escape_string_warning = false;
+	pgnq_in_log_hook = true;
+
+	oldcontext = MemoryContextSwitchTo(pgnq_log_context);
+
+	PG_TRY();
+	{
+		pgnq_init_const_locations(&jstate, pgnq_current_options());
+		pgnq_scan_constants(&jstate, stmt);
+		out = pgnq_build_normalized_text(&jstate, stmt, 0, stmt_len);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(pgnq_log_context);
+		pgnq_in_log_hook = false;
+		escape_string_warning = save_escape_string_warning;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgnq_in_log_hook = false;
+	escape_string_warning = save_escape_string_warning;
+
+	/* Messages belong to ErrorContext, which is current here */
+	prefix_len = stmt - edata->message;
+	out_len = VARSIZE(out) - VARHDRSZ;
+	message = palloc(prefix_len + out_len + 1);
+	memcpy(message, edata->message, prefix_len);
+	memcpy(message + prefix_len, VARDATA(out), out_len);
+	message[prefix_len + out_len] = '\0';
+
+	pfree(edata->message);
+	edata->message = message;
+
+	MemoryContextReset(pgnq_log_context);
+}
+
+/*
+ * Normalize one statement of an already parsed query_len bytes long string.
+ *
+ * The statement text is trimmed of surrounding whitespace, as
+ * pg_stat_statements does.  Returns a palloc'd text datum.
+ */
+static text *
+pgnq_normalize_statement(pgnqConstLocations *jstate, const char *query,
+						 int query_len, RawStmt *stmt)
+{
+	int			stmt_loc = Max(stmt->stmt_location, 0);
+	int			stmt_len = stmt->stmt_len;
+	char	   *stmt_text;
+	text	   *out;
+
+	/* A length of zero means "rest of string" */
+	if (stmt_len <= 0)
+		stmt_len = query_len - stmt_loc;
+
+	while (stmt_len > 0 && scanner_isspace(query[stmt_loc]))
+	{
+		stmt_loc++;
+		stmt_len--;
+	}
+	while (stmt_len > 0 && scanner_isspace(query[stmt_loc + stmt_len - 1]))
+		stmt_len--;
+
+	/* Walk the statement and record const locations */
+	jstate->clocations_count = 0;
+	jstate->highest_extern_param_id = 0;
+	pgnq_const_record_walker((Node *) stmt, jstate);
+
+	/*
+	 * The scanner only gets to see this statement, so that long scripts are
+	 * not copied once per statement.
+	 */
+	stmt_text = pnstrdup(query + stmt_loc, stmt_len);
+	pgnq_fill_in_constant_lengths(jstate, stmt_text, stmt_loc);
+
+	out = pgnq_build_normalized_text(jstate, stmt_text, stmt_loc, stmt_len);
+	pfree(stmt_text);
+
+	return out;
+}
+
+/*
+ * Like pgnq_normalize(), but serve repeated inputs from the backend-local
+ * and shared caches without parsing them, and remember new results there.
+ *
+ * Returns a text datum allocated in result_context.
+ */
+static text *
+pgnq_normalize_cached(pgnqConstLocations *jstate, const char *query,
+					  int query_len, MemoryContext result_context)
+{
+	const char *cached;
+	int			cached_len;
+	text	   *out;
+	int			options = jstate->options;
+	MemoryContext oldcontext;
+
+	/* Repeated inputs are served from the cache without parsing */
+	if (pgnq_cache_lookup(query, query_len, options, &cached, &cached_len))
+	{
+		oldcontext = MemoryContextSwitchTo(result_context);
+		out = cstring_to_text_with_len(cached, cached_len);
+		MemoryContextSwitchTo(oldcontext);
+		return out;
+	}
+
+	/* Then try results already computed by other backends */
+	oldcontext = MemoryContextSwitchTo(result_context);
+	out = pgnq_shared_cache_lookup(query, query_len, options);
+	MemoryContextSwitchTo(oldcontext);
+	if (out != NULL)
+	{
+		pgnq_cache_insert(query, query_len, options,
+						  VARDATA(out), VARSIZE(out) - VARHDRSZ);
+		return out;
+	}
+
+	out = pgnq_normalize(jstate, query, query_len, result_context);
+
+	pgnq_cache_insert(query, query_len, options,
+					  VARDATA(out), VARSIZE(out) - VARHDRSZ);
+	pgnq_shared_cache_insert(query, query_len, options,
+							 VARDATA(out), VARSIZE(out) - VARHDRSZ);
+
+	return out;
+}
+
+/*
+ * Report hit/miss counters and current size of the backend-local cache
+ */
+Datum
+pg_normalize_query_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(pgnq_cache_hits);
+	values[1] = Int64GetDatum(pgnq_cache_misses);
+	values[2] = Int64GetDatum(pgnq_cache_evictions);
+	values[3] = Int64GetDatum(pgnq_cache ? (int64) hash_get_num_entries(pgnq_cache) : 0);
+	values[4] = Int64GetDatum((int64) pgnq_cache_memory);
+	values[5] = Int64GetDatum(pgnq_shared_cache_hits);
+	values[6] = Int64GetDatum(pgnq_shared_cache_misses);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Discard all cached entries and reset the counters
+ */
+Datum
+pg_normalize_query_cache_reset(PG_FUNCTION_ARGS)
+{
+	if (pgnq_cache_context != NULL)
+	{
+		MemoryContextDelete(pgnq_cache_context);
+		pgnq_cache_context = NULL;
+		pgnq_cache = NULL;
+	}
+	dlist_init(&pgnq_cache_lru);
+	pgnq_cache_memory = 0;
+
+	pgnq_cache_hits = 0;
+	pgnq_cache_misses = 0;
+	pgnq_cache_evictions = 0;
+	pgnq_shared_cache_hits = 0;
+	pgnq_shared_cache_misses = 0;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Return the queries captured in shared memory
+ */
+Datum
+pg_normalized_queries(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgnqCaptureEntry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	pgnq_capture_check_enabled();
+
+	/* Include what this backend has seen so far */
+	pgnq_capture_flush();
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+									 false, work_mem);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgnq_capture->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgnq_capture_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[4];
+		bool		nulls[4];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(entry->key.dbid);
+		values[1] = PointerGetDatum(cstring_to_text_with_len(entry->query,
+															 entry->query_len));
+		values[2] = Int64GetDatum(entry->calls);
+		values[3] = Int64GetDatum(entry->syntax_errors);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		pfree(DatumGetPointer(values[1]));
+	}
+
+	LWLockRelease(pgnq_capture->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Discard all captured queries
+ */
+Datum
+pg_normalized_queries_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgnqCaptureEntry *entry;
+
+	pgnq_capture_check_enabled();
+
+	pgnq_capture_npending = 0;
+	MemoryContextReset(pgnq_capture_context);
+
+	LWLockAcquire(pgnq_capture->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgnq_capture_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pgnq_capture_hash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(pgnq_capture->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Sample the normalized queries of live backends, reading the backend status
+ * array directly rather than through pg_stat_activity.
+ *
+ * Texts that may have been cut at track_activity_query_size seldom parse, so
+ * they go straight to the lexer-only normalization.  Queries that still
+ * can't be normalized are returned as NULL, as are the queries of other
+ * users unless the caller may see them in pg_stat_activity.
+ */
+Datum
+pg_normalized_activity(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	MemoryContext row_context;
+	pgnqConstLocations jstate;
+	bool		read_all;
+	int			truncated_len;
+	int			num_backends;
+	int			beid;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+									 false, work_mem);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
+	row_context = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_normalized_activity",
+										ALLOCSET_DEFAULT_SIZES);
+
+	read_all = is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
+
+	/* The clipping may leave up to one character less than the limit */
+	truncated_len = pgstat_track_activity_query_size - pg_database_encoding_max_length();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (beid = 1; beid <= num_backends; beid++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(beid);
+		const char *state;
+		text	   *out = NULL;
+		Datum		values[3];
+		bool		nulls[3];
+
+		if (beentry == NULL)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		MemoryContextReset(row_context);
+		oldcontext = MemoryContextSwitchTo(row_context);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(beentry->st_procpid);
+
+		/* Like pg_stat_activity, show only the pid of other users' sessions */
+		state = NULL;
+		if (read_all || has_privs_of_role(GetUserId(), beentry->st_userid))
+		{
+			state = pgnq_backend_state_name(beentry->st_state);
+
+#if PG_VERSION_NUM >= 110000
+			char	   *activity = pgstat_clip_activity(beentry->st_activity_raw);
+#else
+			char	   *activity = pstrdup(beentry->st_activity);
+#endif
+			int			activity_len = strlen(activity);
+
+			if (activity_len >= truncated_len)
+				out = pgnq_normalize_lexer_tolerant(&jstate, activity, activity_len);
+			else
+				out = pgnq_normalize_tolerant(&jstate, activity, activity_len, true);
+		}
+
+		if (state != NULL)
+			values[1] = CStringGetTextDatum(state);
+		else
+			nulls[1] = true;
+
+		if (out != NULL)
+			values[2] = PointerGetDatum(out);
+		else
+			nulls[2] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	MemoryContextDelete(row_context);
+
+	return (Datum) 0;
+}
+
+/*
+ * Name of a backend state, as shown by pg_stat_activity
+ */
+static const char *
+pgnq_backend_state_name(BackendState state)
+{
+	switch (state)
+	{
+		case STATE_IDLE:
+			return "idle";
+		case STATE_RUNNING:
+			return "active";
+		case STATE_IDLEINTRANSACTION:
+			return "idle in transaction";
+		case STATE_FASTPATH:
+			return "fastpath function call";
+		case STATE_IDLEINTRANSACTION_ABORTED:
+			return "idle in transaction (aborted)";
+		case STATE_DISABLED:
+			return "disabled";
+		case STATE_UNDEFINED:
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Microbenchmark of the normalization of one query, used by bench/bench.sql.
+ *
+ * The query is normalized iterations times, bypassing the caches, and the
+ * average time per call is returned together with the memory taken by the
+ * allocations of a single call.
+ */
+Datum
+pg_normalize_query_bench(PG_FUNCTION_ARGS)
+{
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int			iterations = PG_GETARG_INT32(1);
+	bool		lexer_only = PG_GETARG_BOOL(2);
+	int			query_len = strlen(query);
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3];
+	MemoryContext bench_context;
+	MemoryContext oldcontext;
+	instr_time	start;
+	instr_time	duration;
+	Size		allocated;
+	int			i;
+
+	if (iterations < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of iterations must be at least 1")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/*
+	 * Measure memory on a first, untimed call, in a context small enough for
+	 * its initial block not to hide what the call needs.
+	 */
+	bench_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "pg_normalize_query bench",
+										  ALLOCSET_SMALL_SIZES);
+	oldcontext = MemoryContextSwitchTo(bench_context);
+	pgnq_bench_normalize(query, query_len, lexer_only);
+	allocated = pgnq_context_allocated(bench_context);
+	MemoryContextReset(bench_context);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++)
+	{
+		pgnq_bench_normalize(query, query_len, lexer_only);
+		MemoryContextReset(bench_context);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(bench_context);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) iterations);
+	values[1] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+	values[2] = Int64GetDatum((int64) allocated);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Normalize one query and report where the time and memory went, to help
+ * understand pathological inputs
+ */
+Datum
+pg_normalize_query_profile(PG_FUNCTION_ARGS)
+{
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int			query_len = strlen(query);
+	TupleDesc	tupdesc;
+	Datum		values[12];
+	bool		nulls[12];
+	MemoryContext profile_context;
+	MemoryContext oldcontext;
+	pgnqConstLocations jstate;
+	pgnqProfile profile;
+	instr_time	lap;
+	double		parse_time = 0;
+	double		walk_time = 0;
+	double		build_time = 0;
+	List	   *tree;
+	text	   *out;
+	int			constants;
+	Size		peak_memory;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Work in a context of our own, freed at once afterwards */
+	profile_context = AllocSetContextCreate(CurrentMemoryContext,
+											"pg_normalize_query profile",
+											ALLOCSET_SMALL_SIZES);
+	oldcontext = MemoryContextSwitchTo(profile_context);
+
+	memset(&profile, 0, sizeof(profile));
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
+	jstate.profile = &profile;
+
+	/* The same steps as pgnq_normalize(), timed one by one */
+	INSTR_TIME_SET_CURRENT(lap);
+	tree = raw_parser(query);
+	pgnq_profile_lap(&lap, &parse_time);
+
+	pgnq_const_record_walker((Node *) tree, &jstate);
+	constants = jstate.clocations_count;
+	pgnq_profile_lap(&lap, &walk_time);
+
+	/* This one times its sort and rescan parts itself */
+	pgnq_fill_in_constant_lengths(&jstate, query, 0);
+
+	INSTR_TIME_SET_CURRENT(lap);
+	out = pgnq_build_normalized_text(&jstate, query, 0, query_len);
+	pgnq_profile_lap(&lap, &build_time);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Tracking the memory slows allocations down, so it is not timed */
+	peak_memory = pgnq_profile_peak_memory(query, query_len);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = PointerGetDatum(cstring_to_text_with_len(VARDATA(out),
+														 VARSIZE(out) - VARHDRSZ));
+	values[1] = Int64GetDatum((int64) query_len);
+	values[2] = Int64GetDatum((int64) constants);
+	values[3] = Int64GetDatum(profile.duplicates);
+	values[4] = Int64GetDatum(profile.tokens);
+	values[5] = Int32GetDatum(profile.max_depth);
+	values[6] = Int64GetDatum((int64) peak_memory);
+	values[7] = Float8GetDatum(parse_time);
+	values[8] = Float8GetDatum(walk_time);
+	values[9] = Float8GetDatum(profile.sort_time);
+	values[10] = Float8GetDatum(profile.rescan_time);
+	values[11] = Float8GetDatum(build_time);
+
+	MemoryContextDelete(profile_context);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * One normalization run by pg_normalize_query_bench(), the way
+ * pg_normalize_query() or pg_normalize_query_fast() do it
+ */
+static void
+pgnq_bench_normalize(const char *query, int query_len, bool lexer_only)
+{
+	pgnqConstLocations jstate;
+
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
+
+	if (lexer_only)
+	{
+		pgnq_scan_constants(&jstate, query);
+		(void) pgnq_build_normalized_text(&jstate, query, 0, query_len);
+	}
+	else
+		(void) pgnq_normalize(&jstate, query, query_len, CurrentMemoryContext);
+}
+
+/*
+ * Bytes of memory blocks taken by a memory context.  Child contexts are not
+ * included.
+ */
+static Size
+pgnq_context_allocated(MemoryContext context)
+{
+	MemoryContextCounters counters;
+
+	memset(&counters, 0, sizeof(counters));
+#if PG_VERSION_NUM >= 110000
+	context->methods->stats(context, NULL, NULL, &counters);
+#else
+	context->methods->stats(context, 0, false, &counters);
+#endif
+
+	return counters.totalspace;
+}
+
+/*
+ * Normalize query once more in a context of its own, and return the most
+ * memory that context held at once.
+ *
+ * Memory freed along the way, like the buffers of the scanner, is returned
+ * to malloc, so it is gone by the end of each step.  The allocation methods
+ * of the context are therefore wrapped to check its size after each
+ * allocation, which walks all its blocks: the run is kept apart from the
+ * timed one of pg_normalize_query_profile().
+ */
+static Size
+pgnq_profile_peak_memory(const char *query, int query_len)
+{
+	MemoryContext peak_context;
+	MemoryContext oldcontext;
+	pgnqConstLocations jstate;
+	List	   *tree;
+	Size		peak;
+
+	peak_context = AllocSetContextCreate(CurrentMemoryContext,
+										 "pg_normalize_query peak memory",
+										 ALLOCSET_SMALL_SIZES);
+	pgnq_profile_base_methods = peak_context->methods;
+	pgnq_profile_methods = *pgnq_profile_base_methods;
+	pgnq_profile_methods.alloc = pgnq_profile_alloc;
+	pgnq_profile_methods.realloc = pgnq_profile_realloc;
+	peak_context->methods = &pgnq_profile_methods;
+	pgnq_profile_peak = pgnq_context_allocated(peak_context);
+	oldcontext = MemoryContextSwitchTo(peak_context);
+
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
+	tree = raw_parser(query);
+	pgnq_const_record_walker((Node *) tree, &jstate);
+	pgnq_fill_in_constant_lengths(&jstate, query, 0);
+	(void) pgnq_build_normalized_text(&jstate, query, 0, query_len);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Leave the context as AllocSetContextCreate() made it */
+	peak = pgnq_profile_peak;
+	peak_context->methods = pgnq_profile_base_methods;
+	MemoryContextDelete(peak_context);
+
+	return peak;
+}
+
+/*
+ * Allocation methods of the pgnq_profile_peak_memory() context, keeping
+ * track of the most memory it held
+ */
+static void *
+pgnq_profile_alloc(MemoryContext context, Size size)
+{
+	void	   *pointer = pgnq_profile_base_methods->alloc(context, size);
+
+	pgnq_profile_peak = Max(pgnq_profile_peak, pgnq_context_allocated(context));
+
+	return pointer;
+}
+
+static void *
+pgnq_profile_realloc(MemoryContext context, void *pointer, Size size)
+{
+	pointer = pgnq_profile_base_methods->realloc(context, pointer, size);
+
+	pgnq_profile_peak = Max(pgnq_profile_peak, pgnq_context_allocated(context));
+
+	return pointer;
+}
+
+/*
+ * Report the normalization stats of this backend and, when shared memory is
+ * available, of the whole server
+ */
+Datum
+pg_normalize_query_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	pgnqCounters server;
+	int			i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+									 false, work_mem);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgnq_stats_put_row(tupstore, tupdesc, "backend", &pgnq_stats);
+
+	if (pgnq_shared_stats == NULL)
+		return (Datum) 0;
+
+	memset(&server, 0, sizeof(server));
+	for (i = 0; i < pgnq_shared_stats->nslots; i++)
+	{
+		pgnqStatsSlot *slot = &pgnq_shared_stats->slots[i];
+		pgnqCounters counters;
+		uint32		generation = 0;
+
+		for (;;)
+		{
+			uint32		changecount = pg_atomic_read_u32(&slot->changecount);
+
+			if ((changecount & 1) == 0)
+			{
+				pg_read_barrier();
+				generation = slot->generation;
+				memcpy(&counters, &slot->counters, sizeof(pgnqCounters));
+				pg_read_barrier();
+
+				if (pg_atomic_read_u32(&slot->changecount) == changecount)
+					break;
+			}
+
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (generation == pg_atomic_read_u32(&pgnq_shared_stats->generation))
+			pgnq_counters_add(&server, &counters);
+	}
+
+	pgnq_stats_put_row(tupstore, tupdesc, "server", &server);
+
+	return (Datum) 0;
+}
+
+/*
+ * Discard the normalization stats of this backend and of the whole server
+ */
+Datum
+pg_normalize_query_stats_reset(PG_FUNCTION_ARGS)
+{
+	memset(&pgnq_stats, 0, sizeof(pgnq_stats));
+
+	if (pgnq_shared_stats != NULL)
+		pg_atomic_fetch_add_u32(&pgnq_shared_stats->generation, 1);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Add a row of pg_normalize_query_stats() output
+ */
+static void
+pgnq_stats_put_row(Tuplestorestate *tupstore, TupleDesc tupdesc,
+				   const char *scope, const pgnqCounters *counters)
+{
+	Datum		values[6 + PGNQ_NUM_PHASES];
+	bool		nulls[6 + PGNQ_NUM_PHASES];
+	int			i = 0;
+	int			phase;
+
+	memset(nulls, 0, sizeof(nulls));
+	values[i++] = CStringGetTextDatum(scope);
+	values[i++] = Int64GetDatum(counters->calls);
+	values[i++] = Int64GetDatum(counters->total_bytes);
+	values[i++] = Int64GetDatum(counters->max_bytes);
+	values[i++] = Int64GetDatum(counters->constants);
+	values[i++] = Int64GetDatum(counters->clocations_growths);
+	for (phase = 0; phase < PGNQ_NUM_PHASES; phase++)
+		values[i++] = Float8GetDatum(counters->phase_time[phase]);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Number of shared memory stats slots, one per possible backend ID.
+ * MaxBackends is not computed yet when shared memory is requested, so work
+ * it out the same way.
+ */
+static int
+pgnq_stats_nslots(void)
+{
+	int			nslots = MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes;
+
+#if PG_VERSION_NUM >= 120000
+	nslots += max_wal_senders;
+#endif
+
+	return nslots;
+}
+
+/*
+ * Estimate shared memory space needed by the server-wide stats
+ */
+static Size
+pgnq_stats_memsize(void)
+{
+	return add_size(offsetof(pgnqStatsShared, slots),
+					mul_size(pgnq_stats_nslots(), sizeof(pgnqStatsSlot)));
+}
+
+/*
+ * Hash of the input text, mixed with the options it is normalized with, used
+ * by both caches
+ */
+static uint32
+pgnq_cache_hash(const char *query, int query_len, int options)
+{
+	uint32		hash;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) query, query_len));
+
+	return hash ^ ((uint32) options * 0x9e3779b9);
+}
+
+/*
+ * Shrink the cache right away when its size limit is lowered
+ */
+static void
+pgnq_cache_size_assign(int newval, void *extra)
+{
+	pgnq_cache_evict((Size) newval * 1024);
+}
+
+/*
+ * Evict least recently used entries until the cache fits in limit bytes
+ */
+static void
+pgnq_cache_evict(Size limit)
+{
+	while (pgnq_cache_memory > limit && !dlist_is_empty(&pgnq_cache_lru))
+	{
+		pgnqCacheEntry *entry;
+
+		entry = dlist_tail_element(pgnqCacheEntry, lru_node, &pgnq_cache_lru);
+		dlist_delete(&entry->lru_node);
+		pgnq_cache_memory -= entry->size;
+		pfree(entry->query);
+		hash_search(pgnq_cache, &entry->hash, HASH_REMOVE, NULL);
+		pgnq_cache_evictions++;
+	}
+}
+
+/*
+ * Look up the normalized form of query in the cache.
+ *
+ * On a hit, *result points into the cache entry and is only valid until the
+ * next cache modification.
+ */
+static bool
+pgnq_cache_lookup(const char *query, int query_len, int options,
+				  const char **result, int *result_len)
+{
+	pgnqCacheEntry *entry;
+	uint32		hash;
+
+	if (pgnq_cache_size <= 0)
+		return false;
+
+	if (pgnq_cache == NULL)
+	{
+		pgnq_cache_misses++;
+		return false;
+	}
+
+	hash = pgnq_cache_hash(query, query_len, options);
+	entry = (pgnqCacheEntry *) hash_search(pgnq_cache, &hash, HASH_FIND, NULL);
+
+	/* Hash collisions are treated as misses */
+	if (entry == NULL || entry->options != options ||
+		entry->query_len != query_len ||
+		memcmp(entry->query, query, query_len) != 0)
+	{
+		pgnq_cache_misses++;
+		return false;
+	}
+
+	dlist_move_head(&pgnq_cache_lru, &entry->lru_node);
+	pgnq_cache_hits++;
+
+	*result = entry->result;
+	*result_len = entry->result_len;
+	return true;
+}
+
+/*
+ * Remember the normalized form of query, evicting older entries as needed
+ */
+static void
+pgnq_cache_insert(const char *query, int query_len, int options,
+				  const char *result, int result_len)
+{
+	pgnqCacheEntry *entry;
+	Size		limit = (Size) pgnq_cache_size * 1024;
+	Size		size;
+	uint32		hash;
+	bool		found;
+	char	   *copy;
+
+	if (pgnq_cache_size <= 0)
+		return;
+
+	size = sizeof(pgnqCacheEntry) + query_len + result_len + 2;
+	if (size > limit)
+		return;
+
+	if (pgnq_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		pgnq_cache_context = AllocSetContextCreate(TopMemoryContext,
+												   "pg_normalize_query cache",
+												   ALLOCSET_DEFAULT_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(pgnqCacheEntry);
+		ctl.hcxt = pgnq_cache_context;
+		pgnq_cache = hash_create("pg_normalize_query cache", 256, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	/*
+	 * Copy the texts first, so that running out of memory leaves the hash
+	 * table and the LRU list as they were
+	 */
+	copy = MemoryContextAlloc(pgnq_cache_context, query_len + result_len + 2);
+	memcpy(copy, query, query_len);
+	copy[query_len] = '\0';
+	memcpy(copy + query_len + 1, result, result_len);
+	copy[query_len + 1 + result_len] = '\0';
+
+	hash = pgnq_cache_hash(query, query_len, options);
+	PG_TRY();
+	{
+		entry = (pgnqCacheEntry *) hash_search(pgnq_cache, &hash, HASH_ENTER,
+											   &found);
+	}
+	PG_CATCH();
+	{
+		pfree(copy);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* Replace whatever text was cached under the same hash */
+	if (found)
+	{
+		dlist_delete(&entry->lru_node);
+		pgnq_cache_memory -= entry->size;
+		pfree(entry->query);
+	}
+
+	entry->query = copy;
+	entry->query_len = query_len;
+	entry->result = copy + query_len + 1;
+	entry->result_len = result_len;
+	entry->options = options;
+	entry->size = size;
+
+	dlist_push_head(&pgnq_cache_lru, &entry->lru_node);
+	pgnq_cache_memory += size;
+
+	pgnq_cache_evict(limit);
+}
+
+/*
+ * Size of one shared cache slot, header included
+ */
+static Size
+pgnq_shared_cache_slot_size(void)
+{
+	return MAXALIGN(offsetof(pgnqSharedSlot, data) +
+					(Size) pgnq_shared_cache_entry_size * 1024);
+}
+
+/*
+ * Estimate shared memory space needed, or zero if the shared cache is off
+ */
+static Size
+pgnq_shared_cache_memsize(void)
+{
+	Size		slot_size = pgnq_shared_cache_slot_size();
+	Size		nslots = (Size) pgnq_shared_cache_size * 1024 / slot_size;
+
+	if (nslots == 0)
+		return 0;
+
+	return add_size(MAXALIGN(sizeof(pgnqSharedCache)), mul_size(nslots, slot_size));
+}
+
+/*
+ * shmem_startup hook: allocate or attach to shared memory
+ */
+static void
+pgnq_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	/* reset in case this is a restart within the postmaster */
+	pgnq_shared_cache = NULL;
+	pgnq_capture = NULL;
+	pgnq_capture_hash = NULL;
+	pgnq_shared_stats = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pgnq_shared_stats = ShmemInitStruct("pg_normalize_query stats",
+										pgnq_stats_memsize(),
+										&found);
+	if (!found)
+	{
+		int			i;
+
+		pg_atomic_init_u32(&pgnq_shared_stats->generation, 0);
+		pgnq_shared_stats->nslots = pgnq_stats_nslots();
+
+		for (i = 0; i < pgnq_shared_stats->nslots; i++)
+		{
+			pgnqStatsSlot *slot = &pgnq_shared_stats->slots[i];
+
+			pg_atomic_init_u32(&slot->changecount, 0);
+			slot->generation = 0;
+			memset(&slot->counters, 0, sizeof(pgnqCounters));
+		}
+	}
+
+	if (pgnq_capture_memsize() > 0)
+	{
+		HASHCTL		info;
+
+		pgnq_capture = ShmemInitStruct("pg_normalize_query capture",
+									   sizeof(pgnqCaptureShared),
+									   &found);
+		if (!found)
+			pgnq_capture->lock = &(GetNamedLWLockTranche("pg_normalize_query"))->lock;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgnqCaptureKey);
+		info.entrysize = sizeof(pgnqCaptureEntry);
+		pgnq_capture_hash = ShmemInitHash("pg_normalize_query captured queries",
+										  pgnq_capture_max, pgnq_capture_max,
+										  &info,
+										  HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (pgnq_shared_cache_memsize() == 0)
+	{
+		LWLockRelease(AddinShmemInitLock);
+		return;
+	}
+
+	pgnq_shared_cache = ShmemInitStruct("pg_normalize_query shared cache",
+										pgnq_shared_cache_memsize(),
+										&found);
+
+	if (!found)
+	{
+		int			i;
+
+		/* First time through ... */
+		pgnq_shared_cache->slot_size = pgnq_shared_cache_slot_size();
+		pgnq_shared_cache->nslots = (int) ((Size) pgnq_shared_cache_size * 1024 /
+										   pgnq_shared_cache->slot_size);
+
+		for (i = 0; i < pgnq_shared_cache->nslots; i++)
+		{
+			pgnqSharedSlot *slot = PGNQ_SHARED_SLOT(pgnq_shared_cache, i);
+
+			pg_atomic_init_u32(&slot->version, 0);
+			slot->hash = 0;
+			slot->options = 0;
+			slot->query_len = -1;
+			slot->result_len = 0;
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Look up the normalized form of query in the shared cache.
+ *
+ * On a hit, returns a palloc'd text datum holding a copy of the normalized
+ * text, otherwise NULL.
+ */
+static text *
+pgnq_shared_cache_lookup(const char *query, int query_len, int options)
+{
+	pgnqSharedSlot *slot;
+	uint32		hash;
+	uint32		version;
+	int			len;
+	text	   *buf;
+
+	if (pgnq_shared_cache == NULL)
+		return NULL;
+
+	hash = pgnq_cache_hash(query, query_len, options);
+	slot = PGNQ_SHARED_SLOT(pgnq_shared_cache, hash % pgnq_shared_cache->nslots);
+
+	version = pg_atomic_read_u32(&slot->version);
+	if ((version & 1) != 0)
+		goto miss;				/* being rewritten right now */
+
+	pg_read_barrier();
+
+	/*
+	 * The slot can be overwritten while we look at it, so check lengths
+	 * before trusting them and validate everything afterwards.
+	 */
+	len = slot->result_len;
+	if (slot->hash != hash || slot->options != options ||
+		slot->query_len != query_len ||
+		len < 0 || (Size) query_len + len > PGNQ_SHARED_SLOT_CAPACITY(pgnq_shared_cache) ||
+		memcmp(slot->data, query, query_len) != 0)
+		goto miss;
+
+	buf = (text *) palloc(VARHDRSZ + len);
+	SET_VARSIZE(buf, VARHDRSZ + len);
+	memcpy(VARDATA(buf), slot->data + query_len, len);
+
+	pg_read_barrier();
+
+	if (pg_atomic_read_u32(&slot->version) != version)
+	{
+		pfree(buf);
+		goto miss;
+	}
+
+	pgnq_shared_cache_hits++;
+	return buf;
+
+miss:
+	pgnq_shared_cache_misses++;
+	return NULL;
+}
+
+/*
+ * Publish the normalized form of query to the shared cache
+ */
+static void
+pgnq_shared_cache_insert(const char *query, int query_len, int options,
+						 const char *result, int result_len)
+{
+	pgnqSharedSlot *slot;
+	uint32		hash;
+	uint32		version;
+
+	if (pgnq_shared_cache == NULL ||
+		(Size) query_len + result_len > PGNQ_SHARED_SLOT_CAPACITY(pgnq_shared_cache))
+		return;
+
+	hash = pgnq_cache_hash(query, query_len, options);
+	slot = PGNQ_SHARED_SLOT(pgnq_shared_cache, hash % pgnq_shared_cache->nslots);
+
+	/* Leave the slot alone if another backend is writing it */
+	version = pg_atomic_read_u32(&slot->version);
+	if ((version & 1) != 0 ||
+		!pg_atomic_compare_exchange_u32(&slot->version, &version, version + 1))
+		return;
+
+	slot->hash = hash;
+	slot->options = options;
+	slot->query_len = query_len;
+	slot->result_len = result_len;
+	memcpy(slot->data, query, query_len);
+	memcpy(slot->data + query_len, result, result_len);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&slot->version, version + 2);
+}
+
+/*
+ * Estimate shared memory space needed by the query capture, or zero if it is
+ * off
+ */
+static Size
+pgnq_capture_memsize(void)
+{
+	if (pgnq_capture_max <= 0)
+		return 0;
+
+	return add_size(MAXALIGN(sizeof(pgnqCaptureShared)),
+					hash_estimate_size(pgnq_capture_max, sizeof(pgnqCaptureEntry)));
+}
+
+/*
+ * post_parse_analyze hook: capture every statement that was parsed, including
+ * utility statements and those that won't get planned or executed
+ */
+static void
+pgnq_post_parse_analyze(ParseState *pstate, Query *query)
+{
+	const char *stmt = pstate->p_sourcetext;
+	int			stmt_loc;
+	int			stmt_len;
+
+	if (prev_post_parse_analyze_hook)
+		prev_post_parse_analyze_hook(pstate, query);
+
+	if (pgnq_capture == NULL || stmt == NULL)
+		return;
+
+	/* A length of zero means "rest of string" */
+	stmt_loc = Max(query->stmt_location, 0);
+	stmt_len = query->stmt_len;
+	if (stmt_len <= 0)
+		stmt_len = strlen(stmt + stmt_loc);
+
+	while (stmt_len > 0 && scanner_isspace(stmt[stmt_loc]))
+	{
+		stmt_loc++;
+		stmt_len--;
+	}
+	while (stmt_len > 0 && scanner_isspace(stmt[stmt_loc + stmt_len - 1]))
+		stmt_len--;
+
+	if (!pgnq_capture_exit_registered)
+	{
+		before_shmem_exit(pgnq_capture_shmem_exit, (Datum) 0);
+		pgnq_capture_exit_registered = true;
+	}
+
+	pgnq_capture_add(stmt + stmt_loc, stmt_len, false);
+
+	/* The statement start time is already known, so checking is cheap */
+	if (pgnq_capture_npending >= PGNQ_CAPTURE_PENDING_SIZE ||
+		TimestampDifferenceExceeds(pgnq_capture_last_flush,
+								   GetCurrentStatementStartTimestamp(),
+								   PGNQ_CAPTURE_FLUSH_INTERVAL))
+		pgnq_capture_flush_quietly();
+}
+
+/*
+ * Remember a statement until the next flush.
+ *
+ * This is also called while an error is being reported, so it must not raise
+ * one: statements are dropped if there is no room or memory for them.
+ */
+static void
+pgnq_capture_add(const char *query, int query_len, bool syntax_error)
+{
+	pgnqCapturePending *pending;
+	char	   *copy;
+
+	if (pgnq_capture_npending >= PGNQ_CAPTURE_PENDING_SIZE)
+		return;
+
+	copy = MemoryContextAllocExtended(pgnq_capture_context, query_len + 1,
+									  MCXT_ALLOC_NO_OOM);
+	if (copy == NULL)
+		return;
+
+	memcpy(copy, query, query_len);
+	copy[query_len] = '\0';
+
+	pending = &pgnq_capture_pending[pgnq_capture_npending++];
+	pending->query = copy;
+	pending->query_len = query_len;
+	pending->syntax_error = syntax_error;
+}
+
+/*
+ * Normalize the statements captured by this backend and fold them into the
+ * shared hash table
+ */
+static void
+pgnq_capture_flush(void)
+{
+	int			npending = pgnq_capture_npending;
+	pgnqConstLocations jstate;
+	MemoryContext oldcontext;
+	text	  **normalized;
+	pgnqCaptureVictim *victims;
+	int			nvictims;
+	int			i;
+
+	if (pgnq_capture == NULL || npending == 0)
+		return;
+
+	/* Forget the batch first, so that a failure doesn't make us retry it */
+	pgnq_capture_npending = 0;
+	pgnq_capture_last_flush = GetCurrentTimestamp();
+
+	oldcontext = MemoryContextSwitchTo(pgnq_capture_context);
+
+	/*
+	 * Normalize before taking the lock.  Statements with a syntax error are
+	 * normalized by the scanner instead.
+	 */
+	pgnq_init_const_locations(&jstate, pgnq_current_options());
+	normalized = (text **) palloc(npending * sizeof(text *));
+	for (i = 0; i < npending; i++)
+		normalized[i] = pgnq_normalize_tolerant(&jstate,
+												pgnq_capture_pending[i].query,
+												pgnq_capture_pending[i].query_len,
+												true);
+
+	victims = pgnq_capture_pick_victims(normalized, npending, &nvictims);
+
+	LWLockAcquire(pgnq_capture->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < npending; i++)
+	{
+		if (normalized[i] == NULL)
+			continue;
+
+		pgnq_capture_store(VARDATA(normalized[i]),
+						   VARSIZE(normalized[i]) - VARHDRSZ,
+						   pgnq_capture_pending[i].syntax_error,
+						   victims, &nvictims);
+	}
+
+	LWLockRelease(pgnq_capture->lock);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(pgnq_capture_context);
+}
+
+/*
+ * Flush from the post_parse_analyze hook, where a failure must not make the
+ * statement being parsed fail: errors are only logged, and interrupts are
+ * held meanwhile, so that cancelling is left to the statement.
+ */
+static void
+pgnq_capture_flush_quietly(void)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	HOLD_INTERRUPTS();
+
+	PG_TRY();
+	{
+		pgnq_capture_flush();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		/* Besides memory, the flush only acquires the capture lock */
+		if (LWLockHeldByMe(pgnq_capture->lock))
+			LWLockRelease(pgnq_capture->lock);
+		MemoryContextReset(pgnq_capture_context);
+
+		ereport(LOG,
+				(errmsg("could not add captured statements to pg_normalized_queries: %s",
+						edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	RESUME_INTERRUPTS();
+}
+
+/*
+ * Choose the entries to evict if adding the n normalized texts would
+ * overflow the capture hash table, returning them with their number in
+ * *nvictims.  They are the least used ones, sorted under a shared lock only,
+ * so they may have been used or removed by the time they are evicted.
+ */
+static pgnqCaptureVictim *
+pgnq_capture_pick_victims(text **normalized, int n, int *nvictims)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgnqCaptureEntry *entry;
+	pgnqCaptureVictim *victims;
+	long		nentries;
+	int			nnew = 0;
+	int			ncandidates = 0;
+	int			i;
+
+	*nvictims = 0;
+
+	LWLockAcquire(pgnq_capture->lock, LW_SHARED);
+
+	nentries = hash_get_num_entries(pgnq_capture_hash);
+	if (nentries + n > pgnq_capture_max)
+	{
+		for (i = 0; i < n; i++)
+		{
+			pgnqCaptureKey key;
+
+			if (normalized[i] == NULL)
+				continue;
+
+			pgnq_capture_make_key(VARDATA(normalized[i]),
+								  VARSIZE(normalized[i]) - VARHDRSZ, &key);
+			if (hash_search(pgnq_capture_hash, &key, HASH_FIND, NULL) == NULL)
+				nnew++;
+		}
+	}
+
+	if (nentries + nnew <= pgnq_capture_max)
+	{
+		LWLockRelease(pgnq_capture->lock);
+		return NULL;
+	}
+
+	victims = (pgnqCaptureVictim *) palloc(Max(nentries, 1) * sizeof(pgnqCaptureVictim));
+
+	hash_seq_init(&hash_seq, pgnq_capture_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		victims[ncandidates].key = entry->key;
+		victims[ncandidates].usage = entry->calls + entry->syntax_errors;
+		ncandidates++;
+	}
+
+	LWLockRelease(pgnq_capture->lock);
+
+	qsort(victims, ncandidates, sizeof(pgnqCaptureVictim), pgnq_capture_entry_cmp);
+
+	/* Make room for the whole batch at once */
+	*nvictims = Max(nentries + nnew - pgnq_capture_max,
+					ncandidates * PGNQ_CAPTURE_EVICT_PERCENT / 100);
+	*nvictims = Min(*nvictims, ncandidates);
+
+	return victims;
+}
+
+/*
+ * Compute the key of a normalized query in the capture hash table
+ */
+static void
+pgnq_capture_make_key(const char *query, int query_len, pgnqCaptureKey *key)
+{
+	/* Clear padding too, keys are compared as blobs */
+	memset(key, 0, sizeof(pgnqCaptureKey));
+	key->dbid = MyDatabaseId;
+	key->hash = pgnq_hash_bytes(PGNQ_FNV_OFFSET_BASIS, query, query_len);
+}
+
+/*
+ * Count one more occurrence of a normalized query.  If the hash table is
+ * full, the victims chosen by pgnq_capture_pick_victims() are evicted, and
+ * once they are used up new queries are dropped until the next flush.
+ * Caller must hold the capture lock exclusively.
+ */
+static void
+pgnq_capture_store(const char *query, int query_len, bool syntax_error,
+				   pgnqCaptureVictim *victims, int *nvictims)
+{
+	pgnqCaptureKey key;
+	pgnqCaptureEntry *entry;
+	bool		found;
+
+	pgnq_capture_make_key(query, query_len, &key);
+
+	entry = (pgnqCaptureEntry *) hash_search(pgnq_capture_hash, &key,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(pgnq_capture_hash) >= pgnq_capture_max)
+		{
+			pgnq_capture_evict(victims, *nvictims);
+			*nvictims = 0;
+
+			if (hash_get_num_entries(pgnq_capture_hash) >= pgnq_capture_max)
+				return;
+		}
+
+		entry = (pgnqCaptureEntry *) hash_search(pgnq_capture_hash, &key,
+												 HASH_ENTER, &found);
+		entry->calls = 0;
+		entry->syntax_errors = 0;
+		entry->query_len = pg_mbcliplen(query, query_len, PGNQ_CAPTURE_TEXT_SIZE);
+		memcpy(entry->query, query, entry->query_len);
+	}
+
+	if (syntax_error)
+		entry->syntax_errors++;
+	else
+		entry->calls++;
+}
+
+/*
+ * Make room in the capture hash table by removing the victims that are still
+ * there.  Caller must hold the capture lock exclusively.
+ */
+static void
+pgnq_capture_evict(const pgnqCaptureVictim *victims, int nvictims)
+{
+	int			i;
+
+	for (i = 0; i < nvictims; i++)
+		hash_search(pgnq_capture_hash, &victims[i].key, HASH_REMOVE, NULL);
+}
+
+/*
+ * qsort comparator for sorting eviction candidates by usage
+ */
+static int
+pgnq_capture_entry_cmp(const void *a, const void *b)
+{
+	int64		ua = ((const pgnqCaptureVictim *) a)->usage;
+	int64		ub = ((const pgnqCaptureVictim *) b)->usage;
+
+	if (ua < ub)
+		return -1;
+	else if (ua > ub)
+		return 1;
+	else
+		return 0;
+}
+
+/*
+ * Flush the statements captured by a backend before it exits
+ */
+static void
+pgnq_capture_shmem_exit(int code, Datum arg)
+{
+	/* Don't try to do anything more when exiting because of an error */
+	if (code != 0)
+		return;
+
+	pgnq_capture_flush();
+}
+
+/*
+ * Complain if the query capture is not set up
+ */
+static void
+pgnq_capture_check_enabled(void)
+{
+	if (pgnq_capture == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query capture is not enabled"),
+				 errhint("Add pg_normalize_query to shared_preload_libraries and set pg_normalize_query.capture_max.")));
+}
+
+/*
+ * Decide whether a '-' following the given token is a unary minus that
+ * should be folded into the next numeric constant, as the grammar does.
+ *
+ * That is the case after operators, opening brackets, commas and most
+ * reserved keywords, but not after anything that can end an operand.
+ * Non-reserved keywords can be used as column names, so they are assumed
+ * to end operands.
+ */
+static bool
+pgnq_minus_is_unary(int prev_tok, const char *prev_keyword)
+{
+	int			category;
+
+	switch (prev_tok)
+	{
+		case 0:					/* start of query */
+		case '(':
+		case '[':
+		case ',':
+		case ';':
+		case '=':
+		case '<':
+		case '>':
+		case '+':
+		case '-':
+		case '*':
+		case '/':
+		case '%':
+		case '^':
+		case Op:
+		case LESS_EQUALS:
+		case GREATER_EQUALS:
+		case NOT_EQUALS:
+		case EQUALS_GREATER:
+		case COLON_EQUALS:
+			return true;
+
+		case IDENT:
+		case FCONST:
+		case SCONST:
+		case BCONST:
+		case XCONST:
+		case ICONST:
+		case PARAM:
+		case TYPECAST:
+		case DOT_DOT:
+#if PG_VERSION_NUM >= 130000
+		case UIDENT:
+		case USCONST:
+#endif
+			return false;
+
+			/* Reserved keywords that end an operand */
+		case CURRENT_CATALOG:
+		case CURRENT_DATE:
+		case CURRENT_ROLE:
+		case CURRENT_TIME:
+		case CURRENT_TIMESTAMP:
+		case CURRENT_USER:
+		case END_P:
+		case FALSE_P:
+		case LOCALTIME:
+		case LOCALTIMESTAMP:
+		case NULL_P:
+		case SESSION_USER:
+		case TRUE_P:
+		case USER:
+			return false;
+
+		default:
+			break;
+	}
+
+	/* Any other single-character token, like ')' or ']', ends an operand */
+	if (prev_tok < 256 || prev_keyword == NULL)
+		return false;
+
+#if PG_VERSION_NUM >= 120000
+	{
+		int			kwnum = ScanKeywordLookup(prev_keyword, &ScanKeywords);
+
+		if (kwnum < 0)
+			return false;
+		category = ScanKeywordCategories[kwnum];
+	}
+#else
+	{
+		const ScanKeyword *keyword = ScanKeywordLookup(prev_keyword, ScanKeywords,
+													   NumScanKeywords);
+
+		if (keyword == NULL)
+			return false;
+		category = keyword->category;
+	}
+#endif
+
+	return category == RESERVED_KEYWORD;
+}
+
+/*
+ * Record the locations and lengths of constants using only the core
+ * scanner, for pg_normalize_query_fast().
+ *
+ * Every SCONST, ICONST, FCONST, BCONST and XCONST token is taken as a
+ * constant, together with a preceding unary minus for numeric ones.  The
+ * records come out sorted by location, ready for
+ * pgnq_build_normalized_query().
+ */
+static void
+pgnq_scan_constants(pgnqConstLocations *jstate, const char *query)
+{
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			prev_tok = 0;
+	const char *prev_keyword = NULL;
+	int			minus_loc = -1;
+
+	jstate->clocations_count = 0;
+	jstate->highest_extern_param_id = 0;
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+
+	for (;;)
+	{
+		int			tok = core_yylex(&yylval, &yylloc, yyscanner);
+		int			loc;
+
+		if (tok == 0)
+			break;
+
+		switch (tok)
+		{
+			case ICONST:
+			case FCONST:
+			case SCONST:
+			case BCONST:
+			case XCONST:
+#if PG_VERSION_NUM >= 130000
+			case USCONST:
+#endif
+				loc = yylloc;
+				if (minus_loc >= 0 && (tok == ICONST || tok == FCONST))
+					loc = minus_loc;
+
+				pgnq_record_const_location(jstate, loc);
+				jstate->clocations[jstate->clocations_count - 1].length =
+					pgnq_scanned_constant_length(&yyextra, loc);
+				break;
+
+			case PARAM:
+				if (yylval.ival > jstate->highest_extern_param_id)
+					jstate->highest_extern_param_id = yylval.ival;
+				break;
+
+			default:
+				break;
+		}
+
+		if (tok == '-' && pgnq_minus_is_unary(prev_tok, prev_keyword))
+			minus_loc = yylloc;
+		else
+			minus_loc = -1;
+
+		prev_tok = tok;
+		prev_keyword = (tok >= 256) ? yylval.keyword : NULL;
+	}
+
+	scanner_finish(yyscanner);
+}
+
+/*
+ * Add len bytes of data to a 64-bit FNV-1a hash
+ */
+static uint64
+pgnq_hash_bytes(uint64 hash, const void *data, Size len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	while (len-- > 0)
+	{
+		hash ^= *p++;
+		hash *= PGNQ_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * Add one token to a fingerprint.  The kind byte and the terminating zero
+ * keep, e.g., a keyword apart from a quoted identifier with the same name.
+ */
+static uint64
+pgnq_hash_token(uint64 hash, char kind, const char *str)
+{
+	hash = pgnq_hash_bytes(hash, &kind, 1);
+	return pgnq_hash_bytes(hash, str, strlen(str) + 1);
+}
+
+/*
+ * Create an empty pg_normalize_query_agg() state in context
+ */
+static pgnqAggState *
+pgnq_agg_state_create(MemoryContext context)
+{
+	pgnqAggState *state;
+	HASHCTL		ctl;
+
+	state = (pgnqAggState *) MemoryContextAlloc(context, sizeof(pgnqAggState));
+	state->context = context;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(pgnqAggGroup);
+	ctl.hcxt = context;
+	state->groups = hash_create("pg_normalize_query_agg groups", 64, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	return state;
+}
+
+/*
+ * Add calls and total_duration to the group of fingerprint, creating it with
+ * query as its text if it doesn't exist yet
+ */
+static void
+pgnq_agg_add(pgnqAggState *state, uint64 fingerprint,
+			 const char *query, int query_len,
+			 int64 calls, double total_duration)
+{
+	pgnqAggGroup *group;
+	bool		found;
+
+	group = (pgnqAggGroup *) hash_search(state->groups, &fingerprint,
+										 HASH_ENTER, &found);
+	if (!found)
+	{
+		group->calls = 0;
+		group->total_duration = 0.0;
+		group->query = NULL;
+	}
+
+	/* Keep the smallest text, whichever order the queries come in */
+	if (group->query == NULL ||
+		pgnq_agg_text_cmp(query, query_len, group->query, group->query_len) < 0)
+	{
+		char	   *copy = MemoryContextAlloc(state->context, Max(query_len, 1));
+
+		memcpy(copy, query, query_len);
+		if (group->query != NULL)
+			pfree(group->query);
+		group->query = copy;
+		group->query_len = query_len;
+	}
+
+	group->calls += calls;
+	group->total_duration += total_duration;
+}
+
+/*
+ * qsort comparator of pg_normalize_query_agg() groups: most calls first,
+ * then by text
+ */
+static int
+pgnq_agg_group_cmp(const void *a, const void *b)
+{
+	const pgnqAggGroup *ga = *(pgnqAggGroup *const *) a;
+	const pgnqAggGroup *gb = *(pgnqAggGroup *const *) b;
+
+	if (ga->calls != gb->calls)
+		return (ga->calls > gb->calls) ? -1 : 1;
+
+	return pgnq_agg_text_cmp(ga->query, ga->query_len, gb->query, gb->query_len);
+}
+
+/*
+ * Byte-wise order of the texts of pg_normalize_query_agg() groups
+ */
+static int
+pgnq_agg_text_cmp(const char *a, int a_len, const char *b, int b_len)
+{
+	int			cmp = memcmp(a, b, Min(a_len, b_len));
+
+	if (cmp != 0)
+		return cmp;
+
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+/*
+ * Compute the fingerprint of a parsed query from its token stream.
+ *
+ * The core scanner already drops whitespace and comments and gives us
+ * keywords in canonical form, so we only need to hash the tokens in order,
+ * hashing a placeholder instead of each constant recorded by the tree
+ * walker.  Parameters are hashed as the same placeholder whatever their
+ * number, as "WHERE id = 1" and "WHERE id = $1" normalize to the same text.
+ * Tokens are hashed by their text rather than their grammar codes, which
+ * change between PostgreSQL versions.
+ */
+static uint64
+pgnq_fingerprint_query(pgnqConstLocations *jstate, const char *query)
+{
+	pgnqLocationLen *locs;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	uint64		hash = PGNQ_FNV_OFFSET_BASIS;
+	int			i = 0;
+
+	pgnq_sort_const_locations(jstate);
+	locs = jstate->clocations;
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+
+	for (;;)
+	{
+		int			tok = core_yylex(&yylval, &yylloc, yyscanner);
+		char		buf[32];
+
+		if (tok == 0)
+			break;
+
+		/* Skip over constants we have already passed, and duplicates */
+		while (i < jstate->clocations_count && locs[i].location < yylloc)
+			i++;
+
+		if (i < jstate->clocations_count && locs[i].location == yylloc)
+		{
+			/* As in pgnq_fill_in_constant_lengths(), '-' starts a negative constant */
+			if (query[yylloc] == '-' &&
+				core_yylex(&yylval, &yylloc, yyscanner) == 0)
+				break;
+
+			/* Collapsed lists are hashed as a single placeholder */
+			if (locs[i].kind != PGNQ_LOC_CONST)
+			{
+				int			prev_locs[2] = {-1, -1};
+
+				if (locs[i].squash_end > locs[i].location &&
+					pgnq_lex_to_location(yyscanner, &yylval, &yylloc, query,
+										 locs[i].squash_end, prev_locs, NULL) == 0)
+					break;
+
+				/* And the closing parenthesis of the last row */
+				if (locs[i].kind == PGNQ_LOC_ROWS &&
+					core_yylex(&yylval, &yylloc, yyscanner) == 0)
+					break;
+			}
+
+			hash = pgnq_hash_token(hash, '?', "");
+			continue;
+		}
+
+		switch (tok)
+		{
+			case IDENT:
+#if PG_VERSION_NUM >= 130000
+			case UIDENT:
+#endif
+				hash = pgnq_hash_token(hash, 'i', yylval.str);
+				break;
+
+			case Op:
+				hash = pgnq_hash_token(hash, 'o', yylval.str);
+				break;
+
+			case PARAM:
+				hash = pgnq_hash_token(hash, '?', "");
+				break;
+
+			case ICONST:
+				/* Constants not replaced by the normalization are kept */
+				snprintf(buf, sizeof(buf), "%d", yylval.ival);
+				hash = pgnq_hash_token(hash, 'c', buf);
+				break;
+
+			case FCONST:
+			case SCONST:
+			case BCONST:
+			case XCONST:
+#if PG_VERSION_NUM >= 130000
+			case USCONST:
+#endif
+				hash = pgnq_hash_token(hash, 'c', yylval.str);
+				break;
+
+			case TYPECAST:
+				hash = pgnq_hash_token(hash, 'o', "::");
+				break;
+
+			case DOT_DOT:
+				hash = pgnq_hash_token(hash, 'o', "..");
+				break;
+
+			case COLON_EQUALS:
+				hash = pgnq_hash_token(hash, 'o', ":=");
+				break;
+
+			case EQUALS_GREATER:
+				hash = pgnq_hash_token(hash, 'o', "=>");
+				break;
+
+			case LESS_EQUALS:
+				hash = pgnq_hash_token(hash, 'o', "<=");
+				break;
+
+			case GREATER_EQUALS:
+				hash = pgnq_hash_token(hash, 'o', ">=");
+				break;
+
+			case NOT_EQUALS:
+				hash = pgnq_hash_token(hash, 'o', "<>");
+				break;
+
+			default:
+				if (tok < 256)
+				{
+					/* Single-character token */
+					buf[0] = (char) tok;
+					buf[1] = '\0';
+					hash = pgnq_hash_token(hash, 'o', buf);
+				}
+				else
+				{
+					/* Anything else is a keyword */
+					hash = pgnq_hash_token(hash, 'k', yylval.keyword);
+				}
+				break;
+		}
+	}
+
+	scanner_finish(yyscanner);
+
+	return hash;
+}
+
+/*
+ * Query ID of a raw statement of query, as pg_stat_statements computes it.
+ *
+ * Optimizable statements are analyzed and their query tree jumbled.  This
+ * repeats parse_analyze_varparams() without calling post_parse_analyze_hook,
+ * not to have pg_stat_statements or our own capture record the statement.
+ * Parameter types are inferred from the query, which gives the same query
+ * ID as long as clients did not specify other types.  Utility statements,
+ * SELECT INTO included, are identified by a hash of their text.
+ */
+static uint64
+pgnq_compute_queryid(const char *query, RawStmt *stmt)
+{
+	uint64		queryid;
+
+	if ((IsA(stmt->stmt, SelectStmt) &&
+		 ((SelectStmt *) stmt->stmt)->intoClause == NULL) ||
+		IsA(stmt->stmt, InsertStmt) || IsA(stmt->stmt, UpdateStmt) ||
+		IsA(stmt->stmt, DeleteStmt))
+	{
+		ParseState *pstate = make_parsestate(NULL);
+		Oid		   *param_types = NULL;
+		int			num_params = 0;
+		Query	   *tree;
+		pgnqJumbleState jstate;
+
+		pstate->p_sourcetext = query;
+		parse_variable_parameters(pstate, &param_types, &num_params);
+		tree = transformTopLevelStmt(pstate, stmt);
+		check_variable_parameters(pstate, tree);
+		free_parsestate(pstate);
+
+		jstate.jumble = (unsigned char *) palloc(PGNQ_JUMBLE_SIZE);
+		jstate.jumble_len = 0;
+		pgnq_jumble_query(&jstate, tree);
+
+#if PG_VERSION_NUM >= 110000
+		queryid = DatumGetUInt64(hash_any_extended(jstate.jumble,
+												   jstate.jumble_len, 0));
+#else
+		queryid = DatumGetUInt32(hash_any(jstate.jumble, jstate.jumble_len));
+#endif
+
+		/* Zero is the query ID of utility statements */
+		if (queryid == UINT64CONST(0))
+			queryid = UINT64CONST(1);
+	}
+	else
+	{
+		int			stmt_loc = Max(stmt->stmt_location, 0);
+		int			stmt_len = stmt->stmt_len;
+
+		/* Trimmed the same way as for pg_normalize_query_statements() */
+		if (stmt_len <= 0)
+			stmt_len = strlen(query) - stmt_loc;
+		while (stmt_len > 0 && scanner_isspace(query[stmt_loc]))
+		{
+			stmt_loc++;
+			stmt_len--;
+		}
+		while (stmt_len > 0 && scanner_isspace(query[stmt_loc + stmt_len - 1]))
+			stmt_len--;
+
+#if PG_VERSION_NUM >= 110000
+		queryid = DatumGetUInt64(hash_any_extended((const unsigned char *) query + stmt_loc,
+												   stmt_len, 0));
+#else
+		queryid = DatumGetUInt32(hash_any((const unsigned char *) query + stmt_loc,
+										  stmt_len));
+#endif
+	}
+
+	return queryid;
+}
+
+/*
+ * Catalog changes may make the same text resolve to other objects
+ */
+static void
+pgnq_queryid_relcache_callback(Datum arg, Oid relid)
+{
+	pgnq_queryid_generation++;
+}
+
+static void
+pgnq_queryid_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	pgnq_queryid_generation++;
+}
+
+/*
+ * Prepare what pg_normalize_query_intern() and pg_normalize_query_resolve()
+ * need: the cache, and the plans to access the dictionary table, looked up
+ * in the schema of the calling function fn_oid so that it follows the
+ * extension around.
+ */
+static void
+pgnq_intern_setup(Oid fn_oid)
+{
+	if (!pgnq_intern_callbacks)
+	{
+		CacheRegisterRelcacheCallback(pgnq_intern_relcache_callback, (Datum) 0);
+		RegisterXactCallback(pgnq_intern_xact_callback, NULL);
+		RegisterSubXactCallback(pgnq_intern_subxact_callback, NULL);
+		pgnq_intern_callbacks = true;
+	}
+
+	if (!pgnq_intern_valid)
+	{
+		if (pgnq_intern_cache != NULL)
+			hash_destroy(pgnq_intern_cache);
+		pgnq_intern_cache = NULL;
+
+		if (pgnq_intern_select_plan != NULL)
+			SPI_freeplan(pgnq_intern_select_plan);
+		if (pgnq_intern_insert_plan != NULL)
+			SPI_freeplan(pgnq_intern_insert_plan);
+		if (pgnq_intern_resolve_plan != NULL)
+			SPI_freeplan(pgnq_intern_resolve_plan);
+		pgnq_intern_select_plan = NULL;
+		pgnq_intern_insert_plan = NULL;
+		pgnq_intern_resolve_plan = NULL;
+		pgnq_intern_relid = InvalidOid;
+
+		pgnq_intern_valid = true;
+	}
+
+	if (pgnq_intern_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(pgnqInternEntry);
+		ctl.hcxt = TopMemoryContext;
+		pgnq_intern_cache = hash_create("pg_normalize_query_intern cache", 256,
+										&ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	if (pgnq_intern_select_plan == NULL)
+	{
+		Oid			nspid = get_func_namespace(fn_oid);
+		char	   *nspname = get_namespace_name(nspid);
+		const char *table;
+		StringInfoData sql;
+		Oid			argtypes[2] = {INT8OID, TEXTOID};
+		SPIPlanPtr	select_plan;
+		SPIPlanPtr	insert_plan;
+		SPIPlanPtr	resolve_plan;
+
+		pgnq_intern_relid = get_relname_relid("pg_normalize_query_dictionary",
+											  nspid);
+		if (!OidIsValid(pgnq_intern_relid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_TABLE),
+					 errmsg("relation \"%s.pg_normalize_query_dictionary\" does not exist",
+							nspname)));
+
+		table = quote_qualified_identifier(nspname, "pg_normalize_query_dictionary");
+		initStringInfo(&sql);
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		appendStringInfo(&sql,
+						 "SELECT id FROM %s WHERE fingerprint OPERATOR(pg_catalog.=) $1",
+						 table);
+		select_plan = SPI_prepare(sql.data, 1, argtypes);
+
+		resetStringInfo(&sql);
+		appendStringInfo(&sql,
+						 "INSERT INTO %s (fingerprint, query) VALUES ($1, $2) "
+						 "ON CONFLICT (fingerprint) DO NOTHING RETURNING id",
+						 table);
+		insert_plan = SPI_prepare(sql.data, 2, argtypes);
+
+		resetStringInfo(&sql);
+		appendStringInfo(&sql,
+						 "SELECT query FROM %s WHERE id OPERATOR(pg_catalog.=) $1",
+						 table);
+		resolve_plan = SPI_prepare(sql.data, 1, argtypes);
+
+		if (select_plan == NULL || insert_plan == NULL || resolve_plan == NULL)
+			elog(ERROR, "could not prepare the query dictionary plans: %s",
+				 SPI_result_code_string(SPI_result));
+
+		/* Only remembered once they are all saved */
+		SPI_keepplan(select_plan);
+		SPI_keepplan(insert_plan);
+		SPI_keepplan(resolve_plan);
+		pgnq_intern_select_plan = select_plan;
+		pgnq_intern_insert_plan = insert_plan;
+		pgnq_intern_resolve_plan = resolve_plan;
+
+		SPI_finish();
+		pfree(sql.data);
+	}
+}
+
+/*
+ * Look up the dictionary ID of a normalized query, adding it if needed
+ */
+static int64
+pgnq_intern_store(uint64 fingerprint, text *query)
+{
+	Datum		values[2];
+	bool		isnull;
+	int64		id;
+
+	values[0] = Int64GetDatum((int64) fingerprint);
+	values[1] = PointerGetDatum(query);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Looked up first, so that known queries don't use up IDs */
+	if (SPI_execute_plan(pgnq_intern_select_plan, values, NULL, false, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not look up the query dictionary");
+
+	if (SPI_processed == 0)
+	{
+		if (SPI_execute_plan(pgnq_intern_insert_plan, values, NULL, false, 1) != SPI_OK_INSERT_RETURNING)
+			elog(ERROR, "could not add to the query dictionary");
+
+		/* Either way, the ID may belong to a transaction not committed yet */
+		pgnq_intern_uncommitted = true;
+
+		/* Another session added it in the meantime */
+		if (SPI_processed == 0 &&
+			SPI_execute_plan(pgnq_intern_select_plan, values, NULL, false, 1) != SPI_OK_SELECT)
+			elog(ERROR, "could not look up the query dictionary");
+
+		if (SPI_processed == 0)
+			elog(ERROR, "query fingerprint " UINT64_FORMAT " vanished from the query dictionary",
+				 fingerprint);
+	}
+
+	id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+									 1, &isnull));
+
+	SPI_finish();
+
+	return id;
+}
+
+/*
+ * Forget the cached IDs and plans when the dictionary table changes, e.g.
+ * when it is truncated, or when rows are deleted or updated, as
+ * pg_normalize_query_dictionary_invalidate() then invalidates it.
+ */
+static void
+pgnq_intern_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == pgnq_intern_relid)
+		pgnq_intern_valid = false;
+}
+
+/*
+ * The IDs added by an aborted transaction were never committed, so they
+ * must not stay cached
+ */
+static void
+pgnq_intern_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			if (pgnq_intern_uncommitted)
+				pgnq_intern_valid = false;
+			pgnq_intern_uncommitted = false;
+			break;
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			pgnq_intern_uncommitted = false;
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void
+pgnq_intern_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							 SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB && pgnq_intern_uncommitted)
+		pgnq_intern_valid = false;
+}
+
+#define PGNQ_APP_JUMB(item) \
+	pgnq_append_jumble(jstate, (const unsigned char *) &(item), sizeof(item))
+#define PGNQ_APP_JUMB_STRING(str) \
+	pgnq_append_jumble(jstate, (const unsigned char *) (str), strlen(str) + 1)
+
+/*
+ * Append a value that is substantive in a given query to the current jumble.
+ */
+static void
+pgnq_append_jumble(pgnqJumbleState *jstate, const unsigned char *item, Size size)
+{
+	unsigned char *jumble = jstate->jumble;
+	Size		jumble_len = jstate->jumble_len;
+
+	/*
+	 * Whenever the jumble buffer is full, we hash the current contents and
+	 * reset the buffer to contain just that hash value, thus relying on the
+	 * hash to summarize everything so far.
+	 */
+	while (size > 0)
+	{
+		Size		part_size;
+
+		if (jumble_len >= PGNQ_JUMBLE_SIZE)
+		{
+#if PG_VERSION_NUM >= 110000
+			uint64		start_hash;
+
+			start_hash = DatumGetUInt64(hash_any_extended(jumble,
+														  PGNQ_JUMBLE_SIZE, 0));
+#else
+			uint32		start_hash;
+
+			start_hash = DatumGetUInt32(hash_any(jumble, PGNQ_JUMBLE_SIZE));
+#endif
+			memcpy(jumble, &start_hash, sizeof(start_hash));
+			jumble_len = sizeof(start_hash);
+		}
+		part_size = Min(size, PGNQ_JUMBLE_SIZE - jumble_len);
+		memcpy(jumble + jumble_len, item, part_size);
+		jumble_len += part_size;
+		item += part_size;
+		size -= part_size;
+	}
+	jstate->jumble_len = jumble_len;
+}
+
+/*
+ * Jumble a Query tree, selecting the fields pg_stat_statements considers
+ * significant.  Any change here would give query IDs that no longer match
+ * its own.
+ */
+static void
+pgnq_jumble_query(pgnqJumbleState *jstate, Query *query)
+{
+	Assert(IsA(query, Query));
+	Assert(query->utilityStmt == NULL);
+
+	PGNQ_APP_JUMB(query->commandType);
+	/* resultRelation is usually predictable from commandType */
+	pgnq_jumble_expr(jstate, (Node *) query->cteList);
+	pgnq_jumble_range_table(jstate, query->rtable);
+	pgnq_jumble_expr(jstate, (Node *) query->jointree);
+	pgnq_jumble_expr(jstate, (Node *) query->targetList);
+	pgnq_jumble_expr(jstate, (Node *) query->onConflict);
+	pgnq_jumble_expr(jstate, (Node *) query->returningList);
+	pgnq_jumble_expr(jstate, (Node *) query->groupClause);
+	pgnq_jumble_expr(jstate, (Node *) query->groupingSets);
+	pgnq_jumble_expr(jstate, query->havingQual);
+	pgnq_jumble_expr(jstate, (Node *) query->windowClause);
+	pgnq_jumble_expr(jstate, (Node *) query->distinctClause);
+	pgnq_jumble_expr(jstate, (Node *) query->sortClause);
+	pgnq_jumble_expr(jstate, query->limitOffset);
+	pgnq_jumble_expr(jstate, query->limitCount);
+	/* we ignore rowMarks */
+	pgnq_jumble_expr(jstate, query->setOperations);
+}
+
+/*
+ * Jumble a range table
+ */
+static void
+pgnq_jumble_range_table(pgnqJumbleState *jstate, List *rtable)
+{
+	ListCell   *lc;
+
+	foreach(lc, rtable)
+	{
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+
+		PGNQ_APP_JUMB(rte->rtekind);
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+				PGNQ_APP_JUMB(rte->relid);
+				pgnq_jumble_expr(jstate, (Node *) rte->tablesample);
+				break;
+			case RTE_SUBQUERY:
+				pgnq_jumble_query(jstate, rte->subquery);
+				break;
+			case RTE_JOIN:
+				PGNQ_APP_JUMB(rte->jointype);
+				break;
+			case RTE_FUNCTION:
+				pgnq_jumble_expr(jstate, (Node *) rte->functions);
+				break;
+			case RTE_TABLEFUNC:
+				pgnq_jumble_expr(jstate, (Node *) rte->tablefunc);
+				break;
+			case RTE_VALUES:
+				pgnq_jumble_expr(jstate, (Node *) rte->values_lists);
+				break;
+			case RTE_CTE:
+
+				/*
+				 * Depending on the CTE name here isn't ideal, but it's the
+				 * only info we have to identify the referenced WITH item.
+				 */
+				PGNQ_APP_JUMB_STRING(rte->ctename);
+				PGNQ_APP_JUMB(rte->ctelevelsup);
+				break;
+			case RTE_NAMEDTUPLESTORE:
+				PGNQ_APP_JUMB_STRING(rte->enrname);
+				break;
+#if PG_VERSION_NUM >= 120000
+			case RTE_RESULT:
+				break;
+#endif
+			default:
+				elog(ERROR, "unrecognized RTE kind: %d", (int) rte->rtekind);
+				break;
+		}
+	}
+}
+
+/*
+ * Jumble an expression tree
+ *
+ * We always emit the node's NodeTag, then any additional fields that are
+ * considered significant, and then we recurse to any child nodes.
+ */
+static void
+pgnq_jumble_expr(pgnqJumbleState *jstate, Node *node)
+{
+	ListCell   *temp;
+
+	if (node == NULL)
+		return;
+
+	/* Guard against stack overflow due to overly complex expressions */
+	check_stack_depth();
+
+	PGNQ_APP_JUMB(node->type);
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				PGNQ_APP_JUMB(var->varno);
+				PGNQ_APP_JUMB(var->varattno);
+				PGNQ_APP_JUMB(var->varlevelsup);
+			}
+			break;
+		case T_Const:
+			{
+				Const	   *c = (Const *) node;
+
+				/* We jumble only the constant's type, not its value */
+				PGNQ_APP_JUMB(c->consttype);
+			}
+			break;
+		case T_Param:
+			{
+				Param	   *p = (Param *) node;
+
+				PGNQ_APP_JUMB(p->paramkind);
+				PGNQ_APP_JUMB(p->paramid);
+				PGNQ_APP_JUMB(p->paramtype);
+			}
+			break;
+		case T_Aggref:
+			{
+				Aggref	   *expr = (Aggref *) node;
+
+				PGNQ_APP_JUMB(expr->aggfnoid);
+				pgnq_jumble_expr(jstate, (Node *) expr->aggdirectargs);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+				pgnq_jumble_expr(jstate, (Node *) expr->aggorder);
+				pgnq_jumble_expr(jstate, (Node *) expr->aggdistinct);
+				pgnq_jumble_expr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+		case T_GroupingFunc:
+			{
+				GroupingFunc *grpnode = (GroupingFunc *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) grpnode->refs);
+			}
+			break;
+		case T_WindowFunc:
+			{
+				WindowFunc *expr = (WindowFunc *) node;
+
+				PGNQ_APP_JUMB(expr->winfnoid);
+				PGNQ_APP_JUMB(expr->winref);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+				pgnq_jumble_expr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+#if PG_VERSION_NUM >= 120000
+		case T_SubscriptingRef:
+			{
+				SubscriptingRef *sbsref = (SubscriptingRef *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) sbsref->refupperindexpr);
+				pgnq_jumble_expr(jstate, (Node *) sbsref->reflowerindexpr);
+				pgnq_jumble_expr(jstate, (Node *) sbsref->refexpr);
+				pgnq_jumble_expr(jstate, (Node *) sbsref->refassgnexpr);
+			}
+			break;
+#else
+		case T_ArrayRef:
+			{
+				ArrayRef   *aref = (ArrayRef *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) aref->refupperindexpr);
+				pgnq_jumble_expr(jstate, (Node *) aref->reflowerindexpr);
+				pgnq_jumble_expr(jstate, (Node *) aref->refexpr);
+				pgnq_jumble_expr(jstate, (Node *) aref->refassgnexpr);
+			}
+			break;
+#endif
+		case T_FuncExpr:
+			{
+				FuncExpr   *expr = (FuncExpr *) node;
+
+				PGNQ_APP_JUMB(expr->funcid);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_NamedArgExpr:
+			{
+				NamedArgExpr *nae = (NamedArgExpr *) node;
+
+				PGNQ_APP_JUMB(nae->argnumber);
+				pgnq_jumble_expr(jstate, (Node *) nae->arg);
+			}
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
+		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
+			{
+				OpExpr	   *expr = (OpExpr *) node;
+
+				PGNQ_APP_JUMB(expr->opno);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+
+				PGNQ_APP_JUMB(expr->opno);
+				PGNQ_APP_JUMB(expr->useOr);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_BoolExpr:
+			{
+				BoolExpr   *expr = (BoolExpr *) node;
+
+				PGNQ_APP_JUMB(expr->boolop);
+				pgnq_jumble_expr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_SubLink:
+			{
+				SubLink    *sublink = (SubLink *) node;
+
+				PGNQ_APP_JUMB(sublink->subLinkType);
+				PGNQ_APP_JUMB(sublink->subLinkId);
+				pgnq_jumble_expr(jstate, (Node *) sublink->testexpr);
+				pgnq_jumble_query(jstate, castNode(Query, sublink->subselect));
+			}
+			break;
+		case T_FieldSelect:
+			{
+				FieldSelect *fs = (FieldSelect *) node;
+
+				PGNQ_APP_JUMB(fs->fieldnum);
+				pgnq_jumble_expr(jstate, (Node *) fs->arg);
+			}
+			break;
+		case T_FieldStore:
+			{
+				FieldStore *fstore = (FieldStore *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) fstore->arg);
+				pgnq_jumble_expr(jstate, (Node *) fstore->newvals);
+			}
+			break;
+		case T_RelabelType:
+			{
+				RelabelType *rt = (RelabelType *) node;
+
+				PGNQ_APP_JUMB(rt->resulttype);
+				pgnq_jumble_expr(jstate, (Node *) rt->arg);
+			}
+			break;
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *cio = (CoerceViaIO *) node;
+
+				PGNQ_APP_JUMB(cio->resulttype);
+				pgnq_jumble_expr(jstate, (Node *) cio->arg);
+			}
+			break;
+		case T_ArrayCoerceExpr:
+			{
+				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+
+				PGNQ_APP_JUMB(acexpr->resulttype);
+				pgnq_jumble_expr(jstate, (Node *) acexpr->arg);
+#if PG_VERSION_NUM >= 110000
+				pgnq_jumble_expr(jstate, (Node *) acexpr->elemexpr);
+#endif
+			}
+			break;
+		case T_ConvertRowtypeExpr:
+			{
+				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+
+				PGNQ_APP_JUMB(crexpr->resulttype);
+				pgnq_jumble_expr(jstate, (Node *) crexpr->arg);
+			}
+			break;
+		case T_CollateExpr:
+			{
+				CollateExpr *ce = (CollateExpr *) node;
+
+				PGNQ_APP_JUMB(ce->collOid);
+				pgnq_jumble_expr(jstate, (Node *) ce->arg);
+			}
+			break;
+		case T_CaseExpr:
+			{
+				CaseExpr   *caseexpr = (CaseExpr *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) caseexpr->arg);
+				foreach(temp, caseexpr->args)
+				{
+					CaseWhen   *when = lfirst_node(CaseWhen, temp);
+
+					pgnq_jumble_expr(jstate, (Node *) when->expr);
+					pgnq_jumble_expr(jstate, (Node *) when->result);
+				}
+				pgnq_jumble_expr(jstate, (Node *) caseexpr->defresult);
+			}
+			break;
+		case T_CaseTestExpr:
+			{
+				CaseTestExpr *ct = (CaseTestExpr *) node;
+
+				PGNQ_APP_JUMB(ct->typeId);
+			}
+			break;
+		case T_ArrayExpr:
+			pgnq_jumble_expr(jstate, (Node *) ((ArrayExpr *) node)->elements);
+			break;
+		case T_RowExpr:
+			pgnq_jumble_expr(jstate, (Node *) ((RowExpr *) node)->args);
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+
+				PGNQ_APP_JUMB(rcexpr->rctype);
+				pgnq_jumble_expr(jstate, (Node *) rcexpr->largs);
+				pgnq_jumble_expr(jstate, (Node *) rcexpr->rargs);
+			}
+			break;
+		case T_CoalesceExpr:
+			pgnq_jumble_expr(jstate, (Node *) ((CoalesceExpr *) node)->args);
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+
+				PGNQ_APP_JUMB(mmexpr->op);
+				pgnq_jumble_expr(jstate, (Node *) mmexpr->args);
+			}
+			break;
+		case T_SQLValueFunction:
+			{
+				SQLValueFunction *svf = (SQLValueFunction *) node;
+
+				PGNQ_APP_JUMB(svf->op);
+				/* type is fully determined by op */
+				PGNQ_APP_JUMB(svf->typmod);
+			}
+			break;
+		case T_XmlExpr:
+			{
+				XmlExpr    *xexpr = (XmlExpr *) node;
+
+				PGNQ_APP_JUMB(xexpr->op);
+				pgnq_jumble_expr(jstate, (Node *) xexpr->named_args);
+				pgnq_jumble_expr(jstate, (Node *) xexpr->args);
+			}
+			break;
+		case T_NullTest:
+			{
+				NullTest   *nt = (NullTest *) node;
+
+				PGNQ_APP_JUMB(nt->nulltesttype);
+				pgnq_jumble_expr(jstate, (Node *) nt->arg);
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				PGNQ_APP_JUMB(bt->booltesttype);
+				pgnq_jumble_expr(jstate, (Node *) bt->arg);
+			}
+			break;
+		case T_CoerceToDomain:
+			{
+				CoerceToDomain *cd = (CoerceToDomain *) node;
+
+				PGNQ_APP_JUMB(cd->resulttype);
+				pgnq_jumble_expr(jstate, (Node *) cd->arg);
+			}
+			break;
+		case T_CoerceToDomainValue:
+			{
+				CoerceToDomainValue *cdv = (CoerceToDomainValue *) node;
+
+				PGNQ_APP_JUMB(cdv->typeId);
+			}
+			break;
+		case T_SetToDefault:
+			{
+				SetToDefault *sd = (SetToDefault *) node;
+
+				PGNQ_APP_JUMB(sd->typeId);
+			}
+			break;
+		case T_CurrentOfExpr:
+			{
+				CurrentOfExpr *ce = (CurrentOfExpr *) node;
+
+				PGNQ_APP_JUMB(ce->cvarno);
+				if (ce->cursor_name)
+					PGNQ_APP_JUMB_STRING(ce->cursor_name);
+				PGNQ_APP_JUMB(ce->cursor_param);
+			}
+			break;
+		case T_NextValueExpr:
+			{
+				NextValueExpr *nve = (NextValueExpr *) node;
+
+				PGNQ_APP_JUMB(nve->seqid);
+				PGNQ_APP_JUMB(nve->typeId);
+			}
+			break;
+		case T_InferenceElem:
+			{
+				InferenceElem *ie = (InferenceElem *) node;
+
+				PGNQ_APP_JUMB(ie->infercollid);
+				PGNQ_APP_JUMB(ie->inferopclass);
+				pgnq_jumble_expr(jstate, ie->expr);
+			}
+			break;
+		case T_TargetEntry:
+			{
+				TargetEntry *tle = (TargetEntry *) node;
+
+				PGNQ_APP_JUMB(tle->resno);
+				PGNQ_APP_JUMB(tle->ressortgroupref);
+				pgnq_jumble_expr(jstate, (Node *) tle->expr);
+			}
+			break;
+		case T_RangeTblRef:
+			{
+				RangeTblRef *rtr = (RangeTblRef *) node;
+
+				PGNQ_APP_JUMB(rtr->rtindex);
+			}
+			break;
+		case T_JoinExpr:
+			{
+				JoinExpr   *join = (JoinExpr *) node;
+
+				PGNQ_APP_JUMB(join->jointype);
+				PGNQ_APP_JUMB(join->isNatural);
+				PGNQ_APP_JUMB(join->rtindex);
+				pgnq_jumble_expr(jstate, join->larg);
+				pgnq_jumble_expr(jstate, join->rarg);
+				pgnq_jumble_expr(jstate, join->quals);
+			}
+			break;
+		case T_FromExpr:
+			{
+				FromExpr   *from = (FromExpr *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) from->fromlist);
+				pgnq_jumble_expr(jstate, from->quals);
+			}
+			break;
+		case T_OnConflictExpr:
+			{
+				OnConflictExpr *conf = (OnConflictExpr *) node;
+
+				PGNQ_APP_JUMB(conf->action);
+				pgnq_jumble_expr(jstate, (Node *) conf->arbiterElems);
+				pgnq_jumble_expr(jstate, conf->arbiterWhere);
+				pgnq_jumble_expr(jstate, (Node *) conf->onConflictSet);
+				pgnq_jumble_expr(jstate, conf->onConflictWhere);
+				PGNQ_APP_JUMB(conf->constraint);
+				PGNQ_APP_JUMB(conf->exclRelIndex);
+				pgnq_jumble_expr(jstate, (Node *) conf->exclRelTlist);
+			}
+			break;
+		case T_List:
+			foreach(temp, (List *) node)
+			{
+				pgnq_jumble_expr(jstate, (Node *) lfirst(temp));
+			}
+			break;
+		case T_IntList:
+			foreach(temp, (List *) node)
+			{
+				PGNQ_APP_JUMB(lfirst_int(temp));
+			}
+			break;
+		case T_SortGroupClause:
+			{
+				SortGroupClause *sgc = (SortGroupClause *) node;
+
+				PGNQ_APP_JUMB(sgc->tleSortGroupRef);
+				PGNQ_APP_JUMB(sgc->eqop);
+				PGNQ_APP_JUMB(sgc->sortop);
+				PGNQ_APP_JUMB(sgc->nulls_first);
+			}
+			break;
+		case T_GroupingSet:
+			{
+				GroupingSet *gsnode = (GroupingSet *) node;
+
+				pgnq_jumble_expr(jstate, (Node *) gsnode->content);
+			}
+			break;
+		case T_WindowClause:
+			{
+				WindowClause *wc = (WindowClause *) node;
+
+				PGNQ_APP_JUMB(wc->winref);
+				PGNQ_APP_JUMB(wc->frameOptions);
+				pgnq_jumble_expr(jstate, (Node *) wc->partitionClause);
+				pgnq_jumble_expr(jstate, (Node *) wc->orderClause);
+				pgnq_jumble_expr(jstate, wc->startOffset);
+				pgnq_jumble_expr(jstate, wc->endOffset);
+			}
+			break;
+		case T_CommonTableExpr:
+			{
+				CommonTableExpr *cte = (CommonTableExpr *) node;
+
+				/* we store the string name because RTE_CTE RTEs need it */
+				PGNQ_APP_JUMB_STRING(cte->ctename);
+#if PG_VERSION_NUM >= 120000
+				PGNQ_APP_JUMB(cte->ctematerialized);
+#endif
+				pgnq_jumble_query(jstate, castNode(Query, cte->ctequery));
+			}
+			break;
+		case T_SetOperationStmt:
+			{
+				SetOperationStmt *setop = (SetOperationStmt *) node;
+
+				PGNQ_APP_JUMB(setop->op);
+				PGNQ_APP_JUMB(setop->all);
+				pgnq_jumble_expr(jstate, setop->larg);
+				pgnq_jumble_expr(jstate, setop->rarg);
+			}
+			break;
+		case T_RangeTblFunction:
+			{
+				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+
+				pgnq_jumble_expr(jstate, rtfunc->funcexpr);
+			}
+			break;
+		case T_TableFunc:
+			{
+				TableFunc  *tablefunc = (TableFunc *) node;
+
+				pgnq_jumble_expr(jstate, tablefunc->docexpr);
+				pgnq_jumble_expr(jstate, tablefunc->rowexpr);
+				pgnq_jumble_expr(jstate, (Node *) tablefunc->colexprs);
+			}
+			break;
+		case T_TableSampleClause:
+			{
+				TableSampleClause *tsc = (TableSampleClause *) node;
+
+				PGNQ_APP_JUMB(tsc->tsmhandler);
+				pgnq_jumble_expr(jstate, (Node *) tsc->args);
+				pgnq_jumble_expr(jstate, (Node *) tsc->repeatable);
+			}
+			break;
+		default:
+			/* Only a warning, since we can stumble along anyway */
+			elog(WARNING, "unrecognized node type: %d",
+				 (int) nodeTag(node));
+			break;
+	}
+}
+
+/*
+ * Build a normalized_query value from len bytes of normalized text
+ */
+static struct varlena *
+pgnq_nq_make(const char *str, int len)
+{
+	struct varlena *result = (struct varlena *) palloc(VARHDRSZ + PGNQ_NQ_HASH_SIZE + len);
+	uint64		hash = pgnq_hash_bytes(PGNQ_FNV_OFFSET_BASIS, str, len);
+
+	SET_VARSIZE(result, VARHDRSZ + PGNQ_NQ_HASH_SIZE + len);
+	memcpy(VARDATA(result), &hash, PGNQ_NQ_HASH_SIZE);
+	memcpy(VARDATA(result) + PGNQ_NQ_HASH_SIZE, str, len);
+
+	return result;
+}
+
+/*
+ * Stored hash of a normalized_query value
+ */
+static uint64
+pgnq_nq_hash(const struct varlena *v)
+{
+	uint64		hash;
+
+	memcpy(&hash, VARDATA_ANY(v), PGNQ_NQ_HASH_SIZE);
+
+	return hash;
+}
+
+static bool
+pgnq_nq_equal(const struct varlena *a, const struct varlena *b)
+{
+	return VARSIZE_ANY_EXHDR(a) == VARSIZE_ANY_EXHDR(b) &&
+		pgnq_nq_hash(a) == pgnq_nq_hash(b) &&
+		memcmp(PGNQ_NQ_TEXT(a), PGNQ_NQ_TEXT(b), PGNQ_NQ_TEXT_LEN(a)) == 0;
+}
+
+/*
+ * Order normalized_query values by hash, then bytewise by text.  This is
+ * not an order anyone would sort by for display, but it is a total order
+ * that rarely needs to look at the texts, and that does not depend on any
+ * collation.
+ */
+static int
+pgnq_nq_cmp(const struct varlena *a, const struct varlena *b)
+{
+	uint64		hash_a = pgnq_nq_hash(a);
+	uint64		hash_b = pgnq_nq_hash(b);
+	Size		len_a = PGNQ_NQ_TEXT_LEN(a);
+	Size		len_b = PGNQ_NQ_TEXT_LEN(b);
+	int			result;
+
+	if (hash_a != hash_b)
+		return hash_a < hash_b ? -1 : 1;
+
+	result = memcmp(PGNQ_NQ_TEXT(a), PGNQ_NQ_TEXT(b), Min(len_a, len_b));
+	if (result != 0)
+		return result;
+
+	return len_a < len_b ? -1 : (len_a > len_b ? 1 : 0);
+}
+
+Datum
+normalized_query_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+
+	PG_RETURN_POINTER(pgnq_nq_make(str, strlen(str)));
+}
+
+Datum
+normalized_query_out(PG_FUNCTION_ARGS)
+{
+	struct varlena *v = PG_GETARG_NQ_PP(0);
+
+	PG_RETURN_CSTRING(pnstrdup(PGNQ_NQ_TEXT(v), PGNQ_NQ_TEXT_LEN(v)));
+}
+
+/*
+ * Only the text goes over the wire, the hash is computed again on receipt
+ */
+Datum
+normalized_query_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	struct varlena *result;
+	char	   *str;
+	int			nbytes;
+
+	str = pq_getmsgtext(buf, buf->len - buf->cursor, &nbytes);
+	result = pgnq_nq_make(str, nbytes);
+	pfree(str);
+
+	PG_RETURN_POINTER(result);
+}
+
+Datum
+normalized_query_send(PG_FUNCTION_ARGS)
+{
+	struct varlena *v = PG_GETARG_NQ_PP(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendtext(&buf, PGNQ_NQ_TEXT(v), PGNQ_NQ_TEXT_LEN(v));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Cast from text.  The text is taken as already normalized, e.g. as returned
+ * by pg_normalize_query().
+ */
+Datum
+normalized_query(PG_FUNCTION_ARGS)
+{
+	text	   *t = PG_GETARG_TEXT_PP(0);
+
+	PG_RETURN_POINTER(pgnq_nq_make(VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t)));
+}
+
+/*
+ * Cast to text
+ */
+Datum
+normalized_query_text(PG_FUNCTION_ARGS)
+{
+	struct varlena *v = PG_GETARG_NQ_PP(0);
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(PGNQ_NQ_TEXT(v), PGNQ_NQ_TEXT_LEN(v)));
+}
+
+Datum
+normalized_query_eq(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = pgnq_nq_equal(a, b);
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_ne(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = !pgnq_nq_equal(a, b);
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_lt(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = pgnq_nq_cmp(a, b) < 0;
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_le(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = pgnq_nq_cmp(a, b) <= 0;
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_gt(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = pgnq_nq_cmp(a, b) > 0;
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_ge(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	bool		result = pgnq_nq_cmp(a, b) >= 0;
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_BOOL(result);
+}
+
+Datum
+normalized_query_cmp(PG_FUNCTION_ARGS)
+{
+	struct varlena *a = PG_GETARG_NQ_PP(0);
+	struct varlena *b = PG_GETARG_NQ_PP(1);
+	int			result = pgnq_nq_cmp(a, b);
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+
+	PG_RETURN_INT32(result);
+}
+
+/*
+ * Hash opclass support: the stored hash, folded to 32 bits
+ */
+Datum
+normalized_query_hash(PG_FUNCTION_ARGS)
+{
+	struct varlena *v = PG_GETARG_NQ_PP(0);
+	uint64		hash = pgnq_nq_hash(v);
+
+	PG_FREE_IF_COPY(v, 0);
+
+	PG_RETURN_INT32((int32) (hash ^ (hash >> 32)));
+}
+
+/*
+ * Btree sort support.  Where a Datum can hold it, the stored hash makes an
+ * abbreviated key that decides nearly every comparison on its own.
+ */
+Datum
+normalized_query_sortsupport(PG_FUNCTION_ARGS)
+{
+	SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+	ssup->comparator = pgnq_nq_fastcmp;
+
+#if SIZEOF_DATUM == 8
+	if (ssup->abbreviate)
+	{
+		ssup->comparator = pgnq_nq_abbrev_cmp;
+		ssup->abbrev_converter = pgnq_nq_abbrev_convert;
+		ssup->abbrev_abort = pgnq_nq_abbrev_abort;
+		ssup->abbrev_full_comparator = pgnq_nq_fastcmp;
+	}
+#endif
+
+	PG_RETURN_VOID();
+}
+
+static int
+pgnq_nq_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+	struct varlena *a = (struct varlena *) PG_DETOAST_DATUM_PACKED(x);
+	struct varlena *b = (struct varlena *) PG_DETOAST_DATUM_PACKED(y);
+	int			result = pgnq_nq_cmp(a, b);
+
+	if ((Pointer) a != DatumGetPointer(x))
+		pfree(a);
+	if ((Pointer) b != DatumGetPointer(y))
+		pfree(b);
+
+	return result;
+}
+
+#if SIZEOF_DATUM == 8
+static Datum
+pgnq_nq_abbrev_convert(Datum original, SortSupport ssup)
+{
+	struct varlena *v = (struct varlena *) PG_DETOAST_DATUM_PACKED(original);
+	uint64		hash = pgnq_nq_hash(v);
+
+	if ((Pointer) v != DatumGetPointer(original))
+		pfree(v);
+
+	return (Datum) hash;
+}
+
+static int
+pgnq_nq_abbrev_cmp(Datum x, Datum y, SortSupport ssup)
+{
+	if (x == y)
+		return 0;
+
+	return x < y ? -1 : 1;
+}
+
+/*
+ * Hashes only tie for equal texts or collisions, so abbreviation always
+ * pays off
+ */
+static bool
+pgnq_nq_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+	return false;
+}
+#endif
@@ -0,0 +1,1061 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgnq.c
+ *	  Command-line normalizer built on libpgnq, to normalize the queries of
+ *	  SQL scripts and archived server logs outside of the server.
+ *
+ * The input is read in chunks of queries handed to worker processes, which
+ * normalize them each with a memory context of its own.  Processes are used
+ * rather than threads because the parser keeps its state in global
+ * variables.  A worker gets its next chunk as soon as it is idle, so the
+ * ones slowed down by long queries take less of the work, and the results
+ * are written in the order of the input.
+ *
+ * This is not a frontend program: FRONTEND is left undefined, and
+ * postgres.h used rather than postgres_fe.h, because the workers run the
+ * server's own parser, memory contexts and error handling, and pgnq is
+ * linked with the backend objects like libpgnq.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "getopt_long.h"
+
+#include "pgnq_core.h"
+
+/* Bytes read from an input file at a time */
+#define PGNQ_READ_SIZE			(1024 * 1024)
+
+/* Queries are handed to a worker once a chunk holds this many bytes */
+#define PGNQ_CHUNK_SIZE			(1024 * 1024)
+
+/* Size of the standard output buffer */
+#define PGNQ_WRITE_SIZE			(1024 * 1024)
+
+/* Formats of the input files */
+typedef enum pgnqInputFormat
+{
+	PGNQ_INPUT_LINES,			/* one query per line */
+	PGNQ_INPUT_STDERR,
+	PGNQ_INPUT_CSVLOG,
+	PGNQ_INPUT_JSONLOG
+} pgnqInputFormat;
+
+/*
+ * Growable buffer, like StringInfo but malloc'd, as memory contexts are
+ * only set up by the workers.  data is always NUL-terminated.
+ */
+typedef struct pgnqBuffer
+{
+	char	   *data;
+	size_t		len;
+	size_t		size;
+} pgnqBuffer;
+
+/*
+ * The input files, read one after the other
+ */
+typedef struct pgnqInput
+{
+	char	  **paths;			/* files to read, "-" for standard input */
+	int			npaths;
+	int			next_path;		/* next one of paths to open */
+	const char *path;			/* file being read, for error messages */
+	int			fd;				/* -1 when no file is open */
+	pgnqInputFormat format;
+	char	   *buf;			/* read buffer */
+	size_t		buf_len;		/* valid bytes in buf */
+	size_t		buf_pos;		/* next byte of buf to return */
+	pgnqBuffer	line;			/* current line */
+	pgnqBuffer	severity;		/* severity of the current csvlog entry */
+	pgnqBuffer	message;		/* message of the current entry */
+} pgnqInput;
+
+/*
+ * A worker process.  Chunks are written to request_fd as a uint64 length
+ * followed by the queries, each a uint32 length, its bytes and a NUL byte.
+ * The results come back on result_fd as a uint64 length followed, for each
+ * query, by a uint8 telling whether it could be normalized, a uint32 length
+ * and either the normalized query or the error message.
+ */
+typedef struct pgnqWorker
+{
+	pid_t		pid;
+	int			request_fd;
+	int			result_fd;
+	int64		seq;			/* chunk being normalized, or -1 when idle */
+} pgnqWorker;
+
+/*
+ * Results of a chunk, kept until all the chunks before it are written
+ */
+typedef struct pgnqSlot
+{
+	bool		ready;
+	pgnqBuffer	results;
+} pgnqSlot;
+
+static const char *progname = "pgnq";
+
+static void pgnq_fatal(const char *fmt,...) pg_attribute_printf(1, 2);
+static void *pgnq_realloc(void *ptr, size_t size);
+static void pgnq_buffer_reserve(pgnqBuffer *buffer, size_t needed);
+static void pgnq_buffer_append(pgnqBuffer *buffer, const void *data, size_t len);
+static void pgnq_buffer_append_char(pgnqBuffer *buffer, char c);
+static void pgnq_buffer_reset(pgnqBuffer *buffer);
+static size_t pgnq_read_fully(int fd, void *buf, size_t len);
+static void pgnq_write_fully(int fd, const void *buf, size_t len);
+static bool pgnq_read_message(int fd, pgnqBuffer *buffer);
+static void pgnq_write_message(int fd, pgnqBuffer *buffer);
+static int	pgnq_input_getc(pgnqInput *input);
+static int	pgnq_input_peekc(pgnqInput *input);
+static bool pgnq_input_read_line(pgnqInput *input, pgnqBuffer *dst);
+static bool pgnq_input_read_csv_entry(pgnqInput *input);
+static bool pgnq_json_hex4(const char *p, unsigned int *code);
+static bool pgnq_json_message(const char *line, pgnqBuffer *dst);
+static bool pgnq_input_read_entry(pgnqInput *input);
+static char *pgnq_input_next_query(pgnqInput *input);
+static int64 pgnq_input_fill_chunk(pgnqInput *input, pgnqBuffer *chunk);
+static void pgnq_worker_main(int request_fd, int result_fd, int options);
+static void pgnq_write_results(pgnqBuffer *results, char separator,
+							   bool verbose, int64 *failures);
+static void usage(void);
+
+/*
+ * Report an error and exit
+ */
+static void
+pgnq_fatal(const char *fmt,...)
+{
+	va_list		ap;
+	int			save_errno = errno;
+
+	fprintf(stderr, "%s: ", progname);
+	errno = save_errno;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+static void *
+pgnq_realloc(void *ptr, size_t size)
+{
+	void	   *result = realloc(ptr, size);
+
+	if (result == NULL)
+		pgnq_fatal("out of memory");
+
+	return result;
+}
+
+/*
+ * Make room for needed more bytes, and the terminating NUL byte, in buffer
+ */
+static void
+pgnq_buffer_reserve(pgnqBuffer *buffer, size_t needed)
+{
+	size_t		size = buffer->size ? buffer->size : 1024;
+
+	if (buffer->len + needed + 1 <= buffer->size)
+		return;
+
+	while (size < buffer->len + needed + 1)
+		size *= 2;
+
+	buffer->data = pgnq_realloc(buffer->data, size);
+	buffer->size = size;
+}
+
+static void
+pgnq_buffer_append(pgnqBuffer *buffer, const void *data, size_t len)
+{
+	pgnq_buffer_reserve(buffer, len);
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+	buffer->data[buffer->len] = '\0';
+}
+
+static void
+pgnq_buffer_append_char(pgnqBuffer *buffer, char c)
+{
+	pgnq_buffer_reserve(buffer, 1);
+	buffer->data[buffer->len++] = c;
+	buffer->data[buffer->len] = '\0';
+}
+
+static void
+pgnq_buffer_reset(pgnqBuffer *buffer)
+{
+	pgnq_buffer_reserve(buffer, 0);
+	buffer->len = 0;
+	buffer->data[0] = '\0';
+}
+
+/*
+ * Read len bytes from fd, retrying after short reads.  Returns the number
+ * of bytes read, less than len only at end of file.
+ */
+static size_t
+pgnq_read_fully(int fd, void *buf, size_t len)
+{
+	size_t		done = 0;
+
+	while (done < len)
+	{
+		ssize_t		nread = read(fd, (char *) buf + done, len - done);
+
+		if (nread < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pgnq_fatal("could not read from pipe: %m");
+		}
+		if (nread == 0)
+			break;
+		done += nread;
+	}
+
+	return done;
+}
+
+static void
+pgnq_write_fully(int fd, const void *buf, size_t len)
+{
+	size_t		done = 0;
+
+	while (done < len)
+	{
+		ssize_t		nwritten = write(fd, (const char *) buf + done, len - done);
+
+		if (nwritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pgnq_fatal("could not write to pipe: %m");
+		}
+		done += nwritten;
+	}
+}
+
+/*
+ * Read a message written by pgnq_write_message() into buffer.  Returns
+ * false if fd is at end of file.
+ */
+static bool
+pgnq_read_message(int fd, pgnqBuffer *buffer)
+{
+	uint64		len;
+	size_t		nread;
+
+	nread = pgnq_read_fully(fd, &len, sizeof(len));
+	if (nread == 0)
+		return false;
+	if (nread != sizeof(len))
+		pgnq_fatal("unexpected end of pipe");
+
+	pgnq_buffer_reset(buffer);
+	pgnq_buffer_reserve(buffer, len);
+	if (pgnq_read_fully(fd, buffer->data, len) != len)
+		pgnq_fatal("unexpected end of pipe");
+	buffer->len = len;
+	buffer->data[len] = '\0';
+
+	return true;
+}
+
+static void
+pgnq_write_message(int fd, pgnqBuffer *buffer)
+{
+	uint64		len = buffer->len;
+
+	pgnq_write_fully(fd, &len, sizeof(len));
+	pgnq_write_fully(fd, buffer->data, buffer->len);
+}
+
+/*
+ * Return the next byte of the input file being read, or EOF
+ */
+static int
+pgnq_input_getc(pgnqInput *input)
+{
+	if (input->buf_pos >= input->buf_len)
+	{
+		ssize_t		nread;
+
+		do
+			nread = read(input->fd, input->buf, PGNQ_READ_SIZE);
+		while (nread < 0 && errno == EINTR);
+
+		if (nread < 0)
+			pgnq_fatal("could not read file \"%s\": %m", input->path);
+		if (nread == 0)
+			return EOF;
+
+		input->buf_len = nread;
+		input->buf_pos = 0;
+	}
+
+	return (unsigned char) input->buf[input->buf_pos++];
+}
+
+/*
+ * Return the next byte of the input file being read, or EOF, without
+ * consuming it
+ */
+static int
+pgnq_input_peekc(pgnqInput *input)
+{
+	int			c = pgnq_input_getc(input);
+
+	/* pgnq_input_getc() just returned it from the buffer */
+	if (c != EOF)
+		input->buf_pos--;
+
+	return c;
+}
+
+/*
+ * Append the next line of the input file to dst, without its line
+ * terminator.  Returns false at end of file.
+ */
+static bool
+pgnq_input_read_line(pgnqInput *input, pgnqBuffer *dst)
+{
+	if (pgnq_input_peekc(input) == EOF)
+		return false;
+
+	for (;;)
+	{
+		char	   *start = input->buf + input->buf_pos;
+		size_t		avail = input->buf_len - input->buf_pos;
+		char	   *eol = memchr(start, '\n', avail);
+
+		if (eol != NULL)
+		{
+			pgnq_buffer_append(dst, start, eol - start);
+			input->buf_pos += eol - start + 1;
+			break;
+		}
+
+		pgnq_buffer_append(dst, start, avail);
+		input->buf_pos = input->buf_len;
+
+		if (pgnq_input_peekc(input) == EOF)
+			break;
+	}
+
+	if (dst->len > 0 && dst->data[dst->len - 1] == '\r')
+		dst->data[--dst->len] = '\0';
+
+	return true;
+}
+
+/*
+ * Read the next csvlog entry, keeping only its severity and message fields.
+ * Quoted fields may span several lines.  Returns false at end of file.
+ */
+static bool
+pgnq_input_read_csv_entry(pgnqInput *input)
+{
+	int			field = 0;
+	bool		in_quotes = false;
+	int			c;
+
+	pgnq_buffer_reset(&input->severity);
+	pgnq_buffer_reset(&input->message);
+
+	if (pgnq_input_peekc(input) == EOF)
+		return false;
+
+	while ((c = pgnq_input_getc(input)) != EOF)
+	{
+		if (in_quotes)
+		{
+			if (c == '"')
+			{
+				/* A doubled quote stands for itself */
+				if (pgnq_input_peekc(input) != '"')
+				{
+					in_quotes = false;
+					continue;
+				}
+				pgnq_input_getc(input);
+			}
+		}
+		else if (c == '"')
+		{
+			in_quotes = true;
+			continue;
+		}
+		else if (c == ',')
+		{
+			field++;
+			continue;
+		}
+		else if (c == '\n')
+			break;
+		else if (c == '\r')
+			continue;
+
+		if (field == PGNQ_CSVLOG_SEVERITY)
+			pgnq_buffer_append_char(&input->severity, (char) c);
+		else if (field == PGNQ_CSVLOG_MESSAGE)
+			pgnq_buffer_append_char(&input->message, (char) c);
+	}
+
+	return true;
+}
+
+/*
+ * Read the four hexadecimal digits of a \u escape at p into *code
+ */
+static bool
+pgnq_json_hex4(const char *p, unsigned int *code)
+{
+	int			i;
+
+	*code = 0;
+	for (i = 0; i < 4; i++)
+	{
+		if (!isxdigit((unsigned char) p[i]))
+			return false;
+		*code = (*code << 4) |
+			(isdigit((unsigned char) p[i]) ? p[i] - '0' : (p[i] | 0x20) - 'a' + 10);
+	}
+
+	return true;
+}
+
+/*
+ * Put the unescaped value of the "message" string of a jsonlog entry in
+ * dst.  Returns false if there is none.
+ */
+static bool
+pgnq_json_message(const char *line, pgnqBuffer *dst)
+{
+	const char *p = strstr(line, "\"message\":\"");
+
+	if (p == NULL)
+		return false;
+	p += strlen("\"message\":\"");
+
+	pgnq_buffer_reset(dst);
+
+	while (*p != '"')
+	{
+		unsigned int code;
+		char		utf8[4];
+		int			len;
+
+		if (*p == '\0')
+			return false;
+		if (*p != '\\')
+		{
+			pgnq_buffer_append_char(dst, *p++);
+			continue;
+		}
+
+		p++;
+		switch (*p)
+		{
+			case 'b':
+				pgnq_buffer_append_char(dst, '\b');
+				break;
+			case 'f':
+				pgnq_buffer_append_char(dst, '\f');
+				break;
+			case 'n':
+				pgnq_buffer_append_char(dst, '\n');
+				break;
+			case 'r':
+				pgnq_buffer_append_char(dst, '\r');
+				break;
+			case 't':
+				pgnq_buffer_append_char(dst, '\t');
+				break;
+			case 'u':
+				if (!pgnq_json_hex4(p + 1, &code))
+					return false;
+				p += 4;
+
+				/* Combine surrogate pairs */
+				if (code >= 0xD800 && code <= 0xDBFF &&
+					p[1] == '\\' && p[2] == 'u')
+				{
+					unsigned int low;
+
+					if (pgnq_json_hex4(p + 3, &low) &&
+						low >= 0xDC00 && low <= 0xDFFF)
+					{
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+						p += 6;
+					}
+				}
+
+				if (code < 0x80)
+				{
+					utf8[0] = (char) code;
+					len = 1;
+				}
+				else if (code < 0x800)
+				{
+					utf8[0] = (char) (0xC0 | (code >> 6));
+					utf8[1] = (char) (0x80 | (code & 0x3F));
+					len = 2;
+				}
+				else if (code < 0x10000)
+				{
+					utf8[0] = (char) (0xE0 | (code >> 12));
+					utf8[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+					utf8[2] = (char) (0x80 | (code & 0x3F));
+					len = 3;
+				}
+				else
+				{
+					utf8[0] = (char) (0xF0 | (code >> 18));
+					utf8[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+					utf8[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+					utf8[3] = (char) (0x80 | (code & 0x3F));
+					len = 4;
+				}
+				pgnq_buffer_append(dst, utf8, len);
+				break;
+			case '\0':
+				return false;
+			default:
+				/* \", \\ and \/ */
+				pgnq_buffer_append_char(dst, *p);
+				break;
+		}
+		p++;
+	}
+
+	return true;
+}
+
+/*
+ * Read the input file up to its next query, for lines, or its next log
+ * entry with LOG severity, and put it in input->message.  Returns false at
+ * end of file.
+ */
+static bool
+pgnq_input_read_entry(pgnqInput *input)
+{
+	for (;;)
+	{
+		char	   *p;
+
+		switch (input->format)
+		{
+			case PGNQ_INPUT_LINES:
+				pgnq_buffer_reset(&input->message);
+				if (!pgnq_input_read_line(input, &input->message))
+					return false;
+
+				/* Skip blank lines */
+				for (p = input->message.data; *p != '\0'; p++)
+				{
+					if (!isspace((unsigned char) *p))
+						return true;
+				}
+				break;
+
+			case PGNQ_INPUT_CSVLOG:
+				if (!pgnq_input_read_csv_entry(input))
+					return false;
+				if (strcmp(input->severity.data, "LOG") == 0)
+					return true;
+				break;
+
+			case PGNQ_INPUT_JSONLOG:
+				pgnq_buffer_reset(&input->line);
+				if (!pgnq_input_read_line(input, &input->line))
+					return false;
+
+				/*
+				 * Entries are written one per line with no whitespace between
+				 * tokens, so a search is enough to find their fields.
+				 */
+				if (strstr(input->line.data, "\"error_severity\":\"LOG\"") != NULL &&
+					pgnq_json_message(input->line.data, &input->message))
+					return true;
+				break;
+
+			case PGNQ_INPUT_STDERR:
+				pgnq_buffer_reset(&input->line);
+				if (!pgnq_input_read_line(input, &input->line))
+					return false;
+
+				/* Lines starting with a tab continue the previous entry */
+				if (input->line.data[0] == '\t')
+					break;
+
+				p = strstr(input->line.data, "LOG:  ");
+				if (p == NULL)
+					break;
+
+				pgnq_buffer_reset(&input->message);
+				pgnq_buffer_append(&input->message, p + strlen("LOG:  "),
+								   strlen(p + strlen("LOG:  ")));
+
+				/* Add the lines of multi-line messages, without their tab */
+				while (pgnq_input_peekc(input) == '\t')
+				{
+					pgnq_input_getc(input);
+					pgnq_buffer_append_char(&input->message, '\n');
+					pgnq_input_read_line(input, &input->message);
+				}
+				return true;
+		}
+	}
+}
+
+/*
+ * Return the next query of the input, opening the input files as needed, or
+ * NULL once all of them are read.  The query is overwritten by the next
+ * call.
+ */
+static char *
+pgnq_input_next_query(pgnqInput *input)
+{
+	for (;;)
+	{
+		if (input->fd < 0)
+		{
+			if (input->next_path >= input->npaths)
+				return NULL;
+
+			input->path = input->paths[input->next_path++];
+			if (strcmp(input->path, "-") == 0)
+			{
+				input->path = "standard input";
+				input->fd = STDIN_FILENO;
+			}
+			else if ((input->fd = open(input->path, O_RDONLY, 0)) < 0)
+				pgnq_fatal("could not open file \"%s\": %m", input->path);
+
+			input->buf_len = 0;
+			input->buf_pos = 0;
+		}
+
+		while (pgnq_input_read_entry(input))
+		{
+			char	   *stmt;
+			double		duration;
+			bool		has_duration;
+
+			if (input->format == PGNQ_INPUT_LINES)
+				return input->message.data;
+
+			stmt = pgnq_log_statement(input->message.data, &duration,
+									  &has_duration);
+			if (stmt != NULL)
+				return stmt;
+		}
+
+		if (input->fd != STDIN_FILENO)
+			close(input->fd);
+		input->fd = -1;
+	}
+}
+
+/*
+ * Put the next queries of the input in chunk, in the format read by the
+ * workers.  Returns the number of queries, 0 once the input is exhausted.
+ */
+static int64
+pgnq_input_fill_chunk(pgnqInput *input, pgnqBuffer *chunk)
+{
+	int64		nqueries = 0;
+	char	   *query;
+
+	pgnq_buffer_reset(chunk);
+
+	while (chunk->len < PGNQ_CHUNK_SIZE &&
+		   (query = pgnq_input_next_query(input)) != NULL)
+	{
+		uint32		len = strlen(query);
+
+		pgnq_buffer_append(chunk, &len, sizeof(len));
+		pgnq_buffer_append(chunk, query, len + 1);
+		nqueries++;
+	}
+
+	return nqueries;
+}
+
+/*
+ * Body of a worker process: normalize the chunks coming from request_fd
+ * and send the results to result_fd, until the parent closes request_fd
+ */
+static void
+pgnq_worker_main(int request_fd, int result_fd, int options)
+{
+	pgnqBuffer	chunk = {0};
+	pgnqBuffer	results = {0};
+
+	while (pgnq_read_message(request_fd, &chunk))
+	{
+		char	   *p = chunk.data;
+		char	   *end = chunk.data + chunk.len;
+
+		pgnq_buffer_reset(&results);
+
+		while (p < end)
+		{
+			uint32		len;
+			char	   *normalized;
+			char	   *error;
+			char	   *out;
+			uint8		ok;
+
+			memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+
+			normalized = pgnq_normalize_string(p, options, &error);
+			p += len + 1;
+
+			ok = (normalized != NULL);
+			out = ok ? normalized : error;
+			len = (out != NULL) ? strlen(out) : 0;
+
+			pgnq_buffer_append(&results, &ok, sizeof(ok));
+			pgnq_buffer_append(&results, &len, sizeof(len));
+			if (len > 0)
+				pgnq_buffer_append(&results, out, len);
+
+			free(normalized);
+			free(error);
+		}
+
+		pgnq_write_message(result_fd, &results);
+	}
+
+	exit(0);
+}
+
+/*
+ * Write the normalized queries of a chunk to standard output, each followed
+ * by separator, and count the ones that couldn't be normalized
+ */
+static void
+pgnq_write_results(pgnqBuffer *results, char separator, bool verbose,
+				   int64 *failures)
+{
+	char	   *p = results->data;
+	char	   *end = results->data + results->len;
+
+	while (p < end)
+	{
+		uint8		ok;
+		uint32		len;
+
+		memcpy(&ok, p, sizeof(ok));
+		p += sizeof(ok);
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+
+		if (ok)
+		{
+			fwrite(p, 1, len, stdout);
+			putc(separator, stdout);
+		}
+		else
+		{
+			(*failures)++;
+			if (verbose)
+				fprintf(stderr, "%s: could not normalize query: %.*s\n",
+						progname, (int) len, p);
+		}
+		p += len;
+	}
+
+	if (ferror(stdout))
+		pgnq_fatal("could not write to standard output: %m");
+}
+
+static void
+usage(void)
+{
+	printf("%s normalizes the queries of SQL files and server logs.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]... [FILE]...\n", progname);
+	printf("\nOptions:\n");
+	printf("  -c, --collapse-lists           collapse lists of constants\n");
+	printf("  -F, --format=FORMAT            input format: lines (default), stderr,\n"
+		   "                                 csvlog or jsonlog\n");
+	printf("  -j, --jobs=NUM                 use this many worker processes\n"
+		   "                                 (default: number of CPUs)\n");
+	printf("  -s, --canonicalize-whitespace  canonicalize whitespace\n");
+	printf("  -u, --fold-case                fold keyword and identifier case\n");
+	printf("  -v, --verbose                  report the queries that can't be normalized\n");
+	printf("  -0, --null                     end normalized queries with a NUL byte\n"
+		   "                                 rather than a newline\n");
+	printf("  -?, --help                     show this help, then exit\n");
+	printf("\nWith no FILE, or when FILE is -, read standard input.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"collapse-lists", no_argument, NULL, 'c'},
+		{"format", required_argument, NULL, 'F'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"canonicalize-whitespace", no_argument, NULL, 's'},
+		{"fold-case", no_argument, NULL, 'u'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"null", no_argument, NULL, '0'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+	static char *stdin_paths[] = {"-"};
+	pgnqInput	input = {0};
+	pgnqWorker *workers;
+	pgnqSlot   *slots;
+	struct pollfd *pollfds;
+	pgnqBuffer	chunk = {0};
+	int			options = 0;
+	int			njobs;
+	int			window;
+	char		separator = '\n';
+	bool		verbose = false;
+	bool		input_done = false;
+	int64		next_seq = 0;
+	int64		write_seq = 0;
+	int64		failures = 0;
+	int			c;
+	int			i;
+
+	if (argc > 1 &&
+		(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0))
+	{
+		usage();
+		exit(0);
+	}
+
+	njobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (njobs < 1)
+		njobs = 1;
+	input.format = PGNQ_INPUT_LINES;
+
+	while ((c = getopt_long(argc, argv, "cF:j:suv0?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'c':
+				options |= PGNQ_OPT_COLLAPSE_LISTS;
+				break;
+			case 'F':
+				if (strcmp(optarg, "lines") == 0)
+					input.format = PGNQ_INPUT_LINES;
+				else if (strcmp(optarg, "stderr") == 0)
+					input.format = PGNQ_INPUT_STDERR;
+				else if (strcmp(optarg, "csvlog") == 0)
+					input.format = PGNQ_INPUT_CSVLOG;
+				else if (strcmp(optarg, "jsonlog") == 0)
+					input.format = PGNQ_INPUT_JSONLOG;
+				else
+					pgnq_fatal("invalid input format \"%s\"", optarg);
+				break;
+			case 'j':
+				njobs = atoi(optarg);
+				if (njobs < 1)
+					pgnq_fatal("number of jobs must be at least 1");
+				break;
+			case 's':
+				options |= PGNQ_OPT_CANONICAL_SPACE;
+				break;
+			case 'u':
+				options |= PGNQ_OPT_FOLD_CASE;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case '0':
+				separator = '\0';
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n",
+						progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+	{
+		input.paths = argv + optind;
+		input.npaths = argc - optind;
+	}
+	else
+	{
+		input.paths = stdin_paths;
+		input.npaths = 1;
+	}
+	input.fd = -1;
+	input.buf = pgnq_realloc(NULL, PGNQ_READ_SIZE);
+
+	/* Report write errors on the pipes rather than being killed by them */
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = pgnq_realloc(NULL, njobs * sizeof(pgnqWorker));
+	pollfds = pgnq_realloc(NULL, njobs * sizeof(struct pollfd));
+
+	for (i = 0; i < njobs; i++)
+	{
+		int			request_pipe[2];
+		int			result_pipe[2];
+		pid_t		pid;
+
+		if (pipe(request_pipe) < 0 || pipe(result_pipe) < 0)
+			pgnq_fatal("could not create pipe: %m");
+
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0)
+			pgnq_fatal("could not fork worker process: %m");
+
+		if (pid == 0)
+		{
+			int			j;
+
+			/* The other workers must see the end of their own pipes */
+			for (j = 0; j < i; j++)
+			{
+				close(workers[j].request_fd);
+				close(workers[j].result_fd);
+			}
+			close(request_pipe[1]);
+			close(result_pipe[0]);
+
+			pgnq_worker_main(request_pipe[0], result_pipe[1], options);
+		}
+
+		close(request_pipe[0]);
+		close(result_pipe[1]);
+
+		workers[i].pid = pid;
+		workers[i].request_fd = request_pipe[1];
+		workers[i].result_fd = result_pipe[0];
+		workers[i].seq = -1;
+	}
+
+	/*
+	 * Results are kept until the ones of all previous chunks are written, so
+	 * the chunks handed out are limited to a window beyond the next one to
+	 * write.  That is more than the number of workers, so that a single slow
+	 * chunk doesn't leave the others idle.
+	 */
+	window = 2 * njobs;
+	slots = pgnq_realloc(NULL, window * sizeof(pgnqSlot));
+	memset(slots, 0, window * sizeof(pgnqSlot));
+
+	setvbuf(stdout, NULL, _IOFBF, PGNQ_WRITE_SIZE);
+
+	for (;;)
+	{
+		int			npollfds = 0;
+
+		/* Hand the next chunks to the idle workers */
+		for (i = 0; i < njobs && !input_done; i++)
+		{
+			if (workers[i].seq >= 0)
+				continue;
+			if (next_seq >= write_seq + window)
+				break;
+
+			if (pgnq_input_fill_chunk(&input, &chunk) == 0)
+			{
+				input_done = true;
+				break;
+			}
+
+			pgnq_write_message(workers[i].request_fd, &chunk);
+			workers[i].seq = next_seq++;
+		}
+
+		/* Write the results that are next in order */
+		while (write_seq < next_seq && slots[write_seq % window].ready)
+		{
+			pgnqSlot   *slot = &slots[write_seq % window];
+
+			pgnq_write_results(&slot->results, separator, verbose, &failures);
+			slot->ready = false;
+			write_seq++;
+		}
+
+		if (input_done && write_seq == next_seq)
+			break;
+
+		/* Wait for workers to be done with their chunk */
+		for (i = 0; i < njobs; i++)
+		{
+			if (workers[i].seq < 0)
+				continue;
+			pollfds[npollfds].fd = workers[i].result_fd;
+			pollfds[npollfds].events = POLLIN;
+			pollfds[npollfds].revents = 0;
+			npollfds++;
+		}
+
+		if (poll(pollfds, npollfds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pgnq_fatal("could not poll worker processes: %m");
+		}
+
+		npollfds = 0;
+		for (i = 0; i < njobs; i++)
+		{
+			pgnqSlot   *slot;
+
+			if (workers[i].seq < 0)
+				continue;
+			if (pollfds[npollfds++].revents == 0)
+				continue;
+
+			slot = &slots[workers[i].seq % window];
+			if (!pgnq_read_message(workers[i].result_fd, &slot->results))
+				pgnq_fatal("worker process %d exited unexpectedly",
+						   (int) workers[i].pid);
+			slot->ready = true;
+			workers[i].seq = -1;
+		}
+	}
+
+	if (fflush(stdout) != 0)
+		pgnq_fatal("could not write to standard output: %m");
+
+	/* Workers exit once they see the end of their request pipe */
+	for (i = 0; i < njobs; i++)
+		close(workers[i].request_fd);
+
+	for (i = 0; i < njobs; i++)
+	{
+		int			status;
+
+		if (waitpid(workers[i].pid, &status, 0) < 0)
+			pgnq_fatal("could not wait for worker process: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			pgnq_fatal("worker process %d exited unexpectedly",
+					   (int) workers[i].pid);
+	}
+
+	if (failures > 0)
+		fprintf(stderr, "%s: " INT64_FORMAT " queries could not be normalized\n",
+				progname, failures);
+
+	return 0;
+}
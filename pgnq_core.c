@@ -0,0 +1,1234 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgnq_core.c
+ *	  Normalization core of pg_normalize_query, see pgnq_core.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "nodes/nodeFuncs.h"
+#include "parser/parser.h"
+#include "parser/scanner.h"
+#include "parser/gram.h"		/* must come after scanner.h */
+#include "parser/scansup.h"
+#include "utils/memutils.h"
+
+#include "pgnq_core.h"
+
+/*
+ * A parse tree node waiting to be visited by pgnq_const_record_walker()
+ */
+typedef struct pgnqWalkItem
+{
+	Node	   *node;
+	int			depth;			/* depth of node in the parse tree */
+} pgnqWalkItem;
+
+/*
+ * Explicit work stack of pgnq_const_record_walker(), so that the depth of
+ * the parse tree doesn't translate into C stack usage
+ */
+typedef struct pgnqWalkState
+{
+	pgnqConstLocations *jstate;
+	pgnqWalkItem *items;
+	int			items_size;		/* allocated length of items */
+	int			items_count;	/* number of nodes waiting */
+	int			depth;			/* depth of the node being visited */
+} pgnqWalkState;
+
+static int pgnq_comp_location(const void *a, const void *b);
+static int	pgnq_write_param_symbol(char *dest, int n);
+static int	pgnq_param_symbol_len(int n);
+static int	pgnq_write_placeholder(pgnqConstLocations *jstate, int i,
+								   int *collapsed_rows, char *dest);
+static void pgnq_copy_folded_token(int tok, const char *src, int len, char *dest);
+static int	pgnq_build_token_query(pgnqConstLocations *jstate, const char *query,
+								   int query_loc, int query_len, char *norm_query);
+static void pgnq_record_collapsed_location(pgnqConstLocations *jstate,
+										   pgnqLocationKind kind,
+										   int location, int squash_end);
+static int	pgnq_list_element_location(List *list, int n);
+static bool pgnq_is_collapsible_list(Node *node);
+static void pgnq_const_record_list_params(List *list, pgnqConstLocations *jstate);
+static bool pgnq_collapse_values_lists(SelectStmt *stmt, pgnqWalkState *walk);
+static void pgnq_walk_push(pgnqWalkState *walk, Node *node);
+static bool pgnq_walk_push_walker(Node *node, void *context);
+static void pgnq_walk_reverse(pgnqWalkState *walk, int first);
+static bool pgnq_is_walkable_node(Node *node);
+static void pgnq_const_record_node(Node *node, pgnqWalkState *walk);
+
+/*
+ * Set up a workspace for constant recording, normalizing with the given
+ * PGNQ_OPT_* options.  It can be reused by several calls to
+ * pgnq_normalize(), which reset it as needed.
+ */
+void
+pgnq_init_const_locations(pgnqConstLocations *jstate, int options)
+{
+	jstate->clocations_buf_size = 32;
+	jstate->clocations = (pgnqLocationLen *)
+		palloc(jstate->clocations_buf_size * sizeof(pgnqLocationLen));
+	jstate->clocations_count = 0;
+	jstate->highest_extern_param_id = 0;
+	jstate->options = options;
+	jstate->clocations_growths = 0;
+	jstate->profile = NULL;
+}
+
+/*
+ * Add the time elapsed since *lap to *elapsed, in msec, and start a new lap
+ */
+void
+pgnq_profile_lap(instr_time *lap, double *elapsed)
+{
+	instr_time	now;
+	instr_time	diff;
+
+	INSTR_TIME_SET_CURRENT(now);
+	diff = now;
+	INSTR_TIME_SUBTRACT(diff, *lap);
+	*elapsed += INSTR_TIME_GET_MILLISEC(diff);
+	*lap = now;
+}
+
+/*
+ * pgnq_comp_location: comparator for qsorting pgnqLocationLen structs by location
+ */
+static int
+pgnq_comp_location(const void *a, const void *b)
+{
+	int			l = ((const pgnqLocationLen *) a)->location;
+	int			r = ((const pgnqLocationLen *) b)->location;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Length of the constant starting at loc and ending with the token the
+ * scanner just returned.
+ */
+int
+pgnq_scanned_constant_length(core_yy_extra_type *yyextra, int loc)
+{
+	int			length;
+
+	/*
+	 * We now rely on the assumption that flex has placed a zero
+	 * byte after the text of the current token in scanbuf.
+	 */
+	length = (int) strlen(yyextra->scanbuf + loc);
+
+	/* Quoted string with Unicode escapes
+	 *
+	 * The lexer consumes trailing whitespace in order to find UESCAPE, but if there
+	 * is no UESCAPE it has still consumed it - don't include it in constant length.
+	 */
+	if (length > 4 && /* U&'' */
+		(yyextra->scanbuf[loc] == 'u' || yyextra->scanbuf[loc] == 'U') &&
+		 yyextra->scanbuf[loc + 1] == '&' && yyextra->scanbuf[loc + 2] == '\'')
+	{
+		int j = length - 1; /* Skip the \0 */
+		for (; j >= 0 && scanner_isspace(yyextra->scanbuf[loc + j]); j--) {}
+		length = j + 1; /* Count the \0 */
+	}
+
+	return length;
+}
+
+/*
+ * Sort the records by location so that we can process them in order while
+ * scanning the query text.
+ */
+void
+pgnq_sort_const_locations(pgnqConstLocations *jstate)
+{
+	int			i;
+
+	/*
+	 * The walker visits the tree in source order, so the records usually are
+	 * sorted already: don't pay for a qsort() then.
+	 */
+	for (i = 1; i < jstate->clocations_count; i++)
+	{
+		if (jstate->clocations[i].location < jstate->clocations[i - 1].location)
+			break;
+	}
+
+	if (i < jstate->clocations_count)
+		qsort(jstate->clocations, jstate->clocations_count,
+			  sizeof(pgnqLocationLen), pgnq_comp_location);
+}
+
+/*
+ * Lex tokens until reaching the one at loc, and return its code, or 0 at
+ * end-of-string.  The locations of the two tokens lexed just before it are
+ * remembered in prev_locs.  If ntokens is not NULL, the number of tokens
+ * lexed is added to it.
+ *
+ * N.B. There is an assumption that a '-' character at a Const location begins
+ * a negative numeric constant.  This precludes there ever being another
+ * reason for a constant to start with a '-'.
+ */
+int
+pgnq_lex_to_location(core_yyscan_t yyscanner, core_YYSTYPE *yylval,
+					 YYLTYPE *yylloc, const char *query, int loc,
+					 int *prev_locs, int64 *ntokens)
+{
+	int			tok;
+
+	for (;;)
+	{
+		tok = core_yylex(yylval, yylloc, yyscanner);
+		if (ntokens != NULL)
+			(*ntokens)++;
+
+		/* We should not hit end-of-string, but if we do, behave sanely */
+		if (tok == 0)
+			return 0;
+
+		/*
+		 * We should find the token position exactly, but if we somehow run
+		 * past it, work with that.
+		 */
+		if (*yylloc >= loc)
+			break;
+
+		prev_locs[1] = prev_locs[0];
+		prev_locs[0] = *yylloc;
+	}
+
+	if (query[loc] == '-')
+	{
+		/*
+		 * It's a negative value - this is the one and only case where we
+		 * replace more than a single token.
+		 *
+		 * Do not compensate for the core system's special-case adjustment of
+		 * location to that of the leading '-' operator in the event of a
+		 * negative constant.  It is also useful for our purposes to start from
+		 * the minus symbol.  In this way, queries like "select * from foo
+		 * where bar = 1" and "select * from foo where bar = -2" will have
+		 * identical normalized query strings.
+		 */
+		tok = core_yylex(yylval, yylloc, yyscanner);
+		if (ntokens != NULL)
+			(*ntokens)++;
+	}
+
+	return tok;
+}
+
+/*
+ * Given a valid SQL string and an array of constant-location records,
+ * fill in the textual lengths of those constants.
+ *
+ * The constants may use any allowed constant syntax, such as float literals,
+ * bit-strings, single-quoted strings and dollar-quoted strings.  This is
+ * accomplished by using the public API for the core scanner.
+ *
+ * It is the caller's job to ensure that the string is a valid SQL statement
+ * with constants at the indicated locations.  Since in practice the string
+ * has already been parsed, and the locations that the caller provides will
+ * have originated from within the authoritative parser, this should not be
+ * a problem.
+ *
+ * Duplicate constant pointers are possible, and will have their lengths
+ * marked as '-1', so that they are later ignored.  (Actually, we assume the
+ * lengths were initialized as -1 to start with, and don't change them here.)
+ *
+ * Collapsed lists span from their first to their last element.  The span of
+ * VALUES rows is widened to start at the comma before the first collapsed
+ * row and to end at the closing parenthesis of the last one.
+ *
+ * query_loc is the location of query in the string the constants were
+ * recorded from, when only one of its statements is passed.
+ */
+void
+pgnq_fill_in_constant_lengths(pgnqConstLocations *jstate, const char *query,
+							  int query_loc)
+{
+	pgnqLocationLen *locs;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			prev_locs[2] = {-1, -1};
+	int			last_loc = -1;
+	int64	   *ntokens = NULL;
+	instr_time	lap;
+	int			i;
+
+	if (jstate->profile != NULL)
+	{
+		ntokens = &jstate->profile->tokens;
+		INSTR_TIME_SET_CURRENT(lap);
+	}
+
+	pgnq_sort_const_locations(jstate);
+	locs = jstate->clocations;
+
+	if (jstate->profile != NULL)
+		pgnq_profile_lap(&lap, &jstate->profile->sort_time);
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+
+	/* Search for each constant, in sequence */
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			loc = locs[i].location;
+		int			squash_end = locs[i].squash_end;
+		int			start;
+		int			end;
+
+		/* Adjust recorded location if we're dealing with partial string */
+		loc -= query_loc;
+		squash_end -= query_loc;
+
+		Assert(loc >= 0);
+
+		if (loc <= last_loc)
+		{
+			/* Duplicate constant, ignore */
+			if (jstate->profile != NULL)
+				jstate->profile->duplicates++;
+			continue;
+		}
+
+		/* Lex tokens until we find the desired constant */
+		if (pgnq_lex_to_location(yyscanner, &yylval, &yylloc, query, loc,
+								 prev_locs, ntokens) == 0)
+			break;				/* give up, leaving remaining lengths -1 */
+
+		if (locs[i].kind == PGNQ_LOC_CONST)
+		{
+			locs[i].length = pgnq_scanned_constant_length(&yyextra, loc);
+			last_loc = loc;
+			continue;
+		}
+
+		/* The comma before the row, as the '(' comes just after it */
+		start = loc;
+		if (locs[i].kind == PGNQ_LOC_ROWS && prev_locs[1] >= 0)
+			start = prev_locs[1];
+
+		/* Then find the last element of the collapsed list */
+		if (squash_end > loc &&
+			pgnq_lex_to_location(yyscanner, &yylval, &yylloc, query,
+								 squash_end, prev_locs, ntokens) == 0)
+			break;
+
+		if (locs[i].kind == PGNQ_LOC_LIST)
+			end = squash_end + pgnq_scanned_constant_length(&yyextra, squash_end);
+		else
+		{
+			/* Include the closing parenthesis of the last row */
+			if (ntokens != NULL)
+				(*ntokens)++;
+			if (core_yylex(&yylval, &yylloc, yyscanner) == 0)
+				break;
+			end = yylloc + 1;
+		}
+
+		locs[i].location = start + query_loc;
+		locs[i].length = end - start;
+		last_loc = end - 1;
+	}
+
+	scanner_finish(yyscanner);
+
+	if (jstate->profile != NULL)
+		pgnq_profile_lap(&lap, &jstate->profile->rescan_time);
+}
+
+/*
+ * Write the $n symbol for the n-th parameter at dest, without a trailing
+ * zero byte.  Returns the number of bytes written.
+ */
+static int
+pgnq_write_param_symbol(char *dest, int n)
+{
+	char		digits[16];
+	int			ndigits = 0;
+	int			i;
+
+	Assert(n > 0);
+
+	do
+	{
+		digits[ndigits++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	dest[0] = '$';
+	for (i = 0; i < ndigits; i++)
+		dest[i + 1] = digits[ndigits - i - 1];
+
+	return ndigits + 1;
+}
+
+/*
+ * Length of the $n symbol for the n-th parameter
+ */
+static int
+pgnq_param_symbol_len(int n)
+{
+	int			len = 2;
+
+	while (n >= 10)
+	{
+		n /= 10;
+		len++;
+	}
+
+	return len;
+}
+
+/*
+ * Compute the exact length of the normalized version of a query_len bytes
+ * long query, as generated by pgnq_build_normalized_query().
+ *
+ * The constant records must be sorted by location and have their lengths
+ * filled in.
+ */
+int
+pgnq_normalized_query_len(pgnqConstLocations *jstate, int query_len)
+{
+	int			len = query_len;
+	int			collapsed_rows = 0;
+	int			i;
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		if (jstate->clocations[i].length < 0)
+			continue;			/* ignore any duplicates */
+
+		len -= jstate->clocations[i].length;
+		if (jstate->clocations[i].kind == PGNQ_LOC_ROWS)
+			collapsed_rows++;
+		else
+			len += pgnq_param_symbol_len(i + 1 + jstate->highest_extern_param_id -
+										 collapsed_rows);
+		if (jstate->clocations[i].kind != PGNQ_LOC_CONST)
+			len += strlen(PGNQ_COLLAPSED_SUFFIX);
+	}
+
+	return len;
+}
+
+/*
+ * Generate a normalized version of the query string that will be used to
+ * represent all similar queries.
+ *
+ * The constant records must be sorted by location and have their lengths
+ * filled in.
+ *
+ * Note that the normalized representation may well vary depending on
+ * just which "equivalent" query is used to create the hashtable entry.
+ * We assume this is OK.
+ *
+ * The result is written to norm_query, which must have room for the number
+ * of bytes computed by pgnq_normalized_query_len().  No trailing zero byte
+ * is added.  Returns the result length.
+ */
+int
+pgnq_build_normalized_query(pgnqConstLocations *jstate, const char *query,
+							int query_loc, int query_len, char *norm_query)
+{
+	int			i,
+				len_to_wrt,		/* Length (in bytes) to write */
+				quer_loc = 0,	/* Source query byte location */
+				n_quer_loc = 0, /* Normalized query byte location */
+				last_off = 0,	/* Offset from start for previous tok */
+				last_tok_len = 0,		/* Length (in bytes) of that tok */
+				collapsed_rows = 0;		/* VALUES rows collapsed so far */
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			off,		/* Offset from start for cur tok */
+					tok_len;	/* Length (in bytes) of that tok */
+
+		off = jstate->clocations[i].location;
+		/* Adjust recorded location if we're dealing with partial string */
+		off -= query_loc;
+
+		tok_len = jstate->clocations[i].length;
+
+		if (tok_len < 0)
+			continue;			/* ignore any duplicates */
+
+		/* Copy next chunk (what precedes the next constant) */
+		len_to_wrt = off - last_off;
+		len_to_wrt -= last_tok_len;
+
+		Assert(len_to_wrt >= 0);
+		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+		n_quer_loc += len_to_wrt;
+
+		/* And insert a param symbol in place of the constant token */
+		n_quer_loc += pgnq_write_placeholder(jstate, i, &collapsed_rows,
+											 norm_query + n_quer_loc);
+
+		quer_loc = off + tok_len;
+		last_off = off;
+		last_tok_len = tok_len;
+	}
+
+	/*
+	 * We've copied up until the last ignorable constant.  Copy over the
+	 * remaining bytes of the original query string.
+	 */
+	len_to_wrt = query_len - quer_loc;
+
+	Assert(len_to_wrt >= 0);
+	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+	n_quer_loc += len_to_wrt;
+
+	return n_quer_loc;
+}
+
+/*
+ * Write what replaces the i-th recorded constant: a param symbol, followed by
+ * PGNQ_COLLAPSED_SUFFIX for collapsed lists.  Collapsed VALUES rows take no
+ * param symbol, so the following ones are numbered as if they weren't
+ * recorded; *collapsed_rows counts those written so far.  Returns the number
+ * of bytes written.
+ */
+static int
+pgnq_write_placeholder(pgnqConstLocations *jstate, int i, int *collapsed_rows,
+					   char *dest)
+{
+	int			len = 0;
+
+	if (jstate->clocations[i].kind == PGNQ_LOC_ROWS)
+		(*collapsed_rows)++;
+	else
+		len += pgnq_write_param_symbol(dest,
+									   i + 1 + jstate->highest_extern_param_id -
+									   *collapsed_rows);
+
+	/* Collapsed lists are marked as such */
+	if (jstate->clocations[i].kind != PGNQ_LOC_CONST)
+	{
+		memcpy(dest + len, PGNQ_COLLAPSED_SUFFIX, strlen(PGNQ_COLLAPSED_SUFFIX));
+		len += strlen(PGNQ_COLLAPSED_SUFFIX);
+	}
+
+	return len;
+}
+
+/*
+ * Copy a token of len bytes, writing it in upper case if it is a keyword and
+ * in lower case if it is an unquoted name.  Case folding is ASCII-only, like
+ * the keyword lookup, so the length does not change.
+ */
+static void
+pgnq_copy_folded_token(int tok, const char *src, int len, char *dest)
+{
+	bool		upper;
+	int			i;
+
+	if (tok == IDENT && src[0] != '"' &&
+		!((src[0] == 'u' || src[0] == 'U') && src[1] == '&'))
+		upper = false;
+	else if (tok >= 256 && tok != IDENT &&
+			 ((src[0] >= 'a' && src[0] <= 'z') || (src[0] >= 'A' && src[0] <= 'Z')) &&
+#if PG_VERSION_NUM >= 120000
+			 ScanKeywordLookup(src, &ScanKeywords) >= 0
+#else
+			 ScanKeywordLookup(src, ScanKeywords, NumScanKeywords) != NULL
+#endif
+		)
+		upper = true;
+	else
+	{
+		memcpy(dest, src, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		dest[i] = upper ? pg_ascii_toupper((unsigned char) src[i]) :
+			pg_ascii_tolower((unsigned char) src[i]);
+}
+
+/*
+ * Like pgnq_build_normalized_query(), but with the query lexed again so that
+ * each token is copied on its own.  This is how the options that change the
+ * text around constants are applied:
+ *
+ * - with PGNQ_OPT_CANONICAL_SPACE, each run of whitespace and comments
+ *   between two tokens is replaced by a single space, and those at either
+ *   end are left out;
+ * - with PGNQ_OPT_FOLD_CASE, keywords are written in upper case and unquoted
+ *   names in lower case.
+ *
+ * The contents of quoted identifiers, literals left in place and
+ * dollar-quoted bodies are copied as they are.  The result is never longer
+ * than the one of pgnq_build_normalized_query(), as only separators get
+ * shorter.
+ */
+static int
+pgnq_build_token_query(pgnqConstLocations *jstate, const char *query,
+					   int query_loc, int query_len, char *norm_query)
+{
+	bool		canonical_space = (jstate->options & PGNQ_OPT_CANONICAL_SPACE) != 0;
+	bool		fold_case = (jstate->options & PGNQ_OPT_FOLD_CASE) != 0;
+	pgnqLocationLen *locs = jstate->clocations;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			n_quer_loc = 0; /* Normalized query byte location */
+	int			quer_loc = 0;	/* End of the source text written so far */
+	int			collapsed_rows = 0; /* VALUES rows collapsed so far */
+	int			i = 0;
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(PGNQ_SCANNER_INIT_ARGS);
+
+	/* we don't want to re-emit any escape string warnings */
+	yyextra.escape_string_warning = false;
+
+	for (;;)
+	{
+		int			tok = core_yylex(&yylval, &yylloc, yyscanner);
+		int			off = yylloc;
+		int			tok_len;
+
+		if (tok == 0)
+			break;
+
+		/* Tokens inside a replaced constant or list are dropped */
+		if (off < quer_loc)
+			continue;
+
+		/* Copy what separates the tokens, or a single space standing for it */
+		if (!canonical_space)
+		{
+			memcpy(norm_query + n_quer_loc, query + quer_loc, off - quer_loc);
+			n_quer_loc += off - quer_loc;
+		}
+		else if (n_quer_loc > 0 && off > quer_loc)
+			norm_query[n_quer_loc++] = ' ';
+
+		/* Skip duplicates and constants the token went past */
+		while (i < jstate->clocations_count &&
+			   (locs[i].length < 0 || locs[i].location - query_loc < off))
+		{
+			/* Numbered as pgnq_normalized_query_len() expects */
+			if (locs[i].length >= 0 && locs[i].kind == PGNQ_LOC_ROWS)
+				collapsed_rows++;
+			i++;
+		}
+
+		if (i < jstate->clocations_count && locs[i].location - query_loc == off)
+		{
+			n_quer_loc += pgnq_write_placeholder(jstate, i, &collapsed_rows,
+												 norm_query + n_quer_loc);
+			quer_loc = off + locs[i].length;
+			i++;
+			continue;
+		}
+
+		tok_len = pgnq_scanned_constant_length(&yyextra, off);
+		if (fold_case)
+			pgnq_copy_folded_token(tok, yyextra.scanbuf + off, tok_len,
+								   norm_query + n_quer_loc);
+		else
+			memcpy(norm_query + n_quer_loc, query + off, tok_len);
+		n_quer_loc += tok_len;
+		quer_loc = off + tok_len;
+	}
+
+	scanner_finish(yyscanner);
+
+	/* Then whatever follows the last token */
+	if (!canonical_space && query_len > quer_loc)
+	{
+		memcpy(norm_query + n_quer_loc, query + quer_loc, query_len - quer_loc);
+		n_quer_loc += query_len - quer_loc;
+	}
+
+	return n_quer_loc;
+}
+
+/*
+ * Generate the normalized version of a query straight into a text datum of
+ * the exact size needed, or just large enough when whitespace is
+ * canonicalized.
+ */
+text *
+pgnq_build_normalized_text(pgnqConstLocations *jstate, const char *query,
+						   int query_loc, int query_len)
+{
+	int			len = pgnq_normalized_query_len(jstate, query_len);
+	text	   *result = (text *) palloc(VARHDRSZ + len);
+
+	if ((jstate->options & PGNQ_OPT_TOKEN_BUILD) != 0)
+		len = pgnq_build_token_query(jstate, query, query_loc, query_len,
+									 VARDATA(result));
+	else
+		len = pgnq_build_normalized_query(jstate, query, query_loc, query_len,
+										  VARDATA(result));
+	SET_VARSIZE(result, VARHDRSZ + len);
+
+	return result;
+}
+
+void
+pgnq_record_const_location(pgnqConstLocations *jstate, int location)
+{
+	/* -1 indicates unknown or undefined location */
+	if (location >= 0)
+	{
+		/* enlarge array if needed */
+		if (jstate->clocations_count >= jstate->clocations_buf_size)
+		{
+			jstate->clocations_buf_size *= 2;
+			jstate->clocations = (pgnqLocationLen *)
+				repalloc(jstate->clocations,
+						 jstate->clocations_buf_size *
+						 sizeof(pgnqLocationLen));
+			jstate->clocations_growths++;
+		}
+		jstate->clocations[jstate->clocations_count].location = location;
+		/* initialize lengths to -1 to simplify pgnq_fill_in_constant_lengths */
+		jstate->clocations[jstate->clocations_count].length = -1;
+		jstate->clocations[jstate->clocations_count].kind = PGNQ_LOC_CONST;
+		jstate->clocations[jstate->clocations_count].squash_end = -1;
+		jstate->clocations_count++;
+	}
+}
+
+/*
+ * Record a list of constants to collapse, from the element at location to the
+ * one at squash_end
+ */
+static void
+pgnq_record_collapsed_location(pgnqConstLocations *jstate,
+							   pgnqLocationKind kind,
+							   int location, int squash_end)
+{
+	if (location < 0 || squash_end < location)
+		return;
+
+	pgnq_record_const_location(jstate, location);
+	jstate->clocations[jstate->clocations_count - 1].kind = kind;
+	jstate->clocations[jstate->clocations_count - 1].squash_end = squash_end;
+}
+
+/*
+ * Location of the n-th element of a list accepted by
+ * pgnq_is_collapsible_list()
+ */
+static int
+pgnq_list_element_location(List *list, int n)
+{
+	Node	   *elem = (Node *) list_nth(list, n);
+
+	if (IsA(elem, A_Const))
+		return ((A_Const *) elem)->location;
+
+	return ((ParamRef *) elem)->location;
+}
+
+/*
+ * Is node a non-empty list made only of constants and parameters?
+ */
+static bool
+pgnq_is_collapsible_list(Node *node)
+{
+	ListCell   *lc;
+
+	if (node == NULL || !IsA(node, List))
+		return false;
+
+	foreach(lc, (List *) node)
+	{
+		Node	   *elem = (Node *) lfirst(lc);
+
+		if (!IsA(elem, A_Const) && !IsA(elem, ParamRef))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Account for the parameters of a list accepted by pgnq_is_collapsible_list()
+ * without recording its constants
+ */
+static void
+pgnq_const_record_list_params(List *list, pgnqConstLocations *jstate)
+{
+	ListCell   *lc;
+
+	foreach(lc, list)
+	{
+		ParamRef   *param = (ParamRef *) lfirst(lc);
+
+		if (IsA(param, ParamRef) &&
+			param->number > jstate->highest_extern_param_id)
+			jstate->highest_extern_param_id = param->number;
+	}
+}
+
+/*
+ * Collapse the rows of a VALUES list after the first one, if every row is
+ * made only of constants and parameters.  Returns false, having recorded
+ * nothing, if the list can't be collapsed.
+ */
+static bool
+pgnq_collapse_values_lists(SelectStmt *stmt, pgnqWalkState *walk)
+{
+	pgnqConstLocations *jstate = walk->jstate;
+	List	   *second_row;
+	List	   *last_row;
+	ListCell   *lc;
+	int			first = walk->items_count;
+
+	foreach(lc, stmt->valuesLists)
+	{
+		if (!pgnq_is_collapsible_list((Node *) lfirst(lc)))
+			return false;
+	}
+
+	/* Parameters of the other rows still count in the numbering */
+	foreach(lc, stmt->valuesLists)
+		pgnq_const_record_list_params((List *) lfirst(lc), jstate);
+
+	second_row = (List *) lsecond(stmt->valuesLists);
+	last_row = (List *) llast(stmt->valuesLists);
+	pgnq_record_collapsed_location(jstate, PGNQ_LOC_ROWS,
+								   pgnq_list_element_location(second_row, 0),
+								   pgnq_list_element_location(last_row,
+															  list_length(last_row) - 1));
+
+	/*
+	 * The first row is normalized as usual, and the rest of the statement
+	 * may still hold constants
+	 */
+	pgnq_walk_push(walk, (Node *) linitial(stmt->valuesLists));
+	pgnq_walk_push(walk, (Node *) stmt->sortClause);
+	pgnq_walk_push(walk, stmt->limitOffset);
+	pgnq_walk_push(walk, stmt->limitCount);
+	pgnq_walk_push(walk, (Node *) stmt->lockingClause);
+	pgnq_walk_push(walk, (Node *) stmt->withClause);
+	pgnq_walk_reverse(walk, first);
+
+	return true;
+}
+
+/*
+ * Queue a child of the node being visited, if there's one
+ */
+static void
+pgnq_walk_push(pgnqWalkState *walk, Node *node)
+{
+	if (node == NULL)
+		return;
+
+	if (walk->items_count >= walk->items_size)
+	{
+		walk->items_size *= 2;
+		walk->items = repalloc(walk->items,
+							   walk->items_size * sizeof(pgnqWalkItem));
+	}
+
+	walk->items[walk->items_count].node = node;
+	walk->items[walk->items_count].depth = walk->depth + 1;
+	walk->items_count++;
+}
+
+/*
+ * raw_expression_tree_walker() callback queueing each child instead of
+ * visiting it
+ */
+static bool
+pgnq_walk_push_walker(Node *node, void *context)
+{
+	pgnq_walk_push((pgnqWalkState *) context, node);
+
+	return false;
+}
+
+/*
+ * Reverse the nodes queued from position first on, so that they're popped in
+ * the order they were pushed, which is the order they appear in the query
+ */
+static void
+pgnq_walk_reverse(pgnqWalkState *walk, int first)
+{
+	int			last = walk->items_count - 1;
+
+	while (first < last)
+	{
+		pgnqWalkItem tmp = walk->items[first];
+
+		walk->items[first++] = walk->items[last];
+		walk->items[last--] = tmp;
+	}
+}
+
+/*
+ * Walk a raw parse tree, recording the locations of constants in jstate.
+ *
+ * The nodes still to visit are kept on an explicit stack rather than
+ * recursing, so huge generated statements don't run out of C stack: only
+ * the parser's own limits apply.  When profiling, also keep track of how deep
+ * the tree goes.
+ */
+bool
+pgnq_const_record_walker(Node *node, pgnqConstLocations *jstate)
+{
+	pgnqWalkState walk;
+
+	if (node == NULL)
+		return false;
+
+	walk.jstate = jstate;
+	walk.items_size = 64;
+	walk.items = palloc(walk.items_size * sizeof(pgnqWalkItem));
+	walk.items_count = 0;
+	walk.depth = 0;
+
+	pgnq_walk_push(&walk, node);
+
+	while (walk.items_count > 0)
+	{
+		pgnqWalkItem *item = &walk.items[--walk.items_count];
+
+		walk.depth = item->depth;
+		if (jstate->profile != NULL)
+			jstate->profile->max_depth = Max(jstate->profile->max_depth,
+											 walk.depth);
+
+		pgnq_const_record_node(item->node, &walk);
+	}
+
+	pfree(walk.items);
+
+	return false;
+}
+
+/*
+ * Can raw_expression_tree_walker() visit the children of node?  It knows
+ * about the optimizable statements and the nodes making up expressions, and
+ * raises an error for anything else, like most utility statements.
+ */
+static bool
+pgnq_is_walkable_node(Node *node)
+{
+	switch (nodeTag(node))
+	{
+		case T_SetToDefault:
+		case T_CurrentOfExpr:
+		case T_SQLValueFunction:
+		case T_Integer:
+		case T_Float:
+		case T_String:
+		case T_BitString:
+		case T_Null:
+		case T_ParamRef:
+		case T_A_Const:
+		case T_A_Star:
+		case T_Alias:
+		case T_RangeVar:
+		case T_GroupingFunc:
+		case T_SubLink:
+		case T_CaseExpr:
+		case T_RowExpr:
+		case T_CoalesceExpr:
+		case T_MinMaxExpr:
+		case T_XmlExpr:
+		case T_NullTest:
+		case T_BooleanTest:
+		case T_JoinExpr:
+		case T_IntoClause:
+		case T_List:
+		case T_InsertStmt:
+		case T_DeleteStmt:
+		case T_UpdateStmt:
+		case T_SelectStmt:
+		case T_A_Expr:
+		case T_BoolExpr:
+		case T_ColumnRef:
+		case T_FuncCall:
+		case T_NamedArgExpr:
+		case T_A_Indices:
+		case T_A_Indirection:
+		case T_A_ArrayExpr:
+		case T_ResTarget:
+		case T_MultiAssignRef:
+		case T_TypeCast:
+		case T_CollateClause:
+		case T_SortBy:
+		case T_WindowDef:
+		case T_RangeSubselect:
+		case T_RangeFunction:
+		case T_RangeTableSample:
+		case T_RangeTableFunc:
+		case T_RangeTableFuncCol:
+		case T_TypeName:
+		case T_ColumnDef:
+		case T_IndexElem:
+		case T_GroupingSet:
+		case T_LockingClause:
+		case T_XmlSerialize:
+		case T_WithClause:
+		case T_InferClause:
+		case T_OnConflictClause:
+		case T_CommonTableExpr:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+/*
+ * Visit a single node for pgnq_const_record_walker(), queueing the children
+ * that need to be visited too
+ */
+static void
+pgnq_const_record_node(Node *node, pgnqWalkState *walk)
+{
+	pgnqConstLocations *jstate = walk->jstate;
+	Node	*nodeReturn = NULL;
+	int			first = walk->items_count;
+
+	switch (nodeTag(node))
+	{
+		case T_A_Const:
+			pgnq_record_const_location(jstate, castNode(A_Const, node)->location);
+			break;
+
+		case T_ParamRef:
+			if (((ParamRef *) node)->number > jstate->highest_extern_param_id)
+				jstate->highest_extern_param_id = castNode(ParamRef, node)->number;
+			break;
+
+		case T_A_Expr:
+			{
+				A_Expr	   *expr = (A_Expr *) node;
+				List	   *list = (List *) expr->rexpr;
+
+				if ((jstate->options & PGNQ_OPT_COLLAPSE_LISTS) == 0 ||
+					expr->kind != AEXPR_IN ||
+					!pgnq_is_collapsible_list(expr->rexpr))
+					break;
+
+				pgnq_const_record_list_params(list, jstate);
+				pgnq_record_collapsed_location(jstate, PGNQ_LOC_LIST,
+											   pgnq_list_element_location(list, 0),
+											   pgnq_list_element_location(list,
+																		  list_length(list) - 1));
+				pgnq_walk_push(walk, expr->lexpr);
+				return;
+			}
+
+		case T_InsertStmt:
+		case T_UpdateStmt:
+		case T_DeleteStmt:
+			break;
+
+		case T_SelectStmt:
+			if ((jstate->options & PGNQ_OPT_COLLAPSE_LISTS) != 0 &&
+				list_length(((SelectStmt *) node)->valuesLists) > 1 &&
+				pgnq_collapse_values_lists((SelectStmt *) node, walk))
+				return;
+			break;
+
+		case T_DefElem:
+			nodeReturn = (Node *) ((DefElem *) node)->arg;
+			break;
+
+#if PG_VERSION_NUM >= 100000
+		case T_RawStmt:
+			nodeReturn = (Node *) ((RawStmt *) node)->stmt;
+			break;
+#endif
+
+		case T_VariableSetStmt:
+			nodeReturn = (Node *) ((VariableSetStmt *) node)->args;
+			break;
+
+		case T_CopyStmt:
+			nodeReturn = (Node *) ((CopyStmt *) node)->query;
+			break;
+
+		case T_ExplainStmt:
+			nodeReturn = (Node *) ((ExplainStmt *) node)->query;
+			break;
+
+		case T_AlterRoleStmt:
+			nodeReturn = (Node *) ((AlterRoleStmt *) node)->options;
+			break;
+
+		case T_DeclareCursorStmt:
+			nodeReturn = (Node *) ((DeclareCursorStmt *) node)->query;
+			break;
+
+		case T_PrepareStmt:
+			nodeReturn = (Node *) ((PrepareStmt *) node)->query;
+			break;
+
+		case T_ViewStmt:
+			nodeReturn = (Node *) ((ViewStmt *) node)->query;
+			break;
+
+		case T_CreateTableAsStmt:
+			nodeReturn = (Node *) ((CreateTableAsStmt *) node)->query;
+			break;
+
+		case T_RuleStmt:
+			pgnq_walk_push(walk, ((RuleStmt *) node)->whereClause);
+			pgnq_walk_push(walk, (Node *) ((RuleStmt *) node)->actions);
+			pgnq_walk_reverse(walk, first);
+			return;
+
+		default:
+			/* Leave the constants of any other utility statement alone */
+			if (!pgnq_is_walkable_node(node))
+				return;
+			break;
+	}
+
+	if (nodeReturn != NULL)
+	{
+		pgnq_walk_push(walk, nodeReturn);
+		return;
+	}
+
+	(void) raw_expression_tree_walker(node, pgnq_walk_push_walker, (void *) walk);
+	pgnq_walk_reverse(walk, first);
+}
+
+/*
+ * Find the statement text in the message of a log entry written by
+ * log_statement or log_min_duration_statement, e.g. "statement: ...",
+ * "execute <unnamed>: ..." or "duration: 1.234 ms  statement: ...".  The
+ * duration is returned too when there is one.  Returns NULL if the message
+ * is about something else.
+ */
+char *
+pgnq_log_statement(char *message, double *duration, bool *has_duration)
+{
+	char	   *p = message;
+
+	*duration = 0;
+	*has_duration = false;
+
+	if (strncmp(p, "duration: ", strlen("duration: ")) == 0)
+	{
+		char	   *end;
+
+		p += strlen("duration: ");
+		*duration = strtod(p, &end);
+		if (end == p || strncmp(end, " ms", strlen(" ms")) != 0)
+			return NULL;
+		*has_duration = true;
+
+		p = end + strlen(" ms");
+		while (*p == ' ')
+			p++;
+	}
+
+	if (strncmp(p, "statement: ", strlen("statement: ")) == 0)
+		return p + strlen("statement: ");
+
+	/* Extended protocol ones are followed by the statement or portal name */
+	if (strncmp(p, "execute ", strlen("execute ")) == 0)
+	{
+		p = strstr(p, ": ");
+		if (p != NULL)
+			return p + strlen(": ");
+	}
+
+	return NULL;
+}
+
+#ifdef PGNQ_LIBRARY
+/*
+ * Defined by the server's main.o, which programs can't be linked with as it
+ * has a main() of its own
+ */
+const char *progname = "libpgnq";
+
+/*
+ * Entry point of libpgnq, for programs that link the server's parser to
+ * normalize queries outside of a server, e.g. while shipping logs.
+ *
+ * query is normalized with the given PGNQ_OPT_* options in a memory context
+ * of its own, deleted before returning, so that calls leave nothing behind
+ * and don't depend on each other.  The result is malloc'd, for the caller
+ * to free.  If query can't be normalized, NULL is returned and *error is set
+ * to a malloc'd copy of the error message.
+ *
+ * The parser keeps some state in global variables, like the server does, so
+ * calls must not run in several threads at once.
+ */
+char *
+pgnq_normalize_string(const char *query, int options, char **error)
+{
+	MemoryContext context;
+	MemoryContext oldcontext;
+	char	   *volatile result = NULL;
+
+	*error = NULL;
+
+	/* Set up the memory context machinery on the first call */
+	if (TopMemoryContext == NULL)
+		MemoryContextInit();
+
+	context = AllocSetContextCreate(TopMemoryContext,
+									"pgnq_normalize_string",
+									ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(context);
+
+	PG_TRY();
+	{
+		pgnqConstLocations jstate;
+		List	   *tree;
+		text	   *out;
+		int			len;
+
+		pgnq_init_const_locations(&jstate, options);
+		tree = raw_parser(query);
+		pgnq_const_record_walker((Node *) tree, &jstate);
+		pgnq_fill_in_constant_lengths(&jstate, query, 0);
+		out = pgnq_build_normalized_text(&jstate, query, 0, (int) strlen(query));
+
+		len = VARSIZE(out) - VARHDRSZ;
+		result = malloc(len + 1);
+		if (result == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory")));
+		memcpy(result, VARDATA(out), len);
+		result[len] = '\0';
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(context);
+		edata = CopyErrorData();
+		FlushErrorState();
+		*error = strdup(edata->message);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(context);
+
+	return result;
+}
+#endif
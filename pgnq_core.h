@@ -0,0 +1,130 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgnq_core.h
+ *	  Normalization core of pg_normalize_query: finding the constants of a
+ *	  raw parse tree and building the normalized text.
+ *
+ * It only depends on the server's parser and support code, so it is also
+ * built as libpgnq, to normalize queries outside of the server.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGNQ_CORE_H
+#define PGNQ_CORE_H
+
+#include "nodes/nodes.h"
+#include "parser/scanner.h"
+#include "portability/instr_time.h"
+
+/* Define scanner_init parameters following the PostgreSQL versions */
+#if PG_VERSION_NUM >= 120000
+#define PGNQ_SCANNER_INIT_ARGS query, &yyextra, &ScanKeywords, ScanKeywordTokens
+#else
+#define PGNQ_SCANNER_INIT_ARGS query, &yyextra, ScanKeywords, NumScanKeywords
+#endif
+
+/*
+ * Normalization options, set from GUCs
+ */
+#define PGNQ_OPT_COLLAPSE_LISTS		0x0001	/* collapse lists of constants */
+#define PGNQ_OPT_CANONICAL_SPACE	0x0002	/* canonicalize whitespace */
+#define PGNQ_OPT_FOLD_CASE			0x0004	/* fold keyword and name case */
+
+/* Options that need the query to be lexed again while it is built */
+#define PGNQ_OPT_TOKEN_BUILD		(PGNQ_OPT_CANONICAL_SPACE | PGNQ_OPT_FOLD_CASE)
+
+/* Text emitted after the placeholder of a collapsed list */
+#define PGNQ_COLLAPSED_SUFFIX		" /*, ... */"
+
+/* Zero-based positions of the csvlog fields with the statements */
+#define PGNQ_CSVLOG_SEVERITY	11
+#define PGNQ_CSVLOG_MESSAGE		13
+
+/*
+ * Kinds of text spans replaced during normalization
+ */
+typedef enum pgnqLocationKind
+{
+	PGNQ_LOC_CONST,				/* a constant, replaced by $n */
+	PGNQ_LOC_LIST,				/* elements of an IN list, replaced by $n and
+								 * PGNQ_COLLAPSED_SUFFIX */
+	PGNQ_LOC_ROWS				/* VALUES rows after the first one, replaced
+								 * by PGNQ_COLLAPSED_SUFFIX */
+} pgnqLocationKind;
+
+/*
+ * Struct for tracking locations/lengths of constants during normalization
+ */
+typedef struct pgnqLocationLen
+{
+	int			location;		/* start offset in query text */
+	int			length;			/* length in bytes, or -1 to ignore */
+	pgnqLocationKind kind;		/* what the span holds */
+	int			squash_end;		/* start offset of the last element of a
+								 * collapsed list, else -1 */
+} pgnqLocationLen;
+
+/*
+ * Details of a single normalization collected for
+ * pg_normalize_query_profile()
+ */
+typedef struct pgnqProfile
+{
+	int			max_depth;		/* deepest parse tree node visited */
+	int64		tokens;			/* tokens lexed to find the constants */
+	int64		duplicates;		/* duplicate constant locations skipped */
+	double		sort_time;		/* msec spent sorting the locations */
+	double		rescan_time;	/* msec spent lexing to find the constants */
+} pgnqProfile;
+
+/*
+ * Working state for constant tree walker
+ */
+typedef struct pgnqConstLocations
+{
+	/* Array of locations of constants that should be removed */
+	pgnqLocationLen *clocations;
+
+	/* Allocated length of clocations array */
+	int			clocations_buf_size;
+
+	/* Current number of valid entries in clocations array */
+	int			clocations_count;
+
+	/* highest Param id we've seen, in order to start normalization correctly */
+	int			highest_extern_param_id;
+
+	/* PGNQ_OPT_* flags in effect */
+	int			options;
+
+	/* Times clocations was enlarged and not yet counted in the stats */
+	int			clocations_growths;
+
+	/* Where to collect profiling details, or NULL */
+	pgnqProfile *profile;
+} pgnqConstLocations;
+
+extern void pgnq_init_const_locations(pgnqConstLocations *jstate, int options);
+extern void pgnq_profile_lap(instr_time *lap, double *elapsed);
+extern int	pgnq_scanned_constant_length(core_yy_extra_type *yyextra, int loc);
+extern void pgnq_sort_const_locations(pgnqConstLocations *jstate);
+extern int	pgnq_lex_to_location(core_yyscan_t yyscanner, core_YYSTYPE *yylval,
+								 YYLTYPE *yylloc, const char *query, int loc,
+								 int *prev_locs, int64 *ntokens);
+extern void pgnq_fill_in_constant_lengths(pgnqConstLocations *jstate, const char *query,
+										  int query_loc);
+extern int	pgnq_normalized_query_len(pgnqConstLocations *jstate, int query_len);
+extern int	pgnq_build_normalized_query(pgnqConstLocations *jstate, const char *query,
+										int query_loc, int query_len, char *norm_query);
+extern text *pgnq_build_normalized_text(pgnqConstLocations *jstate, const char *query,
+										int query_loc, int query_len);
+extern void pgnq_record_const_location(pgnqConstLocations *jstate, int location);
+extern bool pgnq_const_record_walker(Node *node, pgnqConstLocations *jstate);
+extern char *pgnq_log_statement(char *message, double *duration,
+								bool *has_duration);
+
+#ifdef PGNQ_LIBRARY
+extern char *pgnq_normalize_string(const char *query, int options, char **error);
+#endif
+
+#endif							/* PGNQ_CORE_H */
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgnq_example.c
+ *	  Smallest program using libpgnq: prints each query given as argument
+ *	  normalized, with lists of constants collapsed.  Run by "make check".
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pgnq_core.h"
+
+int
+main(int argc, char **argv)
+{
+	int			i;
+
+	for (i = 1; i < argc; i++)
+	{
+		char	   *normalized;
+		char	   *error;
+
+		normalized = pgnq_normalize_string(argv[i], PGNQ_OPT_COLLAPSE_LISTS,
+										   &error);
+		if (normalized == NULL)
+		{
+			fprintf(stderr, "pgnq_example: %s\n", error);
+			free(error);
+			return 1;
+		}
+
+		printf("%s\n", normalized);
+		free(normalized);
+	}
+
+	return 0;
+}
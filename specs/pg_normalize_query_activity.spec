@@ -0,0 +1,24 @@
+# Like pg_stat_activity, pg_normalized_activity shows neither the state nor
+# the query of sessions the user can't see.
+
+setup
+{
+	CREATE EXTENSION pg_normalize_query;
+	CREATE ROLE regress_pgnq_user;
+}
+
+teardown
+{
+	DROP EXTENSION pg_normalize_query;
+	DROP ROLE regress_pgnq_user;
+}
+
+session "s1"
+step "s1_name"		{ SET application_name = 'pgnq_s1'; }
+
+session "s2"
+setup				{ SET ROLE regress_pgnq_user; }
+step "s2_activity"	{ SELECT a.state, a.query FROM pg_normalized_activity a JOIN pg_stat_activity s USING (pid) WHERE s.application_name = 'pgnq_s1'; }
+teardown			{ RESET ROLE; }
+
+permutation "s1_name" "s2_activity"
@@ -0,0 +1,25 @@
+# Two sessions interning the same new query get the same ID, also when the
+# first one adds it in a transaction it then rolls back.
+
+setup
+{
+	CREATE EXTENSION pg_normalize_query;
+}
+
+teardown
+{
+	DROP EXTENSION pg_normalize_query;
+}
+
+session "s1"
+step "s1_begin"		{ BEGIN; }
+step "s1_intern"	{ SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id = 1') AS id; }
+step "s1_commit"	{ COMMIT; }
+step "s1_rollback"	{ ROLLBACK; }
+
+session "s2"
+step "s2_intern"	{ SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id = 2') AS id; }
+step "s2_dictionary"	{ SELECT id, query FROM pg_normalize_query_dictionary ORDER BY id; }
+
+permutation "s1_begin" "s1_intern" "s2_intern" "s1_commit" "s2_dictionary"
+permutation "s1_begin" "s1_intern" "s2_intern" "s1_rollback" "s1_intern" "s2_dictionary"
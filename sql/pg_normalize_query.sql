@@ -13,3 +13,295 @@ SELECT pg_normalize_query('SELECT * FROM pg_attribute WHERE attname = $$relkind$
 SELECT pg_normalize_query($$UPDATE foo SET f1=now(), f2='xxx', f3=current_timestamp WHERE id=1 AND f1 > now() - interval '1 day'$$);
 SELECT pg_normalize_query($$DELETE FROM foo WHERE id IN (SELECT id FROM bar WHERE f1 <= now() - '1 week'::interval)$$);
 SELECT pg_normalize_query($$SELECT * FROM foo WHERE$$); -- Should fail due to syntax error
+-- Backend-local cache
+SET pg_normalize_query.cache_size = '64kB';
+SELECT pg_normalize_query_cache_reset();
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE id = 42$$);
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE id = 42$$);
+SELECT hits, misses, evictions, entries FROM pg_normalize_query_cache_stats();
+RESET pg_normalize_query.cache_size;
+SELECT entries, memory FROM pg_normalize_query_cache_stats();
+-- Batch API
+SELECT pg_normalize_queries(ARRAY['SELECT 1', NULL, $$SELECT 'a' || 'b'$$]);
+SELECT pg_normalize_queries('{}');
+-- Fingerprints
+SELECT pg_normalize_query_fingerprint($$SELECT * FROM foo WHERE id = 1$$) =
+       pg_normalize_query_fingerprint($$select *
+  from foo /* comment */ where id=-42$$) AS same;
+SELECT pg_normalize_query_fingerprint($$SELECT a FROM foo$$) =
+       pg_normalize_query_fingerprint($$SELECT "select" FROM foo$$) AS same;
+SELECT pg_normalize_query_fingerprint($$SELECT * FROM foo WHERE id = 1$$) =
+       pg_normalize_query_fingerprint($$SELECT * FROM foo WHERE id = $1$$) AS same;
+-- Lexer-only normalization
+SELECT pg_normalize_query_fast($$SELECT * FROM foo WHERE a = -1 AND b = 'x' AND c = current_date - 7 AND d = $1$$);
+SELECT pg_normalize_query($$SELECT NULL, -1$$), pg_normalize_query_fast($$SELECT NULL, -1$$);
+SELECT pg_normalize_query_fast($$SELECT * FROM foo WHERE x = 1 AND$$);
+-- Collapsed lists
+SET pg_normalize_query.collapse_lists = on;
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE id IN (1, 2, 3) AND x NOT IN (-1, $1)$$);
+SELECT pg_normalize_query($$INSERT INTO foo VALUES (1, 'a'), (2, 'b'), (3, 'c') RETURNING id$$);
+SELECT * FROM pg_normalize_query_params($$INSERT INTO foo VALUES (1, 'a'), (2, 'b') RETURNING id, 4$$);
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE id IN (1, 2) OR id IN (SELECT 1)$$);
+SELECT pg_normalize_query_fingerprint($$SELECT * FROM foo WHERE id IN (1, 2)$$) =
+       pg_normalize_query_fingerprint($$SELECT * FROM foo WHERE id IN (3, 4, 5, 6)$$) AS same;
+SET pg_normalize_query.cache_size = '64kB';
+SELECT pg_normalize_query($$SELECT 1 IN (1, 2)$$);
+RESET pg_normalize_query.collapse_lists;
+SELECT pg_normalize_query($$SELECT 1 IN (1, 2)$$);
+-- Only functions the settings leave alone can be IMMUTABLE
+SELECT oid::regprocedure AS function FROM pg_proc WHERE proname LIKE 'pg\_%normalize%' AND provolatile = 'i';
+RESET pg_normalize_query.cache_size;
+-- Multi-statement input
+SELECT * FROM pg_normalize_query_statements($$SELECT 1;
+  UPDATE foo SET a = 'x' WHERE id = $1 ;SELECT 'a', 2
+$$) WITH ORDINALITY;
+SELECT * FROM pg_normalize_query_statements('');
+-- Error-tolerant normalization
+SELECT pg_try_normalize_query($$SELECT * FROM foo WHERE id = 1$$);
+SELECT pg_try_normalize_query($$SELECT * FROM foo WHERE$$) IS NULL AS failed;
+SELECT pg_try_normalize_query($$SELECT * FROM foo WHERE id = 1 AND$$, true);
+SELECT pg_try_normalize_query($$SELECT * FROM foo WHERE id = 1 AND name='abc$$, true);
+SELECT pg_normalize_query($$BEGIN$$) AS begin, pg_normalize_query($$CREATE TABLE foo (a int DEFAULT 1)$$) AS create;
+SELECT pg_normalize_query(q) FROM unnest(ARRAY[$$PREPARE p (int) AS SELECT * FROM foo WHERE id = $1 AND a = 2$$,
+  $$CREATE VIEW v AS SELECT * FROM foo WHERE a = 1$$, $$CREATE TABLE t2 AS SELECT 1 AS x$$,
+  $$DECLARE c CURSOR FOR SELECT 'a'$$,
+  $$CREATE RULE r AS ON DELETE TO foo DO INSTEAD UPDATE foo SET a = 0 WHERE id = OLD.id$$]) q;
+-- Log files
+SELECT * FROM pg_normalize_log_file('nonexistent.csv');
+SELECT * FROM pg_normalize_log_file('nonexistent.log', 'syslog');
+SELECT setting AS datadir FROM pg_settings WHERE name = 'data_directory' \gset
+\set pgnq_log :datadir/pgnq_test.log
+COPY (VALUES
+  ($$2024-01-01 10:00:00.000 UTC,"postgres","regression",123,"[local]",659280f0.7b,1,"SELECT",2024-01-01 10:00:00 UTC,3/2,0,LOG,00000,"statement: SELECT * FROM foo WHERE id = 1",,,,,,,,,"psql","client backend",,0$$),
+  ($$2024-01-01 10:00:00.000 UTC,"postgres","regression",123,"[local]",659280f0.7b,2,"SELECT",2024-01-01 10:00:00 UTC,3/3,0,LOG,00000,"duration: 1.500 ms  statement: SELECT 'a,""b""'$$),
+  ($$  FROM foo",,,,,,,,,"psql","client backend",,0$$),
+  ($$2024-01-01 10:00:00.000 UTC,"postgres","regression",123,"[local]",659280f0.7b,3,"SELECT",2024-01-01 10:00:00 UTC,3/4,0,ERROR,42601,"syntax error at end of input",,,,,,"SELECT * FROM",14,,"psql","client backend",,0$$),
+  ($$2024-01-01 10:00:00.000 UTC,"postgres","regression",123,"[local]",659280f0.7b,4,"idle",2024-01-01 10:00:00 UTC,,0,LOG,00000,"checkpoint starting: time",,,,,,,,,"","checkpointer",,0$$)
+) TO :'pgnq_log' (FORMAT csv, QUOTE E'\x01', DELIMITER E'\x02');
+SELECT replace(query, E'\n', ' ') AS query, duration FROM pg_normalize_log_file(:'pgnq_log');
+COPY (VALUES
+  ($$2024-01-01 10:00:00.000 UTC [123] LOG:  statement: SELECT * FROM foo WHERE id = 1$$),
+  ($$2024-01-01 10:00:01.000 UTC [123] LOG:  duration: 0.250 ms  statement: SELECT 'x'$$),
+  (E'\t  FROM foo'),
+  ($$2024-01-01 10:00:02.000 UTC [123] ERROR:  relation "bar" does not exist at character 15$$),
+  ($$2024-01-01 10:00:02.000 UTC [123] STATEMENT:  SELECT * FROM bar$$),
+  ($$2024-01-01 10:00:03.000 UTC [123] LOG:  execute <unnamed>: SELECT * FROM foo WHERE id = $1$$),
+  ($$2024-01-01 10:00:03.000 UTC [123] DETAIL:  parameters: $1 = '5'$$)
+) TO :'pgnq_log' (FORMAT csv, QUOTE E'\x01', DELIMITER E'\x02');
+SELECT replace(query, E'\n', ' ') AS query, duration FROM pg_normalize_log_file(:'pgnq_log', 'stderr');
+COPY (VALUES
+  ($${"timestamp":"2024-01-01 10:00:00.000 UTC","pid":123,"error_severity":"LOG","message":"duration: 2.000 ms  statement: SELECT \"a\" FROM foo WHERE b = 'x'\n  AND c = 2","backend_type":"client backend"}$$),
+  ($${"timestamp":"2024-01-01 10:00:01.000 UTC","pid":123,"error_severity":"ERROR","state_code":"42601","message":"syntax error at end of input","statement":"SELECT * FROM"}$$),
+  ($${"timestamp":"2024-01-01 10:00:02.000 UTC","pid":123,"error_severity":"LOG","message":"statement: SELECT 1"}$$)
+) TO :'pgnq_log' (FORMAT csv, QUOTE E'\x01', DELIMITER E'\x02');
+SELECT replace(query, E'\n', ' ') AS query, duration FROM pg_normalize_log_file(:'pgnq_log', 'jsonlog');
+CREATE ROLE regress_pgnq_user;
+GRANT EXECUTE ON FUNCTION pg_normalize_log_file(text, text) TO regress_pgnq_user;
+SET ROLE regress_pgnq_user;
+SELECT count(*) FROM pg_normalize_log_file(:'pgnq_log', 'jsonlog'); -- Under the data directory
+SELECT * FROM pg_normalize_log_file('/etc/passwd');
+SELECT * FROM pg_normalize_log_file('log/../../postgresql.log');
+RESET ROLE;
+DROP OWNED BY regress_pgnq_user;
+DROP ROLE regress_pgnq_user;
+SELECT proparallel FROM pg_proc WHERE proname = 'pg_normalize_log_file';
+-- Parallel normalization
+SELECT proparallel FROM pg_proc WHERE proname = 'pg_normalize_query';
+CREATE TABLE pgnq_queries (q text);
+INSERT INTO pgnq_queries SELECT format('SELECT * FROM foo WHERE id = %s', i) FROM generate_series(1, 1000) i;
+INSERT INTO pgnq_queries VALUES (NULL), ('SELECT * FROM foo WHERE');
+SELECT pg_normalize_query_parallel, count(*) FROM pg_normalize_query_parallel('pgnq_queries', 'q', 2) GROUP BY 1 ORDER BY 1;
+SELECT * FROM pg_normalize_query_parallel('pgnq_queries', 'nope');
+BEGIN;
+INSERT INTO pgnq_queries VALUES ('SELECT 1');
+SELECT * FROM pg_normalize_query_parallel('pgnq_queries', 'q', 2);
+ROLLBACK;
+BEGIN;
+LOCK TABLE pgnq_queries IN SHARE MODE;
+SELECT * FROM pg_normalize_query_parallel('pgnq_queries', 'q', 2);
+ROLLBACK;
+CREATE TEMP TABLE pgnq_temp_queries (q text);
+SELECT * FROM pg_normalize_query_parallel('pgnq_temp_queries', 'q', 2);
+DROP TABLE pgnq_temp_queries;
+SET pg_normalize_query.collapse_lists = on;
+SET pg_normalize_query.fold_case = on;
+TRUNCATE pgnq_queries;
+INSERT INTO pgnq_queries SELECT format('select * from foo where id in (%s, %s)', i, i + 1) FROM generate_series(1, 1000) i;
+SELECT pg_normalize_query_parallel, count(*) FROM pg_normalize_query_parallel('pgnq_queries', 'q', 2) GROUP BY 1;
+RESET pg_normalize_query.collapse_lists;
+RESET pg_normalize_query.fold_case;
+DROP TABLE pgnq_queries;
+-- Normalized server log
+SET pg_normalize_query.log_normalize = on;
+SET client_min_messages = log;
+SET log_statement = 'all';
+SELECT 1 AS one, 'abc' AS two;
+DO $$BEGIN RAISE LOG 'statement: SELECT * FROM'; END$$;
+SHOW escape_string_warning;
+RESET log_statement;
+RESET client_min_messages;
+RESET pg_normalize_query.log_normalize;
+-- Captured queries
+SELECT * FROM pg_normalized_queries;
+-- Benchmark function
+SELECT calls, ns_per_call > 0 AS timed, bytes_per_call > 0 AS measured
+  FROM pg_normalize_query_bench($$SELECT * FROM foo WHERE id = 1$$, 10);
+SELECT calls FROM pg_normalize_query_bench($$SELECT 'a'$$, 10, true);
+SELECT * FROM pg_normalize_query_bench($$SELECT 1$$, 0);
+-- Statistics
+SELECT pg_normalize_query_stats_reset();
+SET pg_normalize_query.track_timing = on;
+SELECT pg_normalize_query($$SELECT 1, 2, 3$$);
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE id IN ($$ || (SELECT string_agg(i::text, ', ') FROM generate_series(1, 100) i) || ')') IS NOT NULL AS normalized;
+RESET pg_normalize_query.track_timing;
+SELECT calls, total_bytes, max_bytes, constants, clocations_growths, parse_time > 0 AS timed
+  FROM pg_normalize_query_stats WHERE scope = 'backend';
+-- Profiling
+SELECT normalized, query_bytes, constants, duplicates, tokens, max_depth > 0 AS walked,
+       peak_memory > 0 AS measured, parse_time >= 0 AND build_time >= 0 AS timed
+  FROM pg_normalize_query_profile($$SELECT * FROM foo WHERE id = 1 AND name = 'x'$$);
+SET pg_normalize_query.canonicalize_whitespace = on;
+SELECT normalized, peak_memory > 200000 AS peak
+  FROM pg_normalize_query_profile('SELECT 1 /*' || repeat('x', 100000) || '*/');
+RESET pg_normalize_query.canonicalize_whitespace;
+SELECT (SELECT max_depth FROM pg_normalize_query_profile($$SELECT 1 + (2 + (3 + 4))$$)) >
+       (SELECT max_depth FROM pg_normalize_query_profile($$SELECT 1 + 2$$)) AS deeper;
+-- Whitespace canonicalization
+SET pg_normalize_query.canonicalize_whitespace = on;
+SELECT pg_normalize_query($$  SELECT  "a  b",   /* note */ 'x'
+  FROM  foo -- end$$);
+SELECT pg_normalize_query_fast($$  SELECT  "a  b",   /* note */ 'x'
+  FROM  foo -- end$$);
+RESET pg_normalize_query.canonicalize_whitespace;
+-- Case folding
+PREPARE pgnq_folded AS SELECT pg_normalize_query($$select 1$$);
+EXECUTE pgnq_folded;
+SET pg_normalize_query.fold_case = on;
+EXECUTE pgnq_folded; -- Not folded into the plan
+DEALLOCATE pgnq_folded;
+SELECT pg_normalize_query($$select Id, "Name" from Foo f Where f.ID = 1$$);
+SELECT pg_normalize_query_fast($$Select count(*) AS Total FROM PUBLIC.foo$$);
+RESET pg_normalize_query.fold_case;
+-- normalized_query type
+CREATE TABLE pgnq_typed (q normalized_query);
+INSERT INTO pgnq_typed SELECT pg_normalize_query(format('SELECT * FROM foo WHERE id = %s', i)) FROM generate_series(1, 3) i;
+INSERT INTO pgnq_typed VALUES ('SELECT $1');
+SELECT q, count(*) FROM pgnq_typed GROUP BY q ORDER BY 2 DESC;
+SET enable_hashagg = off;
+SELECT count(DISTINCT q) FROM pgnq_typed;
+RESET enable_hashagg;
+SELECT count(*) FROM pgnq_typed a JOIN pgnq_typed b USING (q);
+SELECT pg_normalize_query($$SELECT 2$$)::normalized_query = 'SELECT $1' AS same,
+       'SELECT $1'::normalized_query <> 'SELECT $2' AS different;
+SELECT typcollation FROM pg_type WHERE typname = 'normalized_query';
+DROP TABLE pgnq_typed;
+-- Constants extraction
+SELECT * FROM pg_normalize_query_params($$SELECT * FROM foo WHERE id = $1 AND name = 'x' AND v IN (1, -2)$$);
+SELECT params FROM pg_normalize_query_params($$SELECT a FROM b$$);
+-- Activity
+SELECT state, query FROM pg_normalized_activity WHERE pid = pg_backend_pid() AND state <> 'idle';
+-- Query IDs
+CREATE TABLE pgnq_qid (id integer, name text);
+SELECT pg_normalize_query_queryid($$SELECT * FROM pgnq_qid WHERE id = 1$$) =
+       pg_normalize_query_queryid($$select * from pgnq_qid where id = 42$$) AS same,
+       pg_normalize_query_queryid($$SELECT * FROM pgnq_qid WHERE id = 1$$) <>
+       pg_normalize_query_queryid($$SELECT * FROM pgnq_qid WHERE name = 'x'$$) AS different,
+       pg_normalize_query_queryid($$VACUUM pgnq_qid$$) <>
+       pg_normalize_query_queryid($$VACUUM  pgnq_qid$$) AS utility_by_text;
+SELECT pg_normalize_query_queryid($$EXECUTE foo$$) IS NULL AS untracked;
+SELECT pg_normalize_query_queryid($$SELECT 1; SELECT 2$$);
+DROP TABLE pgnq_qid;
+-- Deep statements
+SELECT pg_normalize_query('SELECT ' || repeat('1 + (', 2000) || '1' || repeat(')', 2000)) =
+       'SELECT ' || (SELECT string_agg(format('$%s + (', i), '' ORDER BY i) FROM generate_series(1, 2000) i) ||
+       '$2001' || repeat(')', 2000) AS deep;
+SELECT max_depth > 2000 AS deeper
+  FROM pg_normalize_query_profile('SELECT ' || repeat('1 + (', 2000) || '1' || repeat(')', 2000));
+SELECT pg_normalize_query('SELECT * FROM foo WHERE ' || (SELECT string_agg(format('a = %s', i), ' OR ') FROM generate_series(1, 1000) i)) =
+       'SELECT * FROM foo WHERE ' || (SELECT string_agg(format('a = $%s', i), ' OR ' ORDER BY i) FROM generate_series(1, 1000) i) AS ordered;
+-- Pre-filter
+SET pg_normalize_query.prefilter = on;
+SELECT pg_normalize_query($$SELECT * FROM foo WHERE$$); -- Not parsed, so no syntax error
+SELECT pg_normalize_query_fast($$SELECT now() FROM foo WHERE id = $1$$);
+SELECT pg_normalize_queries(ARRAY['COMMIT', 'SELECT NULL FROM foo', 'SELECT t1.a FROM t1']);
+RESET pg_normalize_query.prefilter;
+-- Aggregation
+CREATE TABLE pgnq_log (q text, dur double precision);
+INSERT INTO pgnq_log VALUES ('select * from foo where id = 5', 3), ('SELECT * FROM foo WHERE id = 1', 1), ('SELECT * FROM foo WHERE id = 2', 2),
+  ('SELECT * FROM foo WHERE id = 3', NULL), ('SELECT * FROM foo WHERE id = $1', 4),
+  ('SELECT 1', 0.5), (NULL, 10);
+SELECT g.* FROM (SELECT pg_normalize_query_agg(q, dur) AS groups FROM pgnq_log) s, unnest(s.groups) g;
+INSERT INTO pgnq_log SELECT format('SELECT * FROM foo WHERE id = %s', i), 1 FROM generate_series(1, 10000) i;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+EXPLAIN (COSTS OFF) SELECT pg_normalize_query_agg(q, dur) FROM pgnq_log;
+SELECT g.* FROM (SELECT pg_normalize_query_agg(q, dur) AS groups FROM pgnq_log) s, unnest(s.groups) g;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+SELECT pg_normalize_query_agg(q, dur) FROM pgnq_log WHERE false;
+DROP TABLE pgnq_log;
+-- Scripts
+SELECT * FROM pg_normalize_script(convert_to($$
+\connect regression
+-- Name: t; Type: TABLE
+CREATE TABLE t (a int, b text);
+COPY t (a, b) FROM stdin;
+1	semicolon; here
+2	'quoted
+\.
+SELECT 'a;b', 42 FROM t WHERE b = 'x';
+/* comment ; */ UPDATE t SET a = 1;
+CREATE RULE r AS ON INSERT TO t DO ALSO (INSERT INTO t VALUES (1, 'x'); INSERT INTO t VALUES (2, 'y'));
+-- only a comment
+;
+SELECT $x$;$x$ AS dollar
+$$, 'UTF8'));
+SELECT q = pg_normalize_query(s) AS same
+  FROM (SELECT 'SELECT ' || string_agg(i::text, ', ') AS s FROM generate_series(1, 5000) i) g,
+       pg_normalize_script(convert_to(s || '; ', 'UTF8')) q;
+CREATE TABLE pgnq_scripts (script bytea);
+ALTER TABLE pgnq_scripts ALTER script SET STORAGE EXTERNAL;
+INSERT INTO pgnq_scripts SELECT convert_to(repeat($$SELECT 1;
+INSERT INTO t VALUES ('x', 2);
+$$, 20000), 'UTF8');
+SELECT count(*), count(DISTINCT q) FROM pgnq_scripts, pg_normalize_script(script) q;
+SELECT lo_from_bytea(0, script) AS script_lo FROM pgnq_scripts \gset
+SELECT count(*), count(DISTINCT q) FROM pg_normalize_script(:script_lo) q;
+SELECT * FROM pg_normalize_script(:script_lo) LIMIT 2;
+SELECT lo_unlink(:script_lo);
+DROP TABLE pgnq_scripts;
+SELECT * FROM pg_normalize_script(convert_to('SELECT 1; SELECT ''oops', 'UTF8'));
+SELECT * FROM pg_normalize_script(0::oid);
+-- Dictionary
+SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id = 1') AS foo_id \gset
+SELECT pg_normalize_query_intern('select * from foo where id = 42') = :foo_id AS same,
+       pg_normalize_query_intern('SELECT 1') <> :foo_id AS other;
+SELECT pg_normalize_query_resolve(:foo_id);
+BEGIN;
+SELECT pg_normalize_query_intern('SELECT 2, 3') > 0 AS interned;
+ROLLBACK;
+SELECT pg_normalize_query_intern('SELECT 2, 3') AS rolled_back_id \gset
+SELECT pg_normalize_query_resolve(:rolled_back_id);
+SELECT query FROM pg_normalize_query_dictionary ORDER BY id;
+SELECT pg_normalize_query_resolve(-1) IS NULL AS unknown;
+SELECT pg_normalize_query_intern('SELECT * FROM');
+TRUNCATE pg_normalize_query_dictionary;
+SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id = 1') AS foo_id \gset
+SELECT pg_normalize_query_resolve(:foo_id);
+SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id = $1') = :foo_id AS same;
+DELETE FROM pg_normalize_query_dictionary;
+SELECT pg_normalize_query_resolve(pg_normalize_query_intern('SELECT * FROM foo WHERE id = 1'));
+-- Settings don't change what is interned
+SET pg_normalize_query.collapse_lists = on;
+SET pg_normalize_query.canonicalize_whitespace = on;
+SET pg_normalize_query.fold_case = on;
+SELECT pg_normalize_query_resolve(pg_normalize_query_intern('select  *  from foo where id in (1, 2)'));
+SELECT pg_normalize_query_intern('SELECT * FROM foo WHERE id IN (1, 2, 3)') <>
+       pg_normalize_query_intern('SELECT * FROM foo WHERE id IN (1, 2)') AS distinct_lists;
+RESET pg_normalize_query.collapse_lists;
+RESET pg_normalize_query.canonicalize_whitespace;
+RESET pg_normalize_query.fold_case;
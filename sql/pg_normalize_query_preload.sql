@@ -0,0 +1,27 @@
+CREATE EXTENSION pg_normalize_query;
+\set VERBOSITY terse
+-- Captured queries
+SELECT pg_normalized_queries_reset();
+CREATE TABLE foo (id integer, a text);
+SELECT * FROM foo WHERE id = 1;
+SELECT * FROM foo WHERE id = 2;
+UPDATE foo SET a = 'x' WHERE id = 1;
+SELECT * FROM foo WHERE id = 1 AND; -- Counted as a syntax error
+SELECT query, calls, syntax_errors FROM pg_normalized_queries WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database()) ORDER BY query COLLATE "C";
+SELECT pg_normalized_queries_reset();
+SELECT count(*) FROM pg_normalized_queries;
+DROP TABLE foo;
+-- Query IDs match those of pg_stat_statements
+CREATE EXTENSION pg_stat_statements;
+CREATE TABLE pgnq_qid (id integer, name text);
+SELECT pg_stat_statements_reset();
+SELECT * FROM pgnq_qid WHERE id = 1;
+UPDATE pgnq_qid SET name = 'x' WHERE id = 2;
+VACUUM pgnq_qid;
+SELECT l.query, s.query AS tracked_as
+  FROM (VALUES ($$SELECT * FROM pgnq_qid WHERE id = 42$$),
+               ($$UPDATE pgnq_qid SET name = 'y' WHERE id = 3$$),
+               ($$VACUUM pgnq_qid$$)) l(query)
+  LEFT JOIN pg_stat_statements s ON s.queryid = pg_normalize_query_queryid(l.query)
+  ORDER BY l.query COLLATE "C";
+DROP TABLE pgnq_qid;